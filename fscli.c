@@ -3,20 +3,47 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sched.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
 #include "mfs.h"
 #include "udp.h"
 #include "ufs.h"
 #include "message.h"
+#include "mfs_shm.h"
 
 #define BUFFER_SIZE (4192)
 
+#define TRANSPORT_UDP (0)
+#define TRANSPORT_SHM (1)
+#define TRANSPORT_UNIX (2)
+#define TRANSPORT_TCP (3)
+
+// frames on a TCP connection: 32-bit big-endian length, then the message
+#define TCP_FRAME_SIZE (sizeof(uint32_t) + sizeof(message))
+
+#define FAILOVER_TIMEOUTS (3) // timeouts in a row before the backup is tried
+
 int initialized = 0;
 char* host;
 int portNum;
 struct sockaddr_in addrSnd, addrRcv;
 int s_descriptor = -1;
 struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
+int transport = TRANSPORT_UDP;
+shm_ring_t *shm_ring = NULL;
+int tcp_lost = 0; // the TCP connection failed under a request
+char backup_host[256]; // MFS_Init("primary,backup[:port]"): the server of the pair not talked to, "" without one
+int backup_port;
+char serving_host[256]; // the one talked to, when there is a backup
+int pair_tcp = 0;       // the pair is talked to over TCP
+uint32_t seen_version = 0; // newest volume version in a reply from the server, see replicaCall
+int routing_shard = 0; // shard the request in sendToServer goes to, see shardCall
 
 // create a socket and bind it to a port on the current machine
 // used to listen for incoming packets
@@ -72,6 +99,28 @@ int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     return rc;
 }
 
+/**
+ * Lay a request out for sendmsg without staging its payload: the header
+ * fields, the payload, zero padding to the end of buf and the fields after
+ * it. The payload is param3 bytes of the caller's buffer when given,
+ * otherwise msg->buf. Returns the number of iov entries used (at most 4).
+ */
+int msgIov(message *msg, char *payload, struct iovec *iov) {
+    static const char zeros[MFS_BLOCK_SIZE];
+    size_t len = sizeof(msg->buf);
+    if (payload != NULL)
+        len = msg->param3 > 0 && msg->param3 <= MFS_BLOCK_SIZE ? msg->param3 : 0;
+    size_t tail = offsetof(message, buf) + sizeof(msg->buf);
+    int n = 0;
+    iov[n++] = (struct iovec){ .iov_base = msg, .iov_len = offsetof(message, buf) };
+    if (len > 0)
+        iov[n++] = (struct iovec){ .iov_base = payload != NULL ? payload : msg->buf, .iov_len = len };
+    if (len < sizeof(msg->buf))
+        iov[n++] = (struct iovec){ .iov_base = (void *)zeros, .iov_len = sizeof(msg->buf) - len };
+    iov[n++] = (struct iovec){ .iov_base = (char *)msg + tail, .iov_len = sizeof(message) - tail };
+    return n;
+}
+
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     int len = sizeof(struct sockaddr_in); 
     int rc = recvfrom(fd, buffer, n, 0, (struct sockaddr *) addr, (socklen_t *) &len);
@@ -83,16 +132,401 @@ int UDP_Close(int fd) {
     return close(fd);
 }
 
-int sendToServer(int sd, struct timeval tv, message forward_msg, message *received_msg, struct sockaddr_in addrSnd, struct sockaddr_in addrRcv)
+// the ring's server has shut down or is gone
+int shmDead()
+{
+    return __atomic_load_n(&shm_ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || SHM_Gone(shm_ring->server);
+}
+
+// take back a slot whose client died holding it. A slot in SHM_REQUEST is
+// left alone: the server still writes its reply.
+int shmReclaim(shm_slot_t *slot)
+{
+    int32_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+    uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == SHM_FREE || state == SHM_REQUEST || !SHM_Gone(owner))
+        return 0;
+    if (!__atomic_compare_exchange_n(&slot->owner, &owner, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    printf("client:: shm slot %d of dead client %d taken back\n", (int)(slot - shm_ring->slots), owner);
+    __atomic_store_n(&slot->state, SHM_CLAIMED, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// grab a free slot in the shared ring, waiting for one if all are in flight.
+// returns NULL after SHM_TIMEOUT seconds without one, or once the server is gone.
+shm_slot_t *shmClaim()
+{
+    time_t deadline = time(NULL) + SHM_TIMEOUT;
+    while (time(NULL) < deadline && !shmDead()) {
+        uint32_t released = __atomic_load_n(&shm_ring->released, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < SHM_SLOTS; i++) {
+            uint32_t expected = SHM_FREE;
+            shm_slot_t *slot = &shm_ring->slots[i];
+            if (__atomic_compare_exchange_n(&slot->state, &expected, SHM_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&slot->owner, getpid(), __ATOMIC_RELEASE);
+                return slot;
+            }
+        }
+        for (int i = 0; i < SHM_SLOTS; i++) {
+            if (shmReclaim(&shm_ring->slots[i]))
+                return &shm_ring->slots[i];
+        }
+        SHM_Wait(&shm_ring->released, released, 1);
+    }
+    printf("client:: no shm slot\n");
+    return NULL;
+}
+
+// publish the request in slot, wake the server and sleep until it answers.
+// the reply stays in slot->rep until the caller releases the slot. -1 when
+// no reply came within SHM_TIMEOUT seconds or the server is gone; the slot is
+// then left to the server, and to shmReclaim once this client exits.
+int shmSubmit(shm_slot_t *slot)
+{
+    __atomic_store_n(&slot->state, SHM_REQUEST, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shm_ring->doorbell, 1, __ATOMIC_RELEASE);
+    SHM_Wake(&shm_ring->doorbell, 1);
+    time_t deadline = time(NULL) + SHM_TIMEOUT;
+    while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SHM_REPLY) {
+        if (time(NULL) >= deadline || shmDead()) {
+            printf("client:: shm timeout\n");
+            return -1;
+        }
+        SHM_Wait(&slot->state, SHM_REQUEST, 1);
+    }
+    return slot->rep.msg_code;
+}
+
+void shmRelease(shm_slot_t *slot)
+{
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SHM_REQUEST)
+        return; // given up on by shmSubmit
+    __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->state, SHM_FREE, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shm_ring->released, 1, __ATOMIC_RELEASE);
+    SHM_Wake(&shm_ring->released, 1);
+}
+
+// round trip for requests without payload: only the header fields are copied
+int shmCall(message *forward_msg, char *payload, message *received_msg)
+{
+    shm_slot_t *slot = shmClaim();
+    if (slot == NULL) {
+        received_msg->msg_code = -1;
+        return -1;
+    }
+    memcpy(slot->req.msg, forward_msg->msg, sizeof(forward_msg->msg));
+    if (payload != NULL && forward_msg->param3 > 0 && forward_msg->param3 <= MFS_BLOCK_SIZE)
+        memcpy(slot->req.buf, payload, forward_msg->param3);
+    slot->req.param1 = forward_msg->param1;
+    slot->req.param2 = forward_msg->param2;
+    slot->req.param3 = forward_msg->param3;
+    memcpy(slot->req.charParam, forward_msg->charParam, sizeof(forward_msg->charParam));
+    int msg_code = shmSubmit(slot);
+    received_msg->msg_code = msg_code;
+    received_msg->param1 = slot->rep.param1;
+    received_msg->param2 = slot->rep.param2;
+    received_msg->param3 = slot->rep.param3;
+    shmRelease(slot);
+    return msg_code;
+}
+
+// attach to the ring fsserv -m publishes for this port
+int shmInit(int port)
+{
+    char name[32];
+    SHM_Name(name, sizeof(name), port);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+    shm_ring_t *ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED || __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        printf("client:: no shared-memory ring for port %d\n", port);
+        return -1;
+    }
+    shm_ring = ring;
+    message forward_msg = {.msg = "MFS_Init"};
+    message receive_msg;
+    int msg_code = shmCall(&forward_msg, NULL, &receive_msg);
+    if (msg_code == 0) {
+        transport = TRANSPORT_SHM;
+        portNum = port;
+        initialized = 1;
+    }
+    return msg_code;
+}
+
+// unix datagram sockets do not drop, so a request is one blocking send and recv
+int unixCall(message *forward_msg, char *payload, message *received_msg)
+{
+    printf("client:: send message [%s] over unix socket\n", forward_msg->msg);
+    struct iovec iov[4];
+    struct msghdr mh = { .msg_iov = iov };
+    mh.msg_iovlen = msgIov(forward_msg, payload, iov);
+    if (sendmsg(s_descriptor, &mh, 0) < 0) {
+        perror("send");
+        return -1;
+    }
+    if (recv(s_descriptor, (char *)received_msg, BUFFER_SIZE, 0) < 0) {
+        perror("recv");
+        return -1;
+    }
+    return received_msg->msg_code;
+}
+
+// connect a datagram socket to the server's unix socket path. binding with an
+// empty address lets the kernel pick an abstract name for our replies.
+int unixInit(char *path)
+{
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(sa_family_t)) != 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        close(fd);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    s_descriptor = fd;
+    transport = TRANSPORT_UNIX;
+    initialized = 1;
+
+    message forward_msg = {.msg = "MFS_Init"};
+    message receive_msg;
+    int msg_code = unixCall(&forward_msg, NULL, &receive_msg);
+    if (msg_code != 0) {
+        close(fd);
+        s_descriptor = -1;
+        transport = TRANSPORT_UDP;
+        initialized = 0;
+    }
+    return msg_code;
+}
+
+// send every byte of iov, resuming after short writes
+int tcpWriteAll(struct iovec *iov, int n)
+{
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n };
+    while (mh.msg_iovlen > 0) {
+        int rc = sendmsg(s_descriptor, &mh, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        while (mh.msg_iovlen > 0 && (size_t)rc >= mh.msg_iov->iov_len) {
+            rc -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + rc;
+            mh.msg_iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+int tcpReadAll(char *buf, int n)
+{
+    while (n > 0) {
+        int rc = recv(s_descriptor, buf, n, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        buf += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+int tcpSend(message *forward_msg, char *payload)
+{
+    uint32_t len = htonl(sizeof(message));
+    struct iovec iov[5] = { { .iov_base = &len, .iov_len = sizeof(len) } };
+    if (tcpWriteAll(iov, 1 + msgIov(forward_msg, payload, iov + 1)) != 0) {
+        perror("send");
+        tcp_lost = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int tcpRecv(message *received_msg)
+{
+    uint32_t len;
+    if (tcpReadAll((char *)&len, sizeof(len)) != 0 || ntohl(len) != sizeof(message) ||
+        tcpReadAll((char *)received_msg, sizeof(message)) != 0) {
+        perror("recv");
+        tcp_lost = 1;
+        return -1;
+    }
+    return received_msg->msg_code;
+}
+
+// TCP retransmits for us, so a request is just one frame out and one back
+int tcpCall(message *forward_msg, char *payload, message *received_msg)
+{
+    printf("client:: send message [%s] over tcp\n", forward_msg->msg);
+    if (tcpSend(forward_msg, payload) != 0)
+        return -1;
+    return tcpRecv(received_msg);
+}
+
+/**
+ * Stream a read or write of any length over TCP: the range is cut at block
+ * boundaries, every piece is sent back to back, then the replies are
+ * collected in order. Writes are flagged deferred when asked to. Returns -1
+ * if any piece failed.
+ */
+int tcpStream(char *op, int inum, char *buffer, int offset, int nbytes, int deferred)
+{
+    int write = strcmp(op, "MFS_Write") == 0;
+    int sent = 0, res = 0;
+    if (offset < 0 || nbytes > DIRECT_PTRS * MFS_BLOCK_SIZE - offset)
+        return -1;
+    for (int pos = offset; pos < offset + nbytes; sent++) {
+        int piece = MFS_BLOCK_SIZE - pos % MFS_BLOCK_SIZE;
+        if (piece > offset + nbytes - pos)
+            piece = offset + nbytes - pos;
+        message forward_msg = {.param1 = inum, .param2 = pos, .param3 = piece};
+        strcpy(forward_msg.msg, op);
+        if (write && deferred)
+            strcpy(forward_msg.charParam, MSG_WRITE_DEFERRED);
+        if (tcpSend(&forward_msg, write ? buffer + (pos - offset) : NULL) != 0)
+            return -1;
+        pos += piece;
+    }
+    for (int pos = offset; sent > 0; sent--) {
+        int piece = MFS_BLOCK_SIZE - pos % MFS_BLOCK_SIZE;
+        if (piece > offset + nbytes - pos)
+            piece = offset + nbytes - pos;
+        message received_msg;
+        int msg_code = tcpRecv(&received_msg);
+        if (msg_code == -1)
+            res = -1;
+        else if (!write)
+            memcpy(buffer + (pos - offset), received_msg.buf, piece);
+        pos += piece;
+    }
+    return res;
+}
+
+int tcpInit(char *hostname, int port)
+{
+    struct sockaddr_in addr;
+    if (UDP_FillSockAddr(&addr, hostname, port) != 0)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s_descriptor = fd;
+    transport = TRANSPORT_TCP;
+    initialized = 1;
+
+    message forward_msg = {.msg = "MFS_Init"};
+    message receive_msg;
+    int msg_code = tcpCall(&forward_msg, NULL, &receive_msg);
+    if (msg_code != 0) {
+        close(fd);
+        s_descriptor = -1;
+        transport = TRANSPORT_UDP;
+        initialized = 0;
+    }
+    return msg_code;
+}
+
+void raForget(int inum);
+
+// turn to the other server of the pair named in MFS_Init: the backup when the
+// primary stopped answering, or the primary again when the backup is still
+// its standby (MSG_STANDBY). addr, when given, gets its UDP address too.
+// Returns -1 when there is no backup, or it cannot be reached over TCP.
+int failover(struct sockaddr_in *addr)
+{
+    if (backup_host[0] == '\0')
+        return -1;
+    char next[sizeof(backup_host)];
+    int next_port = backup_port;
+    strcpy(next, backup_host);
+    strcpy(backup_host, serving_host);
+    backup_port = portNum;
+    strcpy(serving_host, next);
+    portNum = next_port;
+    printf("client:: failing over to %s:%d\n", next, next_port);
+    raForget(-1);
+    if (pair_tcp) {
+        if (s_descriptor >= 0)
+            close(s_descriptor);
+        s_descriptor = -1;
+        transport = TRANSPORT_UDP;
+        initialized = 0;
+        tcp_lost = 0;
+        if (tcpInit(next, next_port) == 0)
+            return 0;
+        tcp_lost = 1;
+        return -1;
+    }
+    if (UDP_FillSockAddr(&addrSnd, next, next_port) != 0)
+        return -1;
+    if (addr != NULL)
+        *addr = addrSnd;
+    return 0;
+}
+
+// payload, when not NULL, is sent in place of forward_msg->buf straight from the caller's buffer
+int sendToServer(int sd, struct timeval tv, message *forward_msg, char *payload, message *received_msg, struct sockaddr_in addrSnd, struct sockaddr_in addrRcv)
 {
     if (initialized == 0)
     {
         printf("Not Initalized. Initialize and Try Again\n");
         return -1;
     }
+    if (transport == TRANSPORT_SHM)
+        return shmCall(forward_msg, payload, received_msg);
+    if (transport == TRANSPORT_UNIX)
+        return unixCall(forward_msg, payload, received_msg);
+    if (transport == TRANSPORT_TCP) {
+        int msg_code = tcpCall(forward_msg, payload, received_msg);
+        // a lost connection is a lost server; a standby has not seen its
+        // primary go yet, or the primary is back
+        for (int tries = 0; (tcp_lost || msg_code == MSG_STANDBY) && routing_shard == 0 && backup_host[0] != '\0' && tries < FAILOVER_TIMEOUTS; tries++) {
+            if (msg_code == MSG_STANDBY)
+                sleep(1);
+            if (failover(NULL) == 0)
+                msg_code = tcpCall(forward_msg, payload, received_msg);
+        }
+        return msg_code == MSG_STANDBY ? -1 : msg_code;
+    }
+    // the server echoes the op and charParam: untagged requests get a tag, so
+    // a reply to an earlier try of an earlier request is not taken for theirs
+    static unsigned int udp_tag = 0;
+    if (forward_msg->charParam[0] == '\0')
+        snprintf(forward_msg->charParam, sizeof(forward_msg->charParam), "udp %u", ++udp_tag);
+    struct iovec iov[4];
+    struct msghdr mh = { .msg_name = &addrSnd, .msg_namelen = sizeof(addrSnd), .msg_iov = iov };
+    mh.msg_iovlen = msgIov(forward_msg, payload, iov);
     int res = 0;
     int rc = 0;
     int msg_code = -1;
+    int timeouts = 0;
     while (res <= 0 || rc < 0)
     {
         // retry
@@ -101,8 +535,8 @@ int sendToServer(int sd, struct timeval tv, message forward_msg, message *receiv
         FD_SET(sd, &rd);
         tv.tv_sec = 5;
 
-        printf("client:: send message [%s], rc: %d\n", forward_msg.msg, rc);
-        rc = UDP_Write(sd, &addrSnd, (char*)&forward_msg, BUFFER_SIZE);
+        printf("client:: send message [%s], rc: %d\n", forward_msg->msg, rc);
+        rc = sendmsg(sd, &mh, 0);
         if (rc < 0) {
             printf("client:: failed to send\n");
             sleep(5);
@@ -110,34 +544,557 @@ int sendToServer(int sd, struct timeval tv, message forward_msg, message *receiv
         }
         printf("client:: wait for reply...\n");
         printf("sd = %d\n", sd);
-        res = select(sd + 1, &rd, NULL, NULL, &tv);
+        while ((res = select(sd + 1, &rd, NULL, NULL, &tv)) > 0) {
+            rc = UDP_Read(sd, &addrRcv, (char*)received_msg, BUFFER_SIZE);
+            if (rc < 0 || (strncmp(received_msg->msg, forward_msg->msg, sizeof(forward_msg->msg)) == 0 &&
+                           memcmp(received_msg->charParam, forward_msg->charParam, sizeof(forward_msg->charParam)) == 0))
+                break;
+            printf("client:: stale reply [%s], still waiting\n", received_msg->msg);
+            FD_ZERO(&rd);
+            FD_SET(sd, &rd);
+        }
         if (res <= 0) {
             printf("fd is not set - err / timeout\n");
+            // a lost datagram is no lost server; the next tries go to the
+            // backup, if there is one, once the server stays silent
+            if (routing_shard == 0 && ++timeouts >= FAILOVER_TIMEOUTS) {
+                failover(&addrSnd);
+                timeouts = 0;
+            }
             continue;
         }
-        rc = UDP_Read(sd, &addrRcv, (char*)received_msg, BUFFER_SIZE);
         
         printf("res: %d\n, rc = %d \n", res, rc);
         if (rc < 0) {
             printf("client:: failed to operate\n");
             continue;
         }
-        if (res <= 0) {
-            printf("err / timeout\n");
-            continue;
-        }
         msg_code = received_msg->msg_code;
+        if (msg_code == MSG_STANDBY && routing_shard == 0 && failover(&addrSnd) == 0) {
+            timeouts = 0;
+            res = 0; // the primary is alive after all: try it again
+        }
     }
+    if (msg_code == MSG_STANDBY)
+        msg_code = -1;
+    if (routing_shard == 0 && (int32_t)((uint32_t)received_msg->param3 - seen_version) > 0)
+        seen_version = received_msg->param3;
     printf("client:: got reply [size:%d code:(%d)\n", rc, msg_code);
     return msg_code;
 }
 
+// read replicas (MFS_AddReplica): lookups, stats and reads take turns between
+// the server and the replicas, backups the server streams its modifications
+// to (fsserv -B). Replies carry the volume's version in param3; an answer from
+// a replica older than the newest version this client saw from the server is
+// dropped for the server's, so a client always reads its own writes. A replica
+// that does not answer sits out REPLICA_RETRY_S.
+#define MAX_REPLICAS (4)
+#define REPLICA_WAIT_MS (500)
+#define REPLICA_RETRY_S (5)
+
+typedef struct {
+    struct sockaddr_in addr;
+    time_t down_until;
+} replica_t;
+
+replica_t replicas[MAX_REPLICAS];
+int num_replicas = 0;
+int rep_sd = -1; // replies from replicas never mix with the server's
+unsigned rep_turn = 0;
+unsigned rep_tag = 0;
+
+// send a read to the replica whose turn it is; -2 when the server has to serve it
+int replicaCall(message *forward_msg, message *received_msg) {
+    if (!initialized || transport != TRANSPORT_UDP || num_replicas == 0)
+        return -2;
+    unsigned turn = rep_turn++ % (num_replicas + 1);
+    if (turn == (unsigned)num_replicas)
+        return -2; // the server's turn
+    replica_t *r = &replicas[turn];
+    if (r->down_until > time(NULL))
+        return -2;
+    if (rep_sd < 0 && (rep_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -2;
+    // lookups carry a name the reply echoes; other reads get a tag in its place
+    if (forward_msg->charParam[0] == '\0')
+        snprintf(forward_msg->charParam, sizeof(forward_msg->charParam), "replica %u", ++rep_tag);
+    while (recv(rep_sd, received_msg, sizeof(*received_msg), MSG_DONTWAIT) > 0)
+        ; // late answers to reads the server served after all
+    if (sendto(rep_sd, forward_msg, sizeof(*forward_msg), 0, (struct sockaddr *)&r->addr, sizeof(r->addr)) != sizeof(*forward_msg))
+        return -2;
+    struct timeval wait = { .tv_sec = 0, .tv_usec = REPLICA_WAIT_MS * 1000 };
+    for (;;) {
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(rep_sd, &rd);
+        if (select(rep_sd + 1, &rd, NULL, NULL, &wait) <= 0) {
+            r->down_until = time(NULL) + REPLICA_RETRY_S;
+            return -2;
+        }
+        if (recv(rep_sd, received_msg, sizeof(*received_msg), 0) == sizeof(*received_msg) &&
+            memcmp(received_msg->charParam, forward_msg->charParam, sizeof(forward_msg->charParam)) == 0)
+            break;
+    }
+    if ((int32_t)((uint32_t)received_msg->param3 - seen_version) < 0)
+        return -2; // the replica has not applied this client's writes yet
+    return received_msg->msg_code;
+}
+
+// sharding: the server MFS_Init reaches is shard 0, which may mount the roots
+// of other servers in its root directory (fsserv -M). Their map is fetched at
+// MFS_Init; every request goes to the shard of the inode it names, and the
+// inode numbers handed out carry their shard above MFS_SHARD_SHIFT. Requests
+// spanning two shards fail. Shards besides 0 are reached over UDP only.
+#define MAX_SHARDS (16)
+#define SHARD(inum) ((inum) >> MFS_SHARD_SHIFT)
+#define LOCAL(inum) ((inum) & ((1 << MFS_SHARD_SHIFT) - 1))
+#define GLOBAL(shard, inum) ((inum) < 0 ? (inum) : (shard) << MFS_SHARD_SHIFT | (inum))
+
+typedef struct {
+    char name[28]; // where its root is mounted in the root directory
+    struct sockaddr_in addr;
+} shard_t;
+
+shard_t shards[MAX_SHARDS]; // shards[0] is the server of MFS_Init, reached as usual
+int num_shards = 1;
+
+// fetch the shard map from shard 0, as "name host port" lines
+void shardLoad(void) {
+    message forward_msg = {.msg = "MFS_ShardMap"};
+    message received_msg;
+    int n = sendToServer(s_descriptor, tv, &forward_msg, NULL, &received_msg, addrSnd, addrRcv);
+    received_msg.buf[sizeof(received_msg.buf) - 1] = '\0';
+    char *line = received_msg.buf;
+    for (int i = 0; i < n && line != NULL && num_shards < MAX_SHARDS; i++) {
+        shard_t *shard = &shards[num_shards];
+        char shard_host[64];
+        int shard_port;
+        if (sscanf(line, "%27s %63s %d", shard->name, shard_host, &shard_port) != 3 ||
+            UDP_FillSockAddr(&shard->addr, shard_host, shard_port) != 0)
+            break;
+        num_shards++;
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+}
+
+// the shard mounted as name in directory pinum, 0 for none
+int shardMount(int pinum, char *name) {
+    if (pinum != 0)
+        return 0;
+    for (int i = 1; i < num_shards; i++)
+        if (strncmp(shards[i].name, name, sizeof(shards[i].name)) == 0)
+            return i;
+    return 0;
+}
+
+// send a request to a shard; forward_msg names inodes by their number there
+int shardCall(int shard, message *forward_msg, char *payload, message *received_msg) {
+    if (shard == 0)
+        return sendToServer(s_descriptor, tv, forward_msg, payload, received_msg, addrSnd, addrRcv);
+    if (shard < 0 || shard >= num_shards || transport != TRANSPORT_UDP)
+        return -1;
+    routing_shard = shard;
+    int msg_code = sendToServer(s_descriptor, tv, forward_msg, payload, received_msg, shards[shard].addr, addrRcv);
+    routing_shard = 0;
+    return msg_code;
+}
+
+// a read off a shard besides 0: inums in the directory entries it returns are made global
+int shardRead(int inum, char *buffer, int offset, int nbytes) {
+    int shard = SHARD(inum);
+    message forward_msg = {.msg = "MFS_Read", .param1 = LOCAL(inum), .param2 = offset, .param3 = nbytes};
+    message received_msg;
+    int msg_code = shardCall(shard, &forward_msg, NULL, &received_msg);
+    if (msg_code == -1)
+        return msg_code;
+    int size = sizeof(MFS_DirEnt_t);
+    for (int pos = (offset + size - 1) / size * size; received_msg.param2 == MFS_DIRECTORY && pos + size <= offset + nbytes; pos += size) {
+        MFS_DirEnt_t ent;
+        memcpy(&ent, received_msg.buf + (pos - offset), size);
+        if (ent.inum < 0)
+            continue;
+        if (LOCAL(inum) == 0 && strcmp(ent.name, "..") == 0)
+            ent.inum = 0; // a mounted root's parent is the root it is mounted in
+        else
+            ent.inum = GLOBAL(shard, ent.inum);
+        memcpy(received_msg.buf + (pos - offset), &ent, size);
+    }
+    memcpy(buffer, received_msg.buf, nbytes);
+    return msg_code;
+}
+
+// client readahead: once an inode is read sequentially over UDP, the blocks
+// after the read are requested ahead on a socket of their own, so their
+// replies never mix with the ones sendToServer waits for. Every request
+// carries a tag in charParam that the server echoes back; a reply no slot
+// waits for any more is dropped. A block is only served while no newer volume
+// version has been seen than the one it was read at, and for RA_AGE_MS at most,
+// since writes of other clients show up in the version only once this client
+// talks to the server.
+#define RA_STREAMS (4)   // inodes followed at once
+#define RA_DEPTH (8)     // blocks kept requested ahead of a sequential reader
+#define RA_SLOTS (RA_STREAMS * RA_DEPTH)
+#define RA_WAIT_MS (200) // longest wait for a block already requested
+#define RA_AGE_MS (1000) // longest a block read ahead is served for
+
+#define RA_FREE (0)
+#define RA_SENT (1)
+#define RA_READY (2)
+
+typedef struct {
+    int inum;
+    int next;  // offset a sequential reader asks for next
+    int ahead; // first block not requested yet
+    unsigned long used; // 0 for a free entry
+} ra_stream_t;
+
+typedef struct {
+    int state;
+    int inum;
+    int blk;
+    uint32_t tag;
+    unsigned long used;
+    uint32_t version;        // of the volume the block was read at
+    struct timespec arrived; // when its reply came in
+    char data[MFS_BLOCK_SIZE];
+} ra_slot_t;
+
+int ra_sd = -1;
+uint32_t ra_tag;
+unsigned long ra_clock;
+ra_stream_t ra_streams[RA_STREAMS];
+ra_slot_t ra_slots[RA_SLOTS];
+
+// store every reply that has arrived for a block requested ahead, waiting up
+// to *wait for the first one; select takes the time waited off *wait
+void raReceive(struct timeval *wait) {
+    struct timeval none = { 0, 0 };
+    message reply;
+    for (;;) {
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(ra_sd, &rd);
+        if (select(ra_sd + 1, &rd, NULL, NULL, wait) <= 0)
+            return;
+        wait = &none;
+        if (recv(ra_sd, &reply, sizeof(reply), 0) != sizeof(reply))
+            continue;
+        uint32_t tag;
+        memcpy(&tag, reply.charParam, sizeof(tag));
+        for (int i = 0; i < RA_SLOTS; i++) {
+            ra_slot_t *slot = &ra_slots[i];
+            if (slot->state != RA_SENT || slot->tag != tag)
+                continue;
+            slot->state = RA_FREE;
+            if (reply.msg_code == 0) {
+                memcpy(slot->data, reply.buf, MFS_BLOCK_SIZE);
+                slot->version = reply.param3;
+                clock_gettime(CLOCK_MONOTONIC, &slot->arrived);
+                slot->state = RA_READY;
+                if ((int32_t)(slot->version - seen_version) > 0)
+                    seen_version = slot->version;
+            }
+            break;
+        }
+    }
+}
+
+ra_slot_t *raFind(int inum, int blk) {
+    for (int i = 0; i < RA_SLOTS; i++)
+        if (ra_slots[i].state != RA_FREE && ra_slots[i].inum == inum && ra_slots[i].blk == blk)
+            return &ra_slots[i];
+    return NULL;
+}
+
+// a block read ahead that may no longer be what the server holds
+int raStale(ra_slot_t *slot) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int32_t)(slot->version - seen_version) < 0 ||
+           (now.tv_sec - slot->arrived.tv_sec) * 1000 + (now.tv_nsec - slot->arrived.tv_nsec) / 1000000 >= RA_AGE_MS;
+}
+
+// ask for block blk of inum ahead of the reader, in the least recently used slot
+void raRequest(int inum, int blk) {
+    ra_slot_t *slot = &ra_slots[0];
+    for (int i = 0; i < RA_SLOTS && slot->state != RA_FREE; i++)
+        if (ra_slots[i].state == RA_FREE || ra_slots[i].used < slot->used)
+            slot = &ra_slots[i];
+    message forward_msg = {.msg = "MFS_Read", .param1 = inum, .param2 = blk * MFS_BLOCK_SIZE, .param3 = MFS_BLOCK_SIZE};
+    slot->tag = ++ra_tag;
+    memcpy(forward_msg.charParam, &slot->tag, sizeof(slot->tag));
+    slot->state = RA_FREE;
+    if (sendto(ra_sd, &forward_msg, sizeof(forward_msg), MSG_DONTWAIT, (struct sockaddr *)&addrSnd, sizeof(addrSnd)) != sizeof(forward_msg))
+        return;
+    slot->state = RA_SENT;
+    slot->inum = inum;
+    slot->blk = blk;
+    slot->used = ++ra_clock;
+}
+
+// drop what was read ahead of inum, of every inode when inum is -1
+void raForget(int inum) {
+    for (int i = 0; i < RA_SLOTS; i++)
+        if (inum == -1 || ra_slots[i].inum == inum)
+            ra_slots[i].state = RA_FREE;
+    for (int i = 0; i < RA_STREAMS; i++)
+        if (inum == -1 || ra_streams[i].inum == inum)
+            ra_streams[i].used = 0;
+}
+
+/**
+ * Serve a read from the blocks requested ahead, waiting for one that is on its
+ * way, and keep RA_DEPTH blocks requested past a sequential read. Returns 0
+ * when the read was served, -1 when it has to go to the server.
+ */
+int raRead(int inum, char *buffer, int offset, int nbytes) {
+    if (ra_sd < 0 && (ra_sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+    struct timeval wait = { 0, 0 };
+    raReceive(&wait);
+
+    ra_stream_t *stream = &ra_streams[0];
+    for (int i = 0; i < RA_STREAMS && !(stream->used && stream->inum == inum); i++)
+        if ((ra_streams[i].used && ra_streams[i].inum == inum) || ra_streams[i].used < stream->used)
+            stream = &ra_streams[i];
+    if (!stream->used || stream->inum != inum)
+        *stream = (ra_stream_t){ .inum = inum, .next = -1 };
+    int sequential = offset == stream->next;
+    stream->next = offset + nbytes;
+    stream->used = ++ra_clock;
+
+    int hit = 1;
+    for (int pos = offset; pos < offset + nbytes && hit; ) {
+        int n = MFS_BLOCK_SIZE - pos % MFS_BLOCK_SIZE;
+        if (n > offset + nbytes - pos)
+            n = offset + nbytes - pos;
+        ra_slot_t *slot = raFind(inum, pos / MFS_BLOCK_SIZE);
+        wait = (struct timeval){ .tv_sec = 0, .tv_usec = RA_WAIT_MS * 1000 };
+        while (slot != NULL && slot->state == RA_SENT && (wait.tv_sec > 0 || wait.tv_usec > 0))
+            raReceive(&wait);
+        if (slot == NULL || slot->state != RA_READY || slot->inum != inum || slot->blk != pos / MFS_BLOCK_SIZE) {
+            hit = 0;
+            break;
+        }
+        if (raStale(slot)) {
+            slot->state = RA_FREE;
+            hit = 0;
+            break;
+        }
+        memcpy(buffer + (pos - offset), slot->data + pos % MFS_BLOCK_SIZE, n);
+        slot->used = ++ra_clock;
+        pos += n;
+    }
+
+    if (!sequential) {
+        // the reader left the window: what was read ahead of it only takes slots
+        for (int i = 0; i < RA_SLOTS; i++)
+            if (ra_slots[i].inum == inum)
+                ra_slots[i].state = RA_FREE;
+        stream->ahead = 0;
+        return hit ? 0 : -1;
+    }
+    int next_blk = (offset + nbytes + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+    if (stream->ahead < next_blk)
+        stream->ahead = next_blk;
+    for (; stream->ahead < next_blk + RA_DEPTH && stream->ahead < DIRECT_PTRS; stream->ahead++)
+        if (raFind(inum, stream->ahead) == NULL)
+            raRequest(inum, stream->ahead);
+    return hit ? 0 : -1;
+}
+
+// one write request, or a TCP stream of them; deferred writes are made durable by MFS_Fsync
+int sendWrite(int inum, char *buffer, int offset, int nbytes, int deferred)
+{
+    if (initialized && transport == TRANSPORT_TCP && nbytes > MFS_BLOCK_SIZE)
+        return tcpStream("MFS_Write", inum, buffer, offset, nbytes, deferred);
+    if (initialized && transport == TRANSPORT_SHM) {
+        // the payload goes straight from the caller into the shared slot
+        shm_slot_t *slot = shmClaim();
+        if (slot == NULL)
+            return -1;
+        strcpy(slot->req.msg, "MFS_Write");
+        slot->req.param1 = inum;
+        slot->req.param2 = offset;
+        slot->req.param3 = nbytes;
+        memset(slot->req.charParam, 0, sizeof(slot->req.charParam));
+        if (deferred)
+            strcpy(slot->req.charParam, MSG_WRITE_DEFERRED);
+        memcpy(slot->req.buf, buffer, nbytes > 0 && nbytes <= MFS_BLOCK_SIZE ? nbytes : 0);
+        int msg_code = shmSubmit(slot);
+        shmRelease(slot);
+        return msg_code;
+    }
+    // only the header is filled in: the payload is sent from the caller's buffer
+    message forward_msg;
+    memset(&forward_msg, 0, offsetof(message, buf));
+    memset(forward_msg.charParam, 0, sizeof(forward_msg.charParam));
+    strcpy(forward_msg.msg, "MFS_Write");
+    if (deferred)
+        strcpy(forward_msg.charParam, MSG_WRITE_DEFERRED);
+    forward_msg.param1 = LOCAL(inum);
+    forward_msg.param2 = offset;
+    forward_msg.param3 = nbytes;
+    message received_msg;
+    return shardCall(SHARD(inum), &forward_msg, buffer, &received_msg);
+}
+
+// write-back (MFS_WriteBack): writes to a file gather in one contiguous range
+// per file, which goes to the server once it is full, once a write does not
+// join it, once it is WB_DELAY_MS old (noticed on the next call into the
+// library), on MFS_Fsync, MFS_Shutdown and at exit. Flushed writes are
+// flagged deferred, so the server syncs them on MFS_Fsync, not one by one.
+#define WB_FILES (4)
+#define WB_BLOCKS (8)    // largest range gathered for a file
+#define WB_DELAY_MS (50)
+
+typedef struct {
+    int inum;
+    int offset;
+    int len; // 0 when the entry is free
+    struct timespec since; // first write gathered
+    char data[WB_BLOCKS * MFS_BLOCK_SIZE];
+} wb_file_t;
+
+int write_back = 0;
+int wb_error = 0; // a flush failed since the last MFS_Fsync
+wb_file_t wb_files[WB_FILES];
+
+// send a gathered range, cut into requests at block boundaries unless TCP can stream it
+void wbSend(wb_file_t *wb) {
+    if (wb->len == 0)
+        return;
+    if (transport == TRANSPORT_TCP) {
+        if (sendWrite(wb->inum, wb->data, wb->offset, wb->len, 1) != 0)
+            wb_error = -1;
+    } else {
+        for (int pos = wb->offset; pos < wb->offset + wb->len; ) {
+            int piece = MFS_BLOCK_SIZE - pos % MFS_BLOCK_SIZE;
+            if (piece > wb->offset + wb->len - pos)
+                piece = wb->offset + wb->len - pos;
+            if (sendWrite(wb->inum, wb->data + (pos - wb->offset), pos, piece, 1) != 0)
+                wb_error = -1;
+            pos += piece;
+        }
+    }
+    wb->len = 0;
+}
+
+// send what is gathered for inum, for every file when inum is -1
+void wbFlush(int inum) {
+    for (int i = 0; i < WB_FILES; i++)
+        if (inum == -1 || wb_files[i].inum == inum)
+            wbSend(&wb_files[i]);
+}
+
+void wbFlushAll(void) {
+    wbFlush(-1);
+}
+
+// send the ranges that have waited WB_DELAY_MS
+void wbExpire(void) {
+    if (!write_back)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < WB_FILES; i++) {
+        wb_file_t *wb = &wb_files[i];
+        if (wb->len > 0 && (now.tv_sec - wb->since.tv_sec) * 1000 + (now.tv_nsec - wb->since.tv_nsec) / 1000000 >= WB_DELAY_MS)
+            wbSend(wb);
+    }
+}
+
+// gather a write into its file's range; a write that does not touch the range
+// or would grow it past WB_BLOCKS sends the range and starts a new one
+int wbWrite(int inum, char *buffer, int offset, int nbytes) {
+    if (offset < 0 || nbytes <= 0 || nbytes > DIRECT_PTRS * MFS_BLOCK_SIZE - offset)
+        return -1;
+    if (nbytes > (int)sizeof(wb_files[0].data)) {
+        wbFlush(inum);
+        return sendWrite(inum, buffer, offset, nbytes, 0);
+    }
+    wb_file_t *wb = NULL;
+    for (int i = 0; i < WB_FILES && wb == NULL; i++)
+        if (wb_files[i].len > 0 && wb_files[i].inum == inum)
+            wb = &wb_files[i];
+    if (wb != NULL) {
+        int lo = offset < wb->offset ? offset : wb->offset;
+        int hi = offset + nbytes > wb->offset + wb->len ? offset + nbytes : wb->offset + wb->len;
+        if (offset > wb->offset + wb->len || offset + nbytes < wb->offset || hi - lo > (int)sizeof(wb->data)) {
+            wbSend(wb);
+        } else {
+            memmove(wb->data + (wb->offset - lo), wb->data, wb->len);
+            memcpy(wb->data + (offset - lo), buffer, nbytes);
+            wb->offset = lo;
+            wb->len = hi - lo;
+            if (wb->len == (int)sizeof(wb->data))
+                wbSend(wb);
+            return 0;
+        }
+    } else {
+        // a free entry, or the one gathering the longest
+        wb = &wb_files[0];
+        for (int i = 1; i < WB_FILES && wb->len > 0; i++)
+            if (wb_files[i].len == 0 || wb_files[i].since.tv_sec < wb->since.tv_sec ||
+                (wb_files[i].since.tv_sec == wb->since.tv_sec && wb_files[i].since.tv_nsec < wb->since.tv_nsec))
+                wb = &wb_files[i];
+        wbSend(wb);
+    }
+    wb->inum = inum;
+    wb->offset = offset;
+    wb->len = nbytes;
+    memcpy(wb->data, buffer, nbytes);
+    clock_gettime(CLOCK_MONOTONIC, &wb->since);
+    return 0;
+}
+
+// hostname "shm" selects the shared-memory ring of a server on this host,
+// "unix:/path" its unix datagram socket and "tcp:host" a TCP connection that
+// can also stream reads and writes longer than a block; anything else is a
+// UDP host name. "primary,backup[:port]" names a backup to fail over to once
+// the primary stops answering, over the same transport (see fsserv -B).
 int MFS_Init(char *hostname, int port)
 {
     int sd = s_descriptor;
-    if (sd > 0) {
+    if (sd > 0 || transport == TRANSPORT_SHM) {
         return 0;
     }
+    static char primary[256];
+    char *comma = strchr(hostname, ',');
+    if (comma != NULL && comma - hostname < (int)sizeof(primary)) {
+        memcpy(primary, hostname, comma - hostname);
+        primary[comma - hostname] = '\0';
+        snprintf(backup_host, sizeof(backup_host), "%s", comma + 1);
+        snprintf(serving_host, sizeof(serving_host), "%s", strncmp(primary, "tcp:", 4) == 0 ? primary + 4 : primary);
+        pair_tcp = strncmp(primary, "tcp:", 4) == 0;
+        backup_port = port;
+        char *colon = strrchr(backup_host, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            backup_port = atoi(colon + 1);
+        }
+        hostname = primary;
+    }
+    if (strcmp(hostname, "shm") == 0 || strncmp(hostname, "shm:", 4) == 0) {
+        host = hostname;
+        return shmInit(port);
+    }
+    if (strncmp(hostname, "unix:", 5) == 0) {
+        host = hostname;
+        portNum = port;
+        return unixInit(hostname + 5);
+    }
+    if (strncmp(hostname, "tcp:", 4) == 0) {
+        host = hostname;
+        portNum = port;
+        int rc = tcpInit(hostname + 4, port);
+        if (rc != 0 && backup_host[0] != '\0')
+            rc = failover(NULL);
+        return rc;
+    }
     while (sd <= -1) {
         int porta = rand() % 20001;
         sd = UDP_Open(porta);
@@ -149,11 +1106,13 @@ int MFS_Init(char *hostname, int port)
     int res = 0;
     int rc = 0;
     int msg_code = -1;
+    int timeouts = 0;
+    portNum = port;
+    UDP_FillSockAddr(&addrSnd, hostname, port);
     while (res <= 0 || rc < 0)
     {
         printf("res: %d, rc = %d \n", res, rc);
         // retry
-        rc = UDP_FillSockAddr(&addrSnd, hostname, port);
         fd_set rd;
         FD_ZERO(&rd);
         FD_SET(sd, &rd);
@@ -172,6 +1131,10 @@ int MFS_Init(char *hostname, int port)
         res = select(sd + 1, &rd, NULL, NULL, &tv);
         if (res <= 0) {
             printf("fd is not set - err / timeout\n");
+            if (++timeouts >= FAILOVER_TIMEOUTS) {
+                failover(NULL);
+                timeouts = 0;
+            }
             continue;
         }
         rc = UDP_Read(sd, &addrRcv, (char*)&receive_msg, BUFFER_SIZE);
@@ -190,28 +1153,57 @@ int MFS_Init(char *hostname, int port)
 
     if (msg_code == 0) {
         // successful
-        portNum = port;
         host = hostname;
         initialized = 1;
         s_descriptor = sd;
+        shardLoad();
     }
 
     printf("client:: got reply [size:%d code:(%d)\n", rc, msg_code);
     return 0;
     
 }
+// add a read replica, a backup the server streams to (fsserv -B); over UDP
+// only, other transports keep reading from the server
+int MFS_AddReplica(char *hostname, int port)
+{
+    if (num_replicas == MAX_REPLICAS || UDP_FillSockAddr(&replicas[num_replicas].addr, hostname, port) != 0)
+        return -1;
+    replicas[num_replicas++].down_until = 0;
+    return 0;
+}
+// a name that fits a directory entry with its terminator; longer ones are refused, never cut short
+static int nameFits(char *name)
+{
+    return strlen(name) < sizeof(((MFS_DirEnt_t *)0)->name);
+}
 int MFS_Lookup(int pinum, char *name)
 {
-    message forward_msg = {.msg = "MFS_Lookup", .param1 = pinum};
-    memcpy(&forward_msg.charParam, name, 48);
+    if (!nameFits(name))
+        return -1;
+    wbExpire();
+    int shard = SHARD(pinum);
+    int mount = shardMount(pinum, name);
+    if (mount != 0)
+        return GLOBAL(mount, 0);
+    if (shard != 0 && LOCAL(pinum) == 0 && strcmp(name, "..") == 0)
+        return 0;
+    message forward_msg = {.msg = "MFS_Lookup", .param1 = LOCAL(pinum)};
+    strcpy(forward_msg.charParam, name);
     message received_msg;
-    return sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    int msg_code = shard == 0 ? replicaCall(&forward_msg, &received_msg) : -2;
+    if (msg_code == -2)
+        msg_code = shardCall(shard, &forward_msg, NULL, &received_msg);
+    return GLOBAL(shard, msg_code);
 }
 int MFS_Stat(int inum, MFS_Stat_t *m)
 {
-    message forward_msg = {.msg = "MFS_Stat", .param1 = inum};
+    wbFlush(inum); // the size counts this client's own writes
+    message forward_msg = {.msg = "MFS_Stat", .param1 = LOCAL(inum)};
     message received_msg;
-    int msg_code = sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    int msg_code = SHARD(inum) == 0 ? replicaCall(&forward_msg, &received_msg) : -2;
+    if (msg_code == -2)
+        msg_code = shardCall(SHARD(inum), &forward_msg, NULL, &received_msg);
     if (msg_code == -1)
         return msg_code;
     m->size = received_msg.param1;
@@ -219,18 +1211,73 @@ int MFS_Stat(int inum, MFS_Stat_t *m)
     printf("inum:%d, msize: %d, mtype: %d\n", inum, m->size, m->type);
     return msg_code;
 }
+// turn write-back on or off; turning it off sends everything gathered
+int MFS_WriteBack(int enable)
+{
+    static int registered = 0;
+    if (enable && !registered) {
+        atexit(wbFlushAll);
+        registered = 1;
+    }
+    if (!enable)
+        wbFlush(-1);
+    write_back = enable;
+    return 0;
+}
+
 int MFS_Write(int inum, char *buffer, int offset, int nbytes)
 {
-    message forward_msg = {.msg = "MFS_Write", .param1 = inum, .param2 = offset, .param3 = nbytes};
-    memcpy(&forward_msg.buf, buffer, 4096);
+    raForget(inum);
+    if (write_back) {
+        wbExpire();
+        return wbWrite(inum, buffer, offset, nbytes);
+    }
+    return sendWrite(inum, buffer, offset, nbytes, 0);
+}
+
+// send what is gathered for inum and have the server sync the volume; -1 also
+// when a write gathered since the last MFS_Fsync failed to reach it
+int MFS_Fsync(int inum)
+{
+    wbFlush(inum);
+    message forward_msg = {.msg = "MFS_Fsync", .param1 = LOCAL(inum)};
     message received_msg;
-    return sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    int msg_code = shardCall(SHARD(inum), &forward_msg, NULL, &received_msg);
+    if (wb_error != 0)
+        msg_code = -1;
+    wb_error = 0;
+    return msg_code;
 }
 int MFS_Read(int inum, char *buffer, int offset, int nbytes)
 {
+    wbExpire();
+    wbFlush(inum); // reads see this client's own writes
+    if (SHARD(inum) != 0)
+        return shardRead(inum, buffer, offset, nbytes);
+    if (initialized && transport == TRANSPORT_TCP && nbytes > MFS_BLOCK_SIZE)
+        return tcpStream("MFS_Read", inum, buffer, offset, nbytes, 0);
+    if (initialized && transport == TRANSPORT_SHM) {
+        shm_slot_t *slot = shmClaim();
+        if (slot == NULL)
+            return -1;
+        strcpy(slot->req.msg, "MFS_Read");
+        slot->req.param1 = inum;
+        slot->req.param2 = offset;
+        slot->req.param3 = nbytes;
+        int msg_code = shmSubmit(slot);
+        if (msg_code != -1)
+            memcpy(buffer, slot->rep.buf, nbytes);
+        shmRelease(slot);
+        return msg_code;
+    }
     message forward_msg = {.msg = "MFS_Read", .param1 = inum, .param2 = offset, .param3 = nbytes};
     message received_msg;
-    int msg_code = sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    int msg_code = replicaCall(&forward_msg, &received_msg);
+    if (msg_code == -2 && initialized && transport == TRANSPORT_UDP && offset >= 0 && nbytes > 0 && nbytes <= MFS_BLOCK_SIZE &&
+        raRead(inum, buffer, offset, nbytes) == 0)
+        return 0;
+    if (msg_code == -2)
+        msg_code = sendToServer(s_descriptor, tv, &forward_msg, NULL, &received_msg, addrSnd, addrRcv);
     if (msg_code == -1)
         return msg_code;
     // buffer = malloc(sizeof(char) * nbytes);
@@ -239,26 +1286,84 @@ int MFS_Read(int inum, char *buffer, int offset, int nbytes)
 }
 int MFS_Creat(int pinum, int type, char *name)
 {
-    message forward_msg = {.msg = "MFS_Creat", .param1 = pinum, .param2 = type};
-    memcpy(&forward_msg.charParam, name, 48);
+    if (!nameFits(name))
+        return -1;
+    wbExpire();
+    if (shardMount(pinum, name) != 0)
+        return -1; // the name is taken by a mounted shard
+    message forward_msg = {.msg = "MFS_Creat", .param1 = LOCAL(pinum), .param2 = type};
+    strcpy(forward_msg.charParam, name);
     message received_msg;
-    return sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    return shardCall(SHARD(pinum), &forward_msg, NULL, &received_msg);
 }
 int MFS_Unlink(int pinum, char *name)
 {
-    message forward_msg = {.msg = "MFS_Unlink", .param1 = pinum};
-    memcpy(&forward_msg.charParam, name, 48);
+    if (!nameFits(name))
+        return -1;
+    raForget(-1); // the inode may come back as another file
+    wbFlush(-1);
+    if (shardMount(pinum, name) != 0)
+        return -1;
+    message forward_msg = {.msg = "MFS_Unlink", .param1 = LOCAL(pinum)};
+    strcpy(forward_msg.charParam, name);
     message received_msg;
-    return sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    return shardCall(SHARD(pinum), &forward_msg, NULL, &received_msg);
+}
+// move entry src_name of src_pinum to dst_name in dst_pinum, replacing a regular file of that name
+int MFS_Rename(int src_pinum, char *src_name, int dst_pinum, char *dst_name)
+{
+    if (!nameFits(src_name) || !nameFits(dst_name))
+        return -1;
+    if (SHARD(src_pinum) != SHARD(dst_pinum) || shardMount(src_pinum, src_name) != 0 || shardMount(dst_pinum, dst_name) != 0)
+        return -1;
+    // the new name is the payload, as a write's data would be
+    message forward_msg = {.msg = "MFS_Rename", .param1 = LOCAL(src_pinum), .param2 = LOCAL(dst_pinum), .param3 = strlen(dst_name) + 1};
+    strcpy(forward_msg.charParam, src_name);
+    raForget(-1); // a replaced file's inode is freed
+    wbFlush(-1);
+    message received_msg;
+    return shardCall(SHARD(src_pinum), &forward_msg, dst_name, &received_msg);
+}
+// copy file src_inum to a new file name in dst_pinum on the server; returns the copy's inum
+int MFS_Copy(int src_inum, int dst_pinum, char *name)
+{
+    message forward_msg = {.msg = "MFS_Copy", .param1 = LOCAL(src_inum), .param2 = LOCAL(dst_pinum)};
+    if (!nameFits(name) || SHARD(src_inum) != SHARD(dst_pinum) || shardMount(dst_pinum, name) != 0)
+        return -1;
+    strcpy(forward_msg.charParam, name);
+    wbFlush(src_inum); // the copy includes this client's own writes
+    message received_msg;
+    int inum = shardCall(SHARD(src_inum), &forward_msg, NULL, &received_msg);
+    return GLOBAL(SHARD(src_inum), inum);
 }
 int MFS_Shutdown()
 {
+    wbFlush(-1);
     message forward_msg = {.msg = "MFS_Shutdown"};
     message received_msg;
-    int res = sendToServer(s_descriptor, tv, forward_msg, &received_msg, addrSnd, addrRcv);
+    for (int i = 1; i < num_shards; i++)
+        shardCall(i, &forward_msg, NULL, &received_msg);
+    int res = sendToServer(s_descriptor, tv, &forward_msg, NULL, &received_msg, addrSnd, addrRcv);
+    return res;
+}
+// freeze the volume into the read-only snapshot <image>@name on the server,
+// and every shard into one of its own
+int MFS_Snapshot(char *name)
+{
+    message forward_msg = {.msg = "MFS_Snapshot"};
+    if (strlen(name) >= sizeof(forward_msg.charParam))
+        return -1;
+    strcpy(forward_msg.charParam, name);
+    wbFlush(-1);
+    message received_msg;
+    int res = 0;
+    for (int i = 0; i < num_shards; i++)
+        if (shardCall(i, &forward_msg, NULL, &received_msg) != 0)
+            res = -1;
     return res;
 }
 
+#ifndef MFS_NO_MAIN
 int main(int argc, char const *argv[])
 {
     MFS_Init("localhost", 3000);
@@ -268,3 +1373,4 @@ int main(int argc, char const *argv[])
     MFS_Shutdown();
     return 0;
 }
+#endif // MFS_NO_MAIN
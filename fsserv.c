@@ -6,12 +6,101 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #include "udp.h"
 #include "ufs.h"
 #include "message.h"
+#include "mfs_shm.h"
+#include "mfs_uring.h"
+#include "mfs_crc.h"
+#include "mfs_lz.h"
 
 #define BLOCK_SIZE (4096)
 
+// address of block blk counted from base. Offsets are computed in 64 bits so
+// images larger than 2 GB work.
+#define BLOCK_ADDR(base, blk) ((char *)(base) + (size_t)(blk) * BLOCK_SIZE)
+
+#define MAX_VOLUMES (64)
+#define PACK_REUSE (64) // half empty data blocks remembered for new packed blocks
+#define STAT_OPS (12)
+#define REPLICA_TIMEOUT (5) // seconds a primary waits for its backup to apply a request
+#define MAX_REPLICAS (4) // backups and read replicas a volume streams to (-B)
+#define MAX_SHARDS (16) // file systems in a sharded namespace, this one included (-M)
+#define RA_MIN (2) // blocks read ahead once an inode is read sequentially
+#define RA_MAX (8) // the window doubles on every sequential read up to this
+
+// how an inode has been read, for readahead
+typedef struct {
+    int next;   // offset a sequential reader asks for next
+    int window; // blocks kept read ahead, 0 while the reads are not sequential
+    int ahead;  // first block index not yet read ahead
+} readahead_t;
+
+// one served image (a volume) and everything a request handler needs to reach it
+typedef struct {
+    int port;
+    const char *path;
+    int fd;
+    void *image;
+    size_t image_size;
+    super_t *superBlock;
+    char *inode_bitmap;
+    char *data_bitmap;
+    inode_t *inode_table;
+    char *data_region;
+    int numInode;
+    int sd;     // UDP socket
+    int tcp_sd; // TCP listener, -1 when unused
+    int active; // cleared by MFS_Shutdown
+    int readonly; // mapped read-only (-R); requests that modify it fail
+    shm_ring_t *shm_ring;
+    char shm_name[32];
+    char *dirty_lo; // range waiting for the next group commit
+    char *dirty_hi;
+    unsigned long dirty_gen;
+    unsigned long ops[STAT_OPS]; // per-volume counters, see stat_names
+    unsigned long errors;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    uint32_t *checksums; // per-block CRC32C table (mkfs -c), NULL when the image has none
+    char *crc_lo; // table entries updated by the current request, see persist_checksums
+    char *crc_hi;
+    unsigned long checksum_errors;
+    unsigned char *scrub_known; // per image block, a bit set once the scrub reported it; cleared by a rewrite
+    uint16_t *sector_map; // per data block, the sectors packed blocks use; NULL unless mkfs -z
+    int pack_blk;         // data block new packed blocks are added to, -1 for none
+    int pack_reuse[PACK_REUSE]; // data blocks packed blocks were freed from, refilled before fresh ones
+    int num_pack_reuse;
+    uint32_t *block_refs; // per data block, references from regular files; NULL unless mkfs -D
+    uint32_t *dedup_fp;   // per data block, fingerprint it is indexed under
+    int *dedup_next;      // per data block, next block in its bucket; -1 ends, -2 not indexed
+    int *dedup_bucket;    // fingerprint index heads, dedup_mask + 1 of them
+    uint32_t dedup_mask;
+    unsigned long dedup_hits;
+    readahead_t *readahead; // per inode
+    unsigned long readahead_blocks;
+    int replica_fd[MAX_REPLICAS]; // primary: TCP streams to its backups (-B), -1 for none
+    int standby;    // backup: clients may not modify the volume while its primary streams to it
+    uint32_t version; // requests that modified the volume, equal on a primary and its backups
+} image_t;
+
+image_t volumes[MAX_VOLUMES];
+int num_volumes = 0;
+
+// transports run on their own threads; requests are applied one at a time
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // create a socket and bind it to a port on the current machine
 // used to listen for incoming packets
 int UDP_Open(int port)
@@ -127,7 +216,7 @@ void set_bit_zero(unsigned int *bitmap, int position)
 {
     int index = position / 32;
     int offset = 31 - (position % 32);
-    bitmap[index] |= 0x0 << offset;
+    bitmap[index] &= ~(0x1 << offset);
 }
 
 /**
@@ -141,7 +230,7 @@ void set_bit_zero(unsigned int *bitmap, int position)
 int find_empty_set_bitmap(unsigned int *bitmap, int size, int *emptySlot)
 {
     int allocated = 0;
-    for (int i = 0; i <= size; i++)
+    for (int i = 0; i < size; i++)
     {
         if (get_bit(bitmap, i) == 0)
         {                       // find empty slot
@@ -171,19 +260,534 @@ int IsInoValid(int inum, int num_inodes, unsigned int *inode_bitmap)
     return 1;
 }
 
-void respondToServer(message reply, int replyNum, int sd, struct sockaddr_in *addr, int *rc)
+// zeros sent after a short read so every reply keeps the full message layout
+static const char zero_buf[BLOCK_SIZE];
+
+/**
+ * @brief Lay a reply out as an iovec: the header fields, the payload, padding
+ * up to the end of buf and the fields after it. The payload is taken from
+ * extents when given (a read served straight out of the image), otherwise
+ * from reply->buf.
+ *
+ * @param reply the reply header
+ * @param extents up to two payload ranges; NULL, or a first range without a
+ * base, sends reply->buf
+ * @param iov room for 5 entries
+ * @return int number of entries used
+ */
+int reply_iov(message *reply, struct iovec *extents, struct iovec *iov)
+{
+    int n = 0;
+    iov[n++] = (struct iovec){.iov_base = reply, .iov_len = offsetof(message, buf)};
+    if (extents == NULL || extents[0].iov_base == NULL)
+    {
+        iov[n++] = (struct iovec){.iov_base = reply->buf, .iov_len = sizeof(reply->buf)};
+    }
+    else
+    {
+        size_t len = 0;
+        for (int i = 0; i < 2 && extents[i].iov_len > 0; i++)
+        {
+            iov[n++] = extents[i];
+            len += extents[i].iov_len;
+        }
+        if (len < sizeof(reply->buf))
+            iov[n++] = (struct iovec){.iov_base = (void *)zero_buf, .iov_len = sizeof(reply->buf) - len};
+    }
+    size_t tail = offsetof(message, buf) + sizeof(reply->buf);
+    iov[n++] = (struct iovec){.iov_base = (char *)reply + tail, .iov_len = sizeof(message) - tail};
+    return n;
+}
+
+// a unix peer that never reads fills its receive queue, and a blocking send
+// would hold fs_lock until it did: its replies are dropped instead
+int reply_flags(struct sockaddr *addr)
+{
+    return addr->sa_family == AF_UNIX ? MSG_DONTWAIT : 0;
+}
+
+void respondToServer(message *reply, struct iovec *extents, int replyNum, int sd, struct sockaddr *addr, socklen_t addr_len, int *rc)
 {
     // sprintf(&(reply.msg), "%d", replyNum);
-    reply.msg_code = replyNum;
-    *rc = UDP_Write(sd, addr, (char *)&reply, sizeof(reply));
+    reply->msg_code = replyNum;
+    struct iovec iov[5];
+    struct msghdr mh = {.msg_name = addr, .msg_namelen = addr_len, .msg_iov = iov};
+    mh.msg_iovlen = reply_iov(reply, extents, iov);
+    *rc = sendmsg(sd, &mh, reply_flags(addr));
     printf("The Machine:: reply\n");
 }
 
+// create a unix domain datagram socket bound to path, for clients on this host.
+// delivery is reliable, so those clients need no retransmission timers.
+int UNIX_Open(const char *path)
+{
+    int fd;
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+    my_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(my_addr.sun_path))
+    {
+        close(fd);
+        return -1;
+    }
+    strcpy(my_addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// where persist() sends dirty ranges. By default each range is msync'd before
+// the request returns. The io_uring loop defers instead: ranges are collected
+// per volume and the replies go out once one fsync of their union completes.
+__thread int persist_deferred = 0;
+
+// the volume whose mapping contains addr, NULL if none does
+image_t *volume_of(void *addr)
+{
+    for (int v = 0; v < num_volumes; v++)
+    {
+        image_t *img = &volumes[v];
+        if ((char *)addr >= (char *)img->image && (char *)addr < (char *)img->image + img->image_size)
+            return img;
+    }
+    return NULL;
+}
+
+// msync [lo, hi) now, or add it to the volume's dirty range when deferred
+void persist_range(image_t *img, char *lo, char *hi)
+{
+    lo = (char *)((uintptr_t)lo & ~(uintptr_t)(BLOCK_SIZE - 1)); // msync wants page alignment
+    if (persist_deferred && img != NULL)
+    {
+        if (img->dirty_lo == NULL || lo < img->dirty_lo)
+            img->dirty_lo = lo;
+        if (img->dirty_hi == NULL || hi > img->dirty_hi)
+            img->dirty_hi = hi;
+        img->dirty_gen++;
+        return;
+    }
+    msync(lo, hi - lo, MS_SYNC);
+}
+
+/**
+ * @brief Make a modified range of the image durable, or queue it for the next
+ * group commit when persistence is deferred. On images with a checksum table
+ * the entries of the blocks the range touches are recomputed, so every
+ * modification must pass through here; the entries themselves are persisted
+ * once per request by persist_checksums.
+ *
+ * @param addr start of the modified range inside the mapping
+ * @param len length of the range in bytes
+ */
+void persist(void *addr, size_t len)
+{
+    image_t *img = volume_of(addr);
+    persist_range(img, addr, (char *)addr + len);
+    if (img == NULL || img->checksums == NULL || len == 0)
+        return;
+
+    super_t *superBlock = img->superBlock;
+    size_t first = ((char *)addr - (char *)img->image) / BLOCK_SIZE;
+    size_t last = ((char *)addr + len - 1 - (char *)img->image) / BLOCK_SIZE;
+    for (size_t blk = first; blk <= last; blk++)
+    {
+        if (blk >= (size_t)superBlock->checksum_addr && blk < (size_t)superBlock->checksum_addr + superBlock->checksum_len)
+            continue; // the table does not cover itself
+        img->checksums[blk] = CRC_Block(BLOCK_ADDR(img->image, blk));
+        if (img->scrub_known != NULL)
+            img->scrub_known[blk / 8] &= ~(1 << blk % 8);
+    }
+    char *lo = (char *)&img->checksums[first];
+    char *hi = (char *)&img->checksums[last + 1];
+    if (img->crc_lo == NULL || lo < img->crc_lo)
+        img->crc_lo = lo;
+    if (img->crc_hi == NULL || hi > img->crc_hi)
+        img->crc_hi = hi;
+}
+
+// persist the checksum entries the request updated, in one range
+void persist_checksums(image_t *img)
+{
+    if (img->crc_lo == NULL)
+        return;
+    persist_range(img, img->crc_lo, img->crc_hi);
+    img->crc_lo = img->crc_hi = NULL;
+}
+
+/**
+ * @brief Record in the super block whether the checksum table may be out of
+ * step with the blocks it covers. Entries are persisted apart from their
+ * blocks and the kernel writes mapped pages back in any order, so a crash can
+ * leave either one behind. A writable open sets the flag before the first
+ * modification and a clean shutdown clears it once the image is durable. The
+ * entry of the super block itself always reaches the disk after a set flag
+ * and before a cleared one, so a crash in between leaves the flag set.
+ *
+ * @param img a volume with a checksum table
+ * @param stale 1 to set the flag, 0 to clear it
+ * @return int 0 on success, -1 if it could not be made durable
+ */
+int checksums_mark(image_t *img, int stale)
+{
+    if (stale)
+    {
+        img->superBlock->checksum_stale = 1;
+        if (msync(img->image, BLOCK_SIZE, MS_SYNC) != 0)
+            return -1;
+        img->checksums[0] = CRC_Block(img->image);
+        return msync(img->checksums, BLOCK_SIZE, MS_SYNC);
+    }
+    char block[BLOCK_SIZE];
+    memcpy(block, img->image, BLOCK_SIZE);
+    ((super_t *)block)->checksum_stale = 0;
+    img->checksums[0] = CRC_Block(block);
+    if (msync(img->checksums, BLOCK_SIZE, MS_SYNC) != 0)
+        return -1;
+    img->superBlock->checksum_stale = 0;
+    return msync(img->image, BLOCK_SIZE, MS_SYNC);
+}
+
+/**
+ * @brief Recompute the checksum table from the blocks as they are, for an
+ * image that was not shut down cleanly. Blocks written just before the crash
+ * get their entries back; a block that was corrupt before it is accepted as
+ * it is.
+ *
+ * @param img a volume with a checksum table
+ * @return unsigned long the entries that changed
+ */
+unsigned long checksums_rebuild(image_t *img)
+{
+    super_t *superBlock = img->superBlock;
+    unsigned long changed = 0;
+    for (size_t blk = 0; blk < img->image_size / BLOCK_SIZE; blk++)
+    {
+        if (blk >= (size_t)superBlock->checksum_addr && blk < (size_t)superBlock->checksum_addr + superBlock->checksum_len)
+            continue;
+        uint32_t crc = CRC_Block(BLOCK_ADDR(img->image, blk));
+        if (crc != img->checksums[blk])
+        {
+            img->checksums[blk] = crc;
+            changed++;
+        }
+    }
+    msync(img->checksums, (size_t)superBlock->checksum_len * BLOCK_SIZE, MS_SYNC);
+    return changed;
+}
+
+/**
+ * @brief Check a block of the image against its entry in the checksum table
+ *
+ * @param image the mapped image
+ * @param superBlock its super block
+ * @param blk absolute block number
+ * @return int 0 if the block is intact or the image has no checksums, -1 if not
+ */
+int block_verify(void *image, super_t *superBlock, size_t blk)
+{
+    if (superBlock->checksum_len == 0)
+        return 0;
+    uint32_t *checksums = (uint32_t *)BLOCK_ADDR(image, superBlock->checksum_addr);
+    return CRC_Block(BLOCK_ADDR(image, blk)) == checksums[blk] ? 0 : -1;
+}
+
+// persist the bitmap word holding position, after it was set or cleared
+void persist_bit(char *bitmap, int position)
+{
+    persist((unsigned int *)bitmap + position / 32, sizeof(unsigned int));
+}
+
+/**
+ * @brief Decompress a packed block of a regular file
+ *
+ * @param ptr the direct[] entry, UFS_PACKED set
+ * @param out BLOCK_SIZE bytes for the contents
+ * @return int 0 on success, -1 if the block is corrupt
+ */
+int packed_load(void *image, super_t *superBlock, unsigned int ptr, char *out)
+{
+    size_t blk = UFS_PACKED_BLOCK(ptr);
+    int sector = UFS_PACKED_SECTOR(ptr);
+    if (blk >= (size_t)superBlock->num_data || block_verify(image, superBlock, superBlock->data_region_addr + blk) != 0)
+    {
+        fprintf(stderr, "packed block %#x is corrupt\n", ptr);
+        return -1;
+    }
+    unsigned char *src = (unsigned char *)BLOCK_ADDR(image, superBlock->data_region_addr + blk) + sector * UFS_SECTOR_SIZE;
+    uint16_t clen;
+    memcpy(&clen, src, sizeof(clen));
+    if (clen > BLOCK_SIZE - sector * UFS_SECTOR_SIZE - sizeof(clen) ||
+        LZ_Decompress(src + sizeof(clen), clen, (unsigned char *)out, BLOCK_SIZE) != BLOCK_SIZE)
+    {
+        fprintf(stderr, "packed block %#x is corrupt\n", ptr);
+        return -1;
+    }
+    return 0;
+}
+
+// the sectors a packed block occupies, as a mask over its data block
+uint16_t packed_mask(void *image, super_t *superBlock, unsigned int ptr)
+{
+    uint16_t clen;
+    memcpy(&clen, BLOCK_ADDR(image, superBlock->data_region_addr + UFS_PACKED_BLOCK(ptr)) + UFS_PACKED_SECTOR(ptr) * UFS_SECTOR_SIZE, sizeof(clen));
+    int nsec = UFS_PACKED_SECTORS(clen);
+    if (nsec > UFS_SECTORS - (int)UFS_PACKED_SECTOR(ptr))
+        nsec = UFS_SECTORS - UFS_PACKED_SECTOR(ptr);
+    return ((1u << nsec) - 1) << UFS_PACKED_SECTOR(ptr);
+}
+
+/**
+ * @brief Rebuild a compressed volume's sector map from its inodes. The map is
+ * derived state, so it is never written to the image.
+ *
+ * @param img the volume
+ */
+void sector_map_build(image_t *img)
+{
+    super_t *superBlock = img->superBlock;
+    img->sector_map = calloc(superBlock->num_data, sizeof(uint16_t));
+    img->pack_blk = -1;
+    for (int inum = 0; inum < img->numInode && inum < superBlock->num_inodes; inum++)
+    {
+        inode_t *inode = &img->inode_table[inum];
+        if (!get_bit((unsigned int *)img->inode_bitmap, inum) || inode->type != UFS_REGULAR_FILE)
+            continue;
+        for (int i = 0; i < DIRECT_PTRS; i++)
+        {
+            unsigned int ptr = inode->direct[i];
+            if (ptr != (unsigned int)-1 && (ptr & UFS_PACKED) && UFS_PACKED_BLOCK(ptr) < (unsigned int)superBlock->num_data)
+                img->sector_map[UFS_PACKED_BLOCK(ptr)] |= packed_mask(img->image, superBlock, ptr);
+        }
+    }
+}
+
+// first sector of a run of nsec free ones in blk, -1 if there is none
+int sector_run(image_t *img, int blk, int nsec)
+{
+    unsigned int need = (1u << nsec) - 1;
+    for (int sector = 0; sector + nsec <= UFS_SECTORS; sector++)
+    {
+        if (!(img->sector_map[blk] & need << sector))
+            return sector;
+    }
+    return -1;
+}
+
+/**
+ * @brief Find room for a packed block of nsec sectors. New packed blocks go
+ * into the current pack block until it is full, then into a data block that
+ * packed blocks were freed from, then into a fresh data block.
+ *
+ * @return unsigned int the direct[] entry for it, (unsigned)-1 when the data region is full
+ */
+unsigned int extent_alloc(image_t *img, int nsec)
+{
+    unsigned int need = (1u << nsec) - 1;
+    int sector = img->pack_blk >= 0 ? sector_run(img, img->pack_blk, nsec) : -1;
+    while (sector < 0 && img->num_pack_reuse > 0)
+    {
+        int blk = img->pack_reuse[--img->num_pack_reuse];
+        if (img->sector_map[blk] == 0)
+            continue; // emptied and freed since
+        img->pack_blk = blk;
+        sector = sector_run(img, blk, nsec);
+    }
+    if (sector >= 0)
+    {
+        img->sector_map[img->pack_blk] |= need << sector;
+        return UFS_PACK(img->pack_blk, sector);
+    }
+    int blk;
+    if (find_empty_set_bitmap((unsigned int *)img->data_bitmap, img->superBlock->num_data, &blk) == 0)
+        return -1;
+    persist_bit(img->data_bitmap, blk);
+    img->sector_map[blk] = need;
+    img->pack_blk = blk;
+    return UFS_PACK(blk, 0);
+}
+
+//
+// deduplication (mkfs -D): every data block a full-block write leaves behind
+// is indexed under a CRC32C fingerprint of its contents. A full-block write
+// whose contents are already in the index takes a reference to that block
+// instead of a block of its own. Blocks with more than one reference are
+// copied before a write changes them. The index and the reference counts
+// are rebuilt from the inodes at startup and never written to the image.
+//
+
+// fingerprint of a block's contents, the index key
+uint32_t dedup_fingerprint(const char *block)
+{
+    return CRC32C(block, BLOCK_SIZE);
+}
+
+void dedup_insert(image_t *img, int blk, uint32_t fp)
+{
+    int *head = &img->dedup_bucket[fp & img->dedup_mask];
+    img->dedup_fp[blk] = fp;
+    img->dedup_next[blk] = *head;
+    *head = blk;
+}
+
+// take blk out of the index before its contents change
+void dedup_remove(image_t *img, int blk)
+{
+    if (img->dedup_next[blk] == -2)
+        return;
+    int *link = &img->dedup_bucket[img->dedup_fp[blk] & img->dedup_mask];
+    while (*link != blk)
+        link = &img->dedup_next[*link];
+    *link = img->dedup_next[blk];
+    img->dedup_next[blk] = -2;
+}
+
+// an indexed block holding exactly block, -1 if there is none
+int dedup_find(image_t *img, const char *block, uint32_t fp)
+{
+    for (int blk = img->dedup_bucket[fp & img->dedup_mask]; blk >= 0; blk = img->dedup_next[blk])
+    {
+        if (img->dedup_fp[blk] == fp && memcmp(BLOCK_ADDR(img->data_region, blk), block, BLOCK_SIZE) == 0)
+            return blk;
+    }
+    return -1;
+}
+
+/**
+ * @brief Rebuild a deduplicated volume's reference counts and fingerprint
+ * index from its inodes
+ *
+ * @param img the volume
+ * @return int 0 on success, -1 when out of memory
+ */
+int dedup_build(image_t *img)
+{
+    super_t *superBlock = img->superBlock;
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)superBlock->num_data / 4)
+        buckets <<= 1;
+    img->dedup_mask = buckets - 1;
+    img->block_refs = calloc(superBlock->num_data, sizeof(uint32_t));
+    img->dedup_fp = malloc(superBlock->num_data * sizeof(uint32_t));
+    img->dedup_next = malloc(superBlock->num_data * sizeof(int));
+    img->dedup_bucket = malloc(buckets * sizeof(int));
+    if (img->block_refs == NULL || img->dedup_fp == NULL || img->dedup_next == NULL || img->dedup_bucket == NULL)
+        return -1;
+    for (int blk = 0; blk < superBlock->num_data; blk++)
+        img->dedup_next[blk] = -2;
+    memset(img->dedup_bucket, 0xff, buckets * sizeof(int)); // -1: empty
+    for (int inum = 0; inum < img->numInode && inum < superBlock->num_inodes; inum++)
+    {
+        inode_t *inode = &img->inode_table[inum];
+        if (!get_bit((unsigned int *)img->inode_bitmap, inum) || inode->type != UFS_REGULAR_FILE)
+            continue;
+        for (int i = 0; i < DIRECT_PTRS; i++)
+        {
+            unsigned int blk = inode->direct[i];
+            if (blk >= (unsigned int)superBlock->num_data)
+                continue;
+            if (img->block_refs[blk]++ == 0)
+                dedup_insert(img, blk, dedup_fingerprint(BLOCK_ADDR(img->data_region, blk)));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Rebuild the allocation state a volume keeps only in memory: where
+ * packed blocks go next, and the order of the fingerprint index. The same
+ * request can allocate different blocks from different states, so a backup
+ * starts its replication stream from the state its image implies, which is
+ * the state its primary opened the volume with.
+ *
+ * @param img the volume
+ * @return int 0 on success, -1 when out of memory
+ */
+int volume_rebuild(image_t *img)
+{
+    if (img->sector_map != NULL)
+    {
+        free(img->sector_map);
+        img->num_pack_reuse = 0;
+        sector_map_build(img);
+        if (img->sector_map == NULL)
+            return -1;
+    }
+    if (img->block_refs != NULL)
+    {
+        free(img->block_refs);
+        free(img->dedup_fp);
+        free(img->dedup_next);
+        free(img->dedup_bucket);
+        return dedup_build(img);
+    }
+    return 0;
+}
+
+/**
+ * @brief Release a regular file's block: a plain data block, or the sectors of
+ * a packed one. A data block is freed with its last sector, or on a
+ * deduplicated volume with its last reference.
+ *
+ * @param img the volume
+ * @param ptr the direct[] entry
+ */
+void extent_free(image_t *img, unsigned int ptr)
+{
+    int blk = ptr;
+    if (ptr & UFS_PACKED)
+    {
+        blk = UFS_PACKED_BLOCK(ptr);
+        img->sector_map[blk] &= ~packed_mask(img->image, img->superBlock, ptr);
+        if (img->sector_map[blk] != 0)
+        {
+            int listed = blk == img->pack_blk || __builtin_popcount(img->sector_map[blk]) > UFS_SECTORS / 2;
+            for (int i = 0; i < img->num_pack_reuse && !listed; i++)
+                listed = img->pack_reuse[i] == blk;
+            if (!listed && img->num_pack_reuse < PACK_REUSE)
+                img->pack_reuse[img->num_pack_reuse++] = blk;
+            return;
+        }
+        if (img->pack_blk == blk)
+            img->pack_blk = -1;
+    }
+    else if (img->block_refs != NULL)
+    {
+        if (--img->block_refs[blk] > 0)
+            return;
+        dedup_remove(img, blk);
+    }
+    set_bit_zero((unsigned int *)img->data_bitmap, blk);
+    persist_bit(img->data_bitmap, blk);
+}
+
 int findNoBlockAlloc(int offset, int nbytes)
 {
-    if (offset % BLOCK_SIZE == 0 && nbytes <= 4096)
-        return 1;
-    return offset / BLOCK_SIZE == (offset + nbytes) / BLOCK_SIZE ? 1 : 2;
+    return offset % BLOCK_SIZE + nbytes <= BLOCK_SIZE ? 1 : 2;
+}
+
+// a name that fits a dir_ent_t with its terminator
+int dir_name_fits(char *name)
+{
+    return memchr(name, '\0', sizeof(((dir_ent_t *)0)->name)) != NULL && name[0] != '\0';
+}
+
+// a name an entry may be created, renamed or unlinked under: fits, and is not ".", ".." or a path
+int dir_name_ok(char *name)
+{
+    return dir_name_fits(name) && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
 }
 
 /**
@@ -198,8 +802,8 @@ int findNoBlockAlloc(int offset, int nbytes)
  */
 int lookup(int pinum, char *name, inode_t *inode_table, char *data_region, int *inumPtr, int data_region_addr)
 {
-    if (inode_table[pinum].type == 1)
-    { // file should not be passed
+    if (inode_table[pinum].type == 1 || !dir_name_fits(name))
+    { // file should not be passed, and no entry has a name that long
         return 0;
     }
     inode_t parent = inode_table[pinum];
@@ -211,7 +815,7 @@ int lookup(int pinum, char *name, inode_t *inode_table, char *data_region, int *
         if (parent.direct[i] == (unsigned int)(-1)) // the directory is not valid{}
             continue;
         int curr = parent.direct[i] - data_region_addr;
-        char *namePosition = data_region + (BLOCK_SIZE * curr);
+        char *namePosition = BLOCK_ADDR(data_region, curr);
         char currName[28];
         if (currentChecked >= parentSize)
             break;
@@ -232,35 +836,113 @@ int lookup(int pinum, char *name, inode_t *inode_table, char *data_region, int *
     return found;
 }
 
-int rm_dir(int inum, inode_t *inode_table, char *data_region, char *data_bitmap, char *inode_bitmap)
+int rm_dir(int inum, inode_t *inode_table, char *data_region, char *data_bitmap, char *inode_bitmap, int data_region_addr)
 {
     inode_t metadata = inode_table[inum];
-    int size = metadata.size;
-    if (size > 2 * sizeof(dir_ent_t))
-        return -1;
+    // unlinks leave dead entries behind, so the size says nothing about emptiness
+    int per_block = BLOCK_SIZE / sizeof(dir_ent_t);
+    int entries = metadata.size / sizeof(dir_ent_t);
+    for (int e = 2; e < entries && e / per_block < DIRECT_PTRS; e++) // past "." and ".."
+    {
+        unsigned int blk = metadata.direct[e / per_block];
+        if (blk == (unsigned int)-1)
+            continue;
+        dir_ent_t *ent = (dir_ent_t *)BLOCK_ADDR(data_region, blk - data_region_addr) + e % per_block;
+        if (ent->inum != -1)
+            return -1;
+    }
     for (int i = 0; i < DIRECT_PTRS; i++)
     {
         unsigned int data_addr = metadata.direct[i];
         if (data_addr == (unsigned int)-1)
             continue;
-        set_bit_zero((unsigned int *)data_bitmap, data_addr);
+        set_bit_zero((unsigned int *)data_bitmap, data_addr - data_region_addr); // directories hold absolute block numbers
+        persist_bit(data_bitmap, data_addr - data_region_addr);
     }
     set_bit_zero((unsigned int *)inode_bitmap, inum);
+    persist_bit(inode_bitmap, inum);
     return 0;
 }
 
 int rm_file(int inum, inode_t *inode_table, char *data_bitmap, char *inode_bitmap)
 {
     inode_t metadata = inode_table[inum];
+    image_t *img = volume_of(data_bitmap);
     for (int i = 0; i < DIRECT_PTRS; i++)
     {
         unsigned int data_addr = metadata.direct[i];
         if (data_addr == (unsigned int)-1)
             continue;
+        if (img != NULL && (img->sector_map != NULL || img->block_refs != NULL))
+        {
+            // packed or shared blocks: extent_free knows when the data block goes
+            extent_free(img, data_addr);
+            continue;
+        }
         set_bit_zero((unsigned int *)data_bitmap, data_addr);
+        persist_bit(data_bitmap, data_addr);
     }
     set_bit_zero((unsigned int *)inode_bitmap, inum);
+    persist_bit(inode_bitmap, inum);
+
+    return 0;
+}
+
+// entry e of directory pinum inside the image, NULL when its block is not allocated
+dir_ent_t *dir_entry(image_t *img, int pinum, int e)
+{
+    int per_block = BLOCK_SIZE / sizeof(dir_ent_t);
+    unsigned int blk = e / per_block < DIRECT_PTRS ? img->inode_table[pinum].direct[e / per_block] : (unsigned int)-1;
+    if (blk == (unsigned int)-1)
+        return NULL;
+    return (dir_ent_t *)BLOCK_ADDR(img->image, blk) + e % per_block; // directories hold absolute block numbers
+}
+
+/**
+ * @brief Find where a new entry of directory pinum goes: the first entry an
+ * unlink left dead, else the one at its size
+ *
+ * @param img the volume
+ * @param pinum the directory
+ * @return int the entry's index, -1 when the directory's blocks are full
+ */
+int dir_slot(image_t *img, int pinum)
+{
+    int entries = img->inode_table[pinum].size / sizeof(dir_ent_t);
+    for (int e = 2; e < entries; e++) // past "." and ".."
+    {
+        dir_ent_t *ent = dir_entry(img, pinum, e);
+        if (ent != NULL && ent->inum == -1)
+            return e;
+    }
+    return dir_entry(img, pinum, entries) != NULL ? entries : -1;
+}
 
+/**
+ * @brief Add an entry to a directory, in the slot dir_slot picks
+ *
+ * @param img the volume
+ * @param pinum the directory
+ * @param name the entry's name, checked with dir_name_ok
+ * @param inum the inode it names
+ * @return int 0 on success, -1 when the directory's blocks are full
+ */
+int dir_append(image_t *img, int pinum, char *name, int inum)
+{
+    inode_t *parent = &img->inode_table[pinum];
+    int e = dir_slot(img, pinum);
+    if (e < 0)
+        return -1;
+    dir_ent_t *ent = dir_entry(img, pinum, e);
+    memset(ent->name, 0, sizeof(ent->name));
+    strcpy(ent->name, name);
+    ent->inum = inum;
+    persist(ent, sizeof(dir_ent_t));
+    if (e == parent->size / (int)sizeof(dir_ent_t))
+    {
+        parent->size += sizeof(dir_ent_t);
+        persist(parent, sizeof(inode_t));
+    }
     return 0;
 }
 
@@ -279,9 +961,15 @@ int rm_file(int inum, inode_t *inode_table, char *data_bitmap, char *inode_bitma
  */
 int MFS_create(int pinum, int type, char *name, inode_t *inode_table, char *data_region, char *data_bitmap, char *inode_bitmap, super_t *superBlock)
 {
-
-    if (strlen(name) > 28)
-    { // check if the pinum is valid
+    image_t *img = volume_of(inode_table);
+    image_t bare;
+    if (img == NULL)
+    { // an image no volume serves, as in mfsperf: the directory helpers only need the mapping
+        bare = (image_t){.image = data_region - (size_t)superBlock->data_region_addr * BLOCK_SIZE, .superBlock = superBlock, .inode_table = inode_table, .data_region = data_region};
+        img = &bare;
+    }
+    if (!dir_name_ok(name))
+    { // too long names are refused rather than cut short
         return -1;
     }
     int inum;
@@ -291,8 +979,8 @@ int MFS_create(int pinum, int type, char *name, inode_t *inode_table, char *data
     }
 
     inode_t metadata = inode_table[pinum]; // meta data of the file/dir to create
-    if (metadata.type == 1)
-    { // cannot create a file inside a file
+    if (metadata.type == 1 || dir_slot(img, pinum) < 0)
+    { // cannot create a file inside a file, nor in a full directory
         return -1;
     }
 
@@ -311,14 +999,17 @@ int MFS_create(int pinum, int type, char *name, inode_t *inode_table, char *data
             return -1;
         }
         inode_table[emptySlot].direct[0] = emptySlot2 + superBlock->data_region_addr;
+        for (int i = 1; i < DIRECT_PTRS; i++)
+            inode_table[emptySlot].direct[i] = (unsigned)-1;
         int datablock_no = emptySlot2;
         dir_ent_t self = {
             ".", emptySlot};
         dir_ent_t parent = {
             "..", pinum};
-        memcpy(data_region + datablock_no * BLOCK_SIZE, &self, sizeof(dir_ent_t));
-        memcpy(data_region + datablock_no * BLOCK_SIZE + sizeof(dir_ent_t), &parent, sizeof(dir_ent_t));
-        msync(data_region + datablock_no * BLOCK_SIZE, sizeof(dir_ent_t) * 2, MS_SYNC);
+        memcpy(BLOCK_ADDR(data_region, datablock_no), &self, sizeof(dir_ent_t));
+        memcpy(BLOCK_ADDR(data_region, datablock_no) + sizeof(dir_ent_t), &parent, sizeof(dir_ent_t));
+        persist(BLOCK_ADDR(data_region, datablock_no), sizeof(dir_ent_t) * 2);
+        persist_bit(data_bitmap, emptySlot2);
     }
     else
     { // create a file
@@ -328,25 +1019,53 @@ int MFS_create(int pinum, int type, char *name, inode_t *inode_table, char *data
             inode_table[emptySlot].direct[i] = (unsigned)-1;
     }
 
-    dir_ent_t temp = {.inum = emptySlot};
-    memcpy((char *)&temp, name, 20);
-    temp.name[19] = '\0';
-    int parentSize = metadata.size;
-    int blockNum = parentSize / BLOCK_SIZE;
-    int blockOffset = parentSize % BLOCK_SIZE;
-
-    int curr = metadata.direct[blockNum] - superBlock->data_region_addr;
-    memcpy(data_region + BLOCK_SIZE * curr + blockOffset, &temp, sizeof(dir_ent_t));
-    inode_table[pinum].size = inode_table[pinum].size + sizeof(dir_ent_t);
+    persist_bit(inode_bitmap, emptySlot);
+    persist(inode_table + emptySlot, sizeof(inode_t));
+    return dir_append(img, pinum, name, emptySlot);
+}
 
-    msync(inode_bitmap, superBlock->inode_bitmap_len * BLOCK_SIZE, MS_SYNC);
-    msync(data_bitmap, superBlock->data_bitmap_len * BLOCK_SIZE, MS_SYNC);
-    msync(inode_table + emptySlot, sizeof(inode_t), MS_SYNC);
+/**
+ * @brief Find the contents of one block of a file or directory, checking its
+ * checksum on the way. A packed block is decompressed into scratch.
+ *
+ * @param metadata the inode the block belongs to
+ * @param ptr its direct[] entry, not (unsigned)-1
+ * @param scratch BLOCK_SIZE bytes for a decompressed block
+ * @param block set to the block's bytes
+ * @return int 0 on success, -2 when the block is corrupt
+ */
+int file_block(void *image, super_t *superBlock, inode_t *metadata, unsigned int ptr, char *scratch, char **block)
+{
+    if (metadata->type == UFS_REGULAR_FILE && (ptr & UFS_PACKED))
+    {
+        if (packed_load(image, superBlock, ptr, scratch) != 0)
+            return -2;
+        *block = scratch;
+        return 0;
+    }
+    size_t blk = metadata->type == UFS_DIRECTORY ? ptr : (size_t)superBlock->data_region_addr + ptr; // directories hold absolute block numbers
+    if (block_verify(image, superBlock, blk) != 0)
+    {
+        fprintf(stderr, "checksum mismatch in block %zu\n", blk);
+        return -2;
+    }
+    *block = BLOCK_ADDR(image, blk);
     return 0;
 }
 
-int MFS_read(int nbytes, int offset, int inum, inode_t *inode_table, void *image, super_t *superBlock, char *buffer)
+/**
+ * @brief Locate the bytes a read covers inside the image without copying them.
+ * Packed blocks are the exception: they are decompressed into a per-thread
+ * buffer, valid until the thread's next read.
+ *
+ * @param extents filled with up to two ranges of the mapped image; an unused
+ * second range has length 0
+ * @return int 0 on success, -1 on an invalid read, -2 when a block the read
+ * covers is corrupt
+ */
+int read_extents(int nbytes, int offset, int inum, inode_t *inode_table, void *image, super_t *superBlock, struct iovec extents[2])
 {
+    static __thread char unpacked[2][BLOCK_SIZE];
     if (nbytes <= 0 || nbytes > BLOCK_SIZE || offset < 0 || offset + nbytes > BLOCK_SIZE * DIRECT_PTRS)
     {
         return -1;
@@ -361,42 +1080,101 @@ int MFS_read(int nbytes, int offset, int inum, inode_t *inode_table, void *image
         }
     }
 
+    extents[1] = (struct iovec){.iov_base = NULL, .iov_len = 0};
     int no_block_to_read = findNoBlockAlloc(offset, nbytes); // how many blocks will be read
-    unsigned int comparison = -1;
-    int no_bytes_to_read_1 = no_block_to_read == 2 ? BLOCK_SIZE - offset : nbytes; // number of bytes to be read from first block
-
-    int startAddrFirstBlockOffset = offset % BLOCK_SIZE;                              // startin addr of read in first block
-    int no_bytes_to_read_2 = no_block_to_read == 1 ? 0 : nbytes - no_bytes_to_read_1; // number of bytes to be read from second block
-
-    int locationFirstBlock = offset / BLOCK_SIZE;
-    int locationFirstBlockNum = metadata.direct[locationFirstBlock];
-    int locationSecondBlock = locationFirstBlock + 1; // prove this
-    int locationSecondBlockNum = metadata.direct[locationSecondBlock];
-
-    // Operation on First Block
-    int firstBlockAllocated = locationFirstBlockNum == comparison ? 0 : 1;
-    if (firstBlockAllocated == 0)
+    for (int i = 0, done = 0; i < no_block_to_read; i++)
     {
-        return -1;
+        int pos = offset + done;
+        int n = BLOCK_SIZE - pos % BLOCK_SIZE < nbytes - done ? BLOCK_SIZE - pos % BLOCK_SIZE : nbytes - done;
+        unsigned int ptr = metadata.direct[pos / BLOCK_SIZE];
+        if (ptr == (unsigned int)-1) // not allocated
+        {
+            return -1;
+        }
+        char *block;
+        int rc = file_block(image, superBlock, &metadata, ptr, unpacked[i], &block);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        extents[i] = (struct iovec){.iov_base = block + pos % BLOCK_SIZE, .iov_len = n};
+        done += n;
     }
+    return 0;
+}
 
-    char *startAddr = image + superBlock->data_region_addr * BLOCK_SIZE + BLOCK_SIZE * locationFirstBlockNum + startAddrFirstBlockOffset;
+int MFS_read(int nbytes, int offset, int inum, inode_t *inode_table, void *image, super_t *superBlock, char *buffer)
+{
+    struct iovec extents[2];
+    int rc = read_extents(nbytes, offset, inum, inode_table, image, superBlock, extents);
+    if (rc != 0)
+    {
+        return rc;
+    }
     // Read
-    memcpy(buffer, startAddr, no_bytes_to_read_1);
+    memcpy(buffer, extents[0].iov_base, extents[0].iov_len);
+    if (extents[1].iov_len > 0)
+        memcpy(buffer + extents[0].iov_len, extents[1].iov_base, extents[1].iov_len);
+    return 0;
+}
 
-    if (no_block_to_read == 2)
+/**
+ * @brief Follow the reads of an inode and, once they turn sequential, have the
+ * kernel page in the blocks the reader asks for next. A file's blocks are
+ * scattered over the data region, so the kernel's own readahead on the
+ * mapping does not find them. Every block is advised once per streak.
+ *
+ * @param img the volume
+ * @param inum the inode just read
+ * @param offset the offset of the read
+ * @param nbytes its length
+ */
+void read_ahead(image_t *img, int inum, int offset, int nbytes)
+{
+    readahead_t *ra = &img->readahead[inum];
+    int sequential = offset == ra->next;
+    ra->next = offset + nbytes;
+    if (!sequential)
     {
-        // Operation on Second Block
-        int secondBlockAllocated = locationSecondBlockNum == comparison ? 0 : 1;
-        if (secondBlockAllocated == 0)
+        ra->window = 0;
+        ra->ahead = 0;
+        return;
+    }
+    ra->window = ra->window == 0 ? RA_MIN : ra->window * 2 > RA_MAX ? RA_MAX : ra->window * 2;
+
+    inode_t *inode = &img->inode_table[inum];
+    int next_blk = (offset + nbytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int first = ra->ahead > next_blk ? ra->ahead : next_blk;
+    int end = next_blk + ra->window;
+    int blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > blocks)
+        end = blocks;
+    if (end > DIRECT_PTRS)
+        end = DIRECT_PTRS;
+    char *run = NULL; // adjacent blocks go to the kernel in one call
+    size_t run_len = 0;
+    for (int i = first; i < end; i++)
+    {
+        unsigned int ptr = inode->direct[i];
+        if (ptr == (unsigned int)-1)
+            continue;
+        size_t blk = inode->type == UFS_DIRECTORY ? ptr : (size_t)img->superBlock->data_region_addr + (ptr & UFS_PACKED ? UFS_PACKED_BLOCK(ptr) : ptr);
+        char *addr = BLOCK_ADDR(img->image, blk);
+        img->readahead_blocks++;
+        if (run_len > 0 && run + run_len == addr)
         {
-            return -1;
+            run_len += BLOCK_SIZE;
+            continue;
         }
-        char *startAddr2 = image + superBlock->data_region_addr * BLOCK_SIZE + BLOCK_SIZE * locationSecondBlockNum;
-        // Read
-        memcpy(buffer + no_bytes_to_read_1, startAddr2, no_bytes_to_read_2);
+        if (run_len > 0)
+            madvise(run, run_len, MADV_WILLNEED);
+        run = addr;
+        run_len = BLOCK_SIZE;
     }
-    return 0;
+    if (run_len > 0)
+        madvise(run, run_len, MADV_WILLNEED);
+    if (end > ra->ahead)
+        ra->ahead = end;
 }
 
 /**
@@ -430,14 +1208,14 @@ int MFS_write(int nbytes, int offset, int inum, inode_t *inode_table, char *data
     int numBlockToWrite = findNoBlockAlloc(offset, nbytes); // Number of Data Block To Write: 1 or 2
     unsigned int comparison = -1;
 
-    int numByteToWriteFirstBlock = numBlockToWrite == 2 ? BLOCK_SIZE - offset : nbytes;
+    int numByteToWriteFirstBlock = numBlockToWrite == 2 ? BLOCK_SIZE - offset % BLOCK_SIZE : nbytes;
     int startAddrFirstBlockOffset = offset % BLOCK_SIZE;
     int numByteToWriteSecondBlock = numBlockToWrite == 1 ? 0 : nbytes - numByteToWriteFirstBlock;
 
     int locationFirstBlock = offset / BLOCK_SIZE;
     int locationFirstBlockNum = metadata.direct[locationFirstBlock];
     int locationSecondBlock = locationFirstBlock + 1; // prove this
-    int locationSecondBlockNum = metadata.direct[locationSecondBlock];
+    int locationSecondBlockNum = numBlockToWrite == 2 ? metadata.direct[locationSecondBlock] : -1;
 
     // Operation on First Block
     int firstBlockAllocated = locationFirstBlockNum == comparison ? 0 : 1;
@@ -446,6 +1224,8 @@ int MFS_write(int nbytes, int offset, int inum, inode_t *inode_table, char *data
     {
         firstBlockAllocated = find_empty_set_bitmap((unsigned int *)data_bitmap, superBlock->num_data, &emptySlot);
         metadata.direct[locationFirstBlock] = emptySlot;
+        if (firstBlockAllocated)
+            persist_bit(data_bitmap, emptySlot);
     }
     
     locationFirstBlockNum = metadata.direct[locationFirstBlock];
@@ -455,10 +1235,10 @@ int MFS_write(int nbytes, int offset, int inum, inode_t *inode_table, char *data
         return -1;
     }
 
-    char *startAddr = image + superBlock->data_region_addr * BLOCK_SIZE + BLOCK_SIZE * locationFirstBlockNum + startAddrFirstBlockOffset;
+    char *startAddr = BLOCK_ADDR(image, (size_t)superBlock->data_region_addr + locationFirstBlockNum) + startAddrFirstBlockOffset;
     // Write to persistency file
     memcpy(startAddr, buffer, numByteToWriteFirstBlock);
-    msync(startAddr, numByteToWriteFirstBlock, MS_SYNC);
+    persist(startAddr, numByteToWriteFirstBlock);
 
     if (numBlockToWrite == 2)
     {
@@ -468,6 +1248,8 @@ int MFS_write(int nbytes, int offset, int inum, inode_t *inode_table, char *data
         {
             secondBlockAllocated = find_empty_set_bitmap((unsigned int *)data_bitmap, superBlock->num_data, &emptySlot);
             metadata.direct[locationSecondBlock] = emptySlot;
+            if (secondBlockAllocated)
+                persist_bit(data_bitmap, emptySlot);
         }
 
         
@@ -478,28 +1260,222 @@ int MFS_write(int nbytes, int offset, int inum, inode_t *inode_table, char *data
             return -1;
         }
 
-        char *startAddr2 = image + superBlock->data_region_addr * BLOCK_SIZE + BLOCK_SIZE * locationSecondBlockNum;
+        char *startAddr2 = BLOCK_ADDR(image, (size_t)superBlock->data_region_addr + locationSecondBlockNum);
         // Write to persistency file
-        memcpy(startAddr2, buffer, numByteToWriteSecondBlock);
-        msync(startAddr2, numByteToWriteSecondBlock, MS_SYNC);
+        memcpy(startAddr2, buffer + numByteToWriteFirstBlock, numByteToWriteSecondBlock);
+        persist(startAddr2, numByteToWriteSecondBlock);
     }
 
     // update the size accordingly
     metadata.size = (nbytes + offset) > metadata.size ? nbytes + offset : metadata.size;
 
-    msync(inode_bitmap, superBlock->inode_bitmap_len * BLOCK_SIZE, MS_SYNC);
-    msync(data_bitmap, superBlock->data_bitmap_len * BLOCK_SIZE, MS_SYNC);
     memcpy(inode_table + inum, &metadata, sizeof(inode_t));
-    msync(inode_table, superBlock->num_inodes * BLOCK_SIZE, MS_SYNC);
+    persist(inode_table + inum, sizeof(inode_t));
     return 0;
 }
 
+/**
+ * @brief Store one block of a regular file on a compressed volume. The block
+ * is written to a new place and the old one released afterwards, so a
+ * failure leaves the old contents in place. Blocks that would not save a
+ * sector stay plain data blocks and are rewritten in place.
+ *
+ * @param img the volume
+ * @param block the new contents, BLOCK_SIZE bytes
+ * @param old the block's current direct[] entry, (unsigned)-1 if none
+ * @return unsigned int the new direct[] entry, (unsigned)-1 when the data region is full
+ */
+unsigned int block_store(image_t *img, char *block, unsigned int old)
+{
+    unsigned char packed[BLOCK_SIZE];
+    uint16_t clen = LZ_Compress((unsigned char *)block, BLOCK_SIZE, packed + sizeof(clen), (UFS_SECTORS - 1) * UFS_SECTOR_SIZE - sizeof(clen));
+    unsigned int ptr;
+    char *dst;
+    size_t len;
+    if (clen == 0)
+    {
+        int blk;
+        if (old != (unsigned int)-1 && !(old & UFS_PACKED))
+        {
+            blk = old;
+        }
+        else
+        {
+            if (find_empty_set_bitmap((unsigned int *)img->data_bitmap, img->superBlock->num_data, &blk) == 0)
+                return -1;
+            persist_bit(img->data_bitmap, blk);
+        }
+        ptr = blk;
+        dst = BLOCK_ADDR(img->data_region, blk);
+        memcpy(dst, block, BLOCK_SIZE);
+        len = BLOCK_SIZE;
+    }
+    else
+    {
+        ptr = extent_alloc(img, UFS_PACKED_SECTORS(clen));
+        if (ptr == (unsigned int)-1)
+            return -1;
+        memcpy(packed, &clen, sizeof(clen));
+        dst = BLOCK_ADDR(img->data_region, UFS_PACKED_BLOCK(ptr)) + UFS_PACKED_SECTOR(ptr) * UFS_SECTOR_SIZE;
+        len = sizeof(clen) + clen;
+        memcpy(dst, packed, len);
+    }
+    persist(dst, len);
+    if (old != (unsigned int)-1 && old != ptr)
+        extent_free(img, old);
+    return ptr;
+}
+
+/**
+ * @brief MFS_write for compressed volumes: each block the write covers is
+ * decompressed, patched and compressed again
+ *
+ * @param img the volume
+ * @return int 0 on success, -1 on failure
+ */
+int MFS_write_packed(image_t *img, int nbytes, int offset, int inum, char *buffer)
+{
+    if (nbytes <= 0 || nbytes > BLOCK_SIZE || offset < 0 || offset + nbytes > BLOCK_SIZE * DIRECT_PTRS)
+    {
+        return -1;
+    }
+    inode_t *inode = img->inode_table + inum;
+    if (inode->type != UFS_REGULAR_FILE)
+    {
+        return -1;
+    }
+
+    int res = 0;
+    for (int done = 0; done < nbytes;)
+    {
+        int pos = offset + done;
+        int n = BLOCK_SIZE - pos % BLOCK_SIZE < nbytes - done ? BLOCK_SIZE - pos % BLOCK_SIZE : nbytes - done;
+        unsigned int old = inode->direct[pos / BLOCK_SIZE];
+        char scratch[BLOCK_SIZE], *block = scratch;
+        if (old == (unsigned int)-1)
+        {
+            memset(scratch, 0, BLOCK_SIZE);
+        }
+        else if (file_block(img->image, img->superBlock, inode, old, scratch, &block) != 0)
+        {
+            res = -1;
+            break;
+        }
+        if (block != scratch)
+            memcpy(scratch, block, BLOCK_SIZE);
+        memcpy(scratch + pos % BLOCK_SIZE, buffer + done, n);
+
+        unsigned int ptr = block_store(img, scratch, old);
+        if (ptr == (unsigned int)-1)
+        {
+            res = -1;
+            break;
+        }
+        inode->direct[pos / BLOCK_SIZE] = ptr;
+        done += n;
+    }
+    if (res == 0 && offset + nbytes > inode->size)
+        inode->size = offset + nbytes;
+    persist(inode, sizeof(inode_t));
+    return res;
+}
+
+/**
+ * @brief MFS_write for deduplicated volumes. A full block whose contents are
+ * already stored is mapped to that block; anything else gets a block of its
+ * own, written in place when the file holds the only reference.
+ *
+ * @param img the volume
+ * @return int 0 on success, -1 on failure
+ */
+int MFS_write_dedup(image_t *img, int nbytes, int offset, int inum, char *buffer)
+{
+    if (nbytes <= 0 || nbytes > BLOCK_SIZE || offset < 0 || offset + nbytes > BLOCK_SIZE * DIRECT_PTRS)
+    {
+        return -1;
+    }
+    inode_t *inode = img->inode_table + inum;
+    if (inode->type != UFS_REGULAR_FILE)
+    {
+        return -1;
+    }
+
+    int res = 0;
+    for (int done = 0; done < nbytes;)
+    {
+        int pos = offset + done;
+        int n = BLOCK_SIZE - pos % BLOCK_SIZE < nbytes - done ? BLOCK_SIZE - pos % BLOCK_SIZE : nbytes - done;
+        int full = n == BLOCK_SIZE;
+        unsigned int old = inode->direct[pos / BLOCK_SIZE];
+        uint32_t fp = 0;
+        if (full)
+        {
+            fp = dedup_fingerprint(buffer + done);
+            int match = dedup_find(img, buffer + done, fp);
+            if (match >= 0)
+            {
+                img->dedup_hits++;
+                if (match != old)
+                {
+                    img->block_refs[match]++;
+                    if (old != (unsigned int)-1)
+                        extent_free(img, old);
+                    inode->direct[pos / BLOCK_SIZE] = match;
+                }
+                done += n;
+                continue;
+            }
+        }
+
+        int blk;
+        if (old != (unsigned int)-1 && img->block_refs[old] == 1)
+        {
+            blk = old; // the only reference: change it in place
+            dedup_remove(img, blk);
+            memcpy(BLOCK_ADDR(img->data_region, blk) + pos % BLOCK_SIZE, buffer + done, n);
+            persist(BLOCK_ADDR(img->data_region, blk) + pos % BLOCK_SIZE, n);
+        }
+        else
+        {
+            if (find_empty_set_bitmap((unsigned int *)img->data_bitmap, img->superBlock->num_data, &blk) == 0)
+            {
+                res = -1;
+                break;
+            }
+            persist_bit(img->data_bitmap, blk);
+            img->block_refs[blk] = 1;
+            char *dst = BLOCK_ADDR(img->data_region, blk);
+            if (old != (unsigned int)-1)
+            {
+                memcpy(dst, BLOCK_ADDR(img->data_region, old), BLOCK_SIZE); // copy on write
+                img->block_refs[old]--;
+            }
+            else
+            {
+                memset(dst, 0, BLOCK_SIZE);
+            }
+            memcpy(dst + pos % BLOCK_SIZE, buffer + done, n);
+            persist(dst, BLOCK_SIZE);
+            inode->direct[pos / BLOCK_SIZE] = blk;
+        }
+        if (full)
+            dedup_insert(img, blk, fp);
+        done += n;
+    }
+    if (res == 0 && offset + nbytes > inode->size)
+        inode->size = offset + nbytes;
+    persist(inode, sizeof(inode_t));
+    return res;
+}
+
 int 
-MFS_unlink(int pinum, char * name, char * data_region, super_t * superBlock, inode_t * inode_table, char * data_bitmap, char * inode_bitmap, void * image, int image_size){
+MFS_unlink(int pinum, char * name, char * data_region, super_t * superBlock, inode_t * inode_table, char * data_bitmap, char * inode_bitmap){
 
     int inum;
     int res = -1;
 
+    if (!dir_name_ok(name)) // "." and ".." go with their directory
+        return -1;
     int found = lookup(pinum, name, inode_table, data_region, &inum, superBlock->data_region_addr);
     if (found == 0) // not found
     {
@@ -509,7 +1485,7 @@ MFS_unlink(int pinum, char * name, char * data_region, super_t * superBlock, ino
     if (metadata.type == 1)
         res = rm_file(inum, inode_table, data_bitmap, inode_bitmap);
     else
-        res = rm_dir(inum, inode_table, data_region, data_bitmap, inode_bitmap);
+        res = rm_dir(inum, inode_table, data_region, data_bitmap, inode_bitmap, superBlock->data_region_addr);
     if (res == -1)
         return res;
     // parent 删除 name
@@ -520,185 +1496,1946 @@ MFS_unlink(int pinum, char * name, char * data_region, super_t * superBlock, ino
         unsigned int curr = parent.direct[i];
         if (curr == (unsigned int)(-1)) // the directory is not valid{}
             continue;
-        char *namePosition = data_region + (BLOCK_SIZE * (curr - superBlock->data_region_addr)) ;
+        char *namePosition = BLOCK_ADDR(data_region, curr - superBlock->data_region_addr);
         char currName[28];
         for (int j = 0; j < BLOCK_SIZE / sizeof(dir_ent_t); j++)
         {
             memcpy(&currName, namePosition + (j * sizeof(dir_ent_t)), 28);
-            if (strcmp(currName, name) == 0)
+            // an earlier unlink of the same name leaves a dead entry behind; skip it
+            if (strcmp(currName, name) == 0 && *(int *)(namePosition + (j * sizeof(dir_ent_t)) + 28) == inum)
             {
                 found = 1;
                 *(int *)(namePosition + (j * sizeof(dir_ent_t)) + 28 * sizeof(char)) = -1;
+                persist(namePosition + (j * sizeof(dir_ent_t)), sizeof(dir_ent_t));
                 break;
             }
         }
         if (found == 1)
             break;
     }
-    if (res != -1) {
-        parent.size -= sizeof(dir_ent_t);
-        memcpy(inode_table + pinum, &metadata, sizeof(dir_ent_t));
-    }
-    // hahahahaha
-    msync(image, image_size, MS_SYNC);
+    // the parent inode stays as it is: new entries are appended at its size,
+    // so shrinking it would let the next create overwrite a live entry
     return res;
 }
 
-int 
-MFS_stat(message * reply_msg_ptr, inode_t * inode_table, int inum){
-
-    inode_t metadata = inode_table[inum];
-    reply_msg_ptr->param1 = metadata.size; // size of the inode
-    reply_msg_ptr->param2 = metadata.type; // type of the inode
-    return 0;
-}
-
-int main(int argc, char const *argv[])
+/**
+ * @brief Find the live entry called name in directory pinum
+ *
+ * @param img the volume
+ * @param pinum the directory
+ * @param name the entry's name
+ * @return dir_ent_t* the entry inside the image, NULL if there is none
+ */
+dir_ent_t *dir_find(image_t *img, int pinum, char *name)
 {
-    printf("Hello From Server \n");
-    // Get length of the argument
-    int length = 0;
-    char const *curr = argv[0];
-    while (curr != NULL)
+    inode_t *dir = &img->inode_table[pinum];
+    int entries = dir->size / sizeof(dir_ent_t);
+    for (int e = 0; e < entries; e++)
     {
-        length++;
-        curr = argv[length];
+        unsigned int blk = dir->direct[e / (BLOCK_SIZE / sizeof(dir_ent_t))];
+        if (blk == (unsigned int)-1)
+            continue;
+        dir_ent_t *ent = (dir_ent_t *)BLOCK_ADDR(img->image, blk) + e % (BLOCK_SIZE / sizeof(dir_ent_t)); // directories hold absolute block numbers
+        if (ent->inum != -1 && strncmp(ent->name, name, sizeof(ent->name)) == 0)
+            return ent;
     }
+    return NULL;
+}
 
-    // server [portnum] [image], argument number has to be 3.
-    assert(length == 3);
-
-    // Convert arguments to variables of port number and file image filename.
-    int portnum = atoi(argv[1]);
-    char const *fileImage = argv[2];
-
-    // Sanity check
-    printf("portnum: %d\nfileImage: %s \n", portnum, fileImage);
+/**
+ * @brief Move the entry src_name of directory src_pinum to dst_name in
+ * dst_pinum. Only directory entries change: the inode and its blocks stay
+ * where they are. A regular file already called dst_name is replaced and
+ * freed; any other existing target fails the rename. A directory cannot move
+ * below itself, and its ".." follows it.
+ *
+ * Within one directory the entry is renamed in place. Across directories the
+ * new entry is written before the old one is cleared, so a crash in between
+ * leaves a second link that mfsck drops rather than losing the file.
+ *
+ * @param img the volume
+ * @param src_pinum directory holding the entry
+ * @param src_name its name
+ * @param dst_pinum directory to move it to
+ * @param dst_name its new name, shorter than dir_ent_t.name
+ * @return int 0 on success, -1 on failure
+ */
+int MFS_rename(image_t *img, int src_pinum, char *src_name, int dst_pinum, char *dst_name)
+{
+    inode_t *inode_table = img->inode_table;
+    if (!IsInoValid(dst_pinum, img->numInode, (unsigned int *)img->inode_bitmap) ||
+        inode_table[src_pinum].type != UFS_DIRECTORY || inode_table[dst_pinum].type != UFS_DIRECTORY)
+        return -1;
+    if (!dir_name_ok(src_name) || !dir_name_ok(dst_name))
+        return -1;
+    dir_ent_t *src = dir_find(img, src_pinum, src_name);
+    if (src == NULL)
+        return -1;
+    int inum = src->inum;
+    dir_ent_t *dst = dir_find(img, dst_pinum, dst_name);
+    if (dst == src)
+        return 0;
+    if (dst != NULL && (inode_table[inum].type != UFS_REGULAR_FILE || inode_table[dst->inum].type != UFS_REGULAR_FILE))
+        return -1;
 
-    // If the file Sys doesn't exist, do this.
-    if (access(fileImage, F_OK) != 0)
+    if (inode_table[inum].type == UFS_DIRECTORY && src_pinum != dst_pinum)
     {
-        printf("image does not exist\n");
-        exit(1);
+        // walk up from the target directory: meeting the moved one would cut it off the tree
+        for (int up = dst_pinum, depth = 0; up != 0; depth++)
+        {
+            dir_ent_t *dotdot = dir_find(img, up, "..");
+            if (up == inum || dotdot == NULL || depth > img->numInode)
+                return -1;
+            up = dotdot->inum;
+        }
     }
 
-    // Establish listening on portnum
-    int sd = UDP_Open(portnum);
-    assert(sd > -1);
-
-    // Read-in the super block
-    int image_fd = open(fileImage, O_RDWR);
-    struct stat sbuf;
-    int rc = fstat(image_fd, &sbuf);
-    assert(rc > -1);
-    int image_size = (int)sbuf.st_size;
-    void *image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
-    assert(image != MAP_FAILED);
-
-    super_t *superBlock = (super_t *)image;
-
-    // Sanity check
-    printf("superBlock info\n inode_bitmap_addr: %d\n inode_bitmap_len: %d\n data_bitmap_addr: %d\n data_bitmap_len: %d\n inode_region_addr: %d\n inode_region_len: %d\n data_region_addr: %d\n data_region_len: %d\n",
-           superBlock->inode_bitmap_addr, superBlock->inode_bitmap_len, superBlock->data_bitmap_addr,
-           superBlock->data_bitmap_len, superBlock->inode_region_addr, superBlock->inode_region_len,
-           superBlock->data_region_addr, superBlock->data_region_len);
-
-    // Read-in the bitmaps
-    char *inode_bitmap = image + superBlock->inode_bitmap_addr * BLOCK_SIZE;
-    char *data_bitmap = image + superBlock->data_bitmap_len * BLOCK_SIZE;
-
-    // Read-in the inode table
-    inode_t *inode_table = image + superBlock->inode_region_addr * BLOCK_SIZE;
-
-    // Read-in the data region
-    char *data_region = image + superBlock->data_region_addr * BLOCK_SIZE;
-
-    int numInode = superBlock->inode_region_len * BLOCK_SIZE / sizeof(inode_t);
+    if (dst != NULL)
+    {
+        // point the existing name at the file, then let the old file go
+        int old = dst->inum;
+        dst->inum = inum;
+        persist(&dst->inum, sizeof(dst->inum));
+        src->inum = -1;
+        persist(&src->inum, sizeof(src->inum));
+        return old == inum ? 0 : rm_file(old, inode_table, img->data_bitmap, img->inode_bitmap); // two links left by a crash
+    }
+    if (src_pinum == dst_pinum)
+    {
+        memset(src->name, 0, sizeof(src->name));
+        strcpy(src->name, dst_name);
+        persist(src, sizeof(dir_ent_t));
+        return 0;
+    }
 
-    // Start the server
-    while (1)
+    if (dir_append(img, dst_pinum, dst_name, inum) != 0)
+        return -1;
+    if (inode_table[inum].type == UFS_DIRECTORY)
     {
-        struct sockaddr_in addr;
-        message received_msg;
-        printf("The Machine:: waiting...\n");
-        int rc = UDP_Read(sd, &addr, (char *)&received_msg, sizeof(message));
-        printf("The Machine:: read message [size:%d contents:(%s)]\n", rc, received_msg.msg);
-        if (rc <= 0)
+        dir_ent_t *dotdot = dir_find(img, inum, "..");
+        if (dotdot != NULL)
         {
-            continue;
+            dotdot->inum = dst_pinum;
+            persist(&dotdot->inum, sizeof(dotdot->inum));
         }
+    }
+    src->inum = -1;
+    persist(&src->inum, sizeof(src->inum));
+    return 0;
+}
 
-        message reply_msg; // message to be replied to client
-
-        char *msg = received_msg.msg;
+/**
+ * @brief Allocate n data blocks in one pass over the bitmap, as a single run
+ * of adjacent blocks when there is one
+ *
+ * @param img the volume
+ * @param n number of blocks, at most DIRECT_PTRS
+ * @param blks set to the blocks allocated, in ascending order
+ * @return int 0 on success, -1 with nothing allocated when fewer than n are free
+ */
+int data_alloc_bulk(image_t *img, int n, int *blks)
+{
+    unsigned int *bitmap = (unsigned int *)img->data_bitmap;
+    int num_data = img->superBlock->num_data;
+    if (n == 0)
+        return 0;
+    int run = 0, end = -1;
+    for (int b = 0; b < num_data && end < 0; b++)
+    {
+        run = get_bit(bitmap, b) ? 0 : run + 1;
+        if (run == n)
+            end = b;
+    }
+    int got = 0;
+    for (int b = end >= 0 ? end - n + 1 : 0; b < num_data && got < n; b++)
+    {
+        if (!get_bit(bitmap, b))
+            blks[got++] = b;
+    }
+    if (got < n)
+        return -1;
+    for (int i = 0; i < n; i++)
+        set_bit(bitmap, blks[i]);
+    persist(bitmap + blks[0] / 32, (blks[n - 1] / 32 - blks[0] / 32 + 1) * sizeof(unsigned int)); // every word touched
+    return 0;
+}
 
-        int param1 = received_msg.param1; // pinum/inum
-        int param2 = received_msg.param2;
-        int param3 = received_msg.param3;
+/**
+ * @brief Copy regular file src_inum to a new file name in dst_pinum without
+ * the data leaving the server. On a deduplicated volume the copy shares every
+ * block, copy-on-write; on a compressed one each packed block is copied as
+ * stored; otherwise all blocks are allocated in one go and copied with one
+ * memcpy per run of blocks adjacent in both files.
+ *
+ * @param img the volume
+ * @param src_inum the file to copy
+ * @param dst_pinum the directory to create the copy in
+ * @param name the copy's name, which must not exist yet
+ * @return int the new file's inode number, -1 on failure, -2 when a block of
+ * the source is corrupt
+ */
+int MFS_copy(image_t *img, int src_inum, int dst_pinum, char *name)
+{
+    inode_t *inode_table = img->inode_table;
+    super_t *superBlock = img->superBlock;
+    if (!IsInoValid(dst_pinum, img->numInode, (unsigned int *)img->inode_bitmap) ||
+        inode_table[src_inum].type != UFS_REGULAR_FILE || inode_table[dst_pinum].type != UFS_DIRECTORY)
+        return -1;
+    if (!dir_name_ok(name) || dir_find(img, dst_pinum, name) != NULL)
+        return -1;
 
-        if (!IsInoValid(param1, numInode, (unsigned int *)inode_bitmap)) // check if the inum is valid, not then continue;
-        {
-            respondToServer(reply_msg, -1, sd, &addr, &rc);
+    inode_t src = inode_table[src_inum];
+    int nblocks = 0;
+    for (int i = 0; i < DIRECT_PTRS; i++)
+    {
+        char scratch[BLOCK_SIZE], *block;
+        if (src.direct[i] == (unsigned int)-1)
             continue;
-        }
-        // process by case according to the msg field
-        if (strcmp(msg, "MFS_Init") == 0) // Initialization
+        if (file_block(img->image, superBlock, &src, src.direct[i], scratch, &block) != 0)
+            return -2; // copying would spread the damage
+        nblocks++;
+    }
+    int inum;
+    if (find_empty_set_bitmap((unsigned int *)img->inode_bitmap, superBlock->num_inodes, &inum) == 0)
+        return -1;
+    inode_t *dst = &inode_table[inum];
+    dst->type = UFS_REGULAR_FILE;
+    dst->size = src.size;
+    for (int i = 0; i < DIRECT_PTRS; i++)
+        dst->direct[i] = (unsigned int)-1;
+
+    int res = 0;
+    if (img->block_refs != NULL)
+    {
+        for (int i = 0; i < DIRECT_PTRS; i++)
         {
-            respondToServer(reply_msg, 0, sd, &addr, &rc);
+            if (src.direct[i] == (unsigned int)-1)
+                continue;
+            img->block_refs[src.direct[i]]++;
+            dst->direct[i] = src.direct[i];
         }
-        else if (strcmp(msg, "MFS_Lookup") == 0)
+    }
+    else if (img->sector_map != NULL)
+    {
+        for (int i = 0; i < DIRECT_PTRS && res == 0; i++)
         {
-            inode_t *metadata = inode_table + param1;
-            if (metadata->type == 1)
-                respondToServer(reply_msg, -1, sd, &addr, &rc); // cannot look up in a file
-            else {
-                int inum;
-                int found = lookup(param1, received_msg.charParam, inode_table, data_region, &inum, superBlock->data_region_addr);
-                found = found == 0 ? -1 : inum;
-                
-                respondToServer(reply_msg, found, sd, &addr, &rc);
+            unsigned int ptr = src.direct[i];
+            if (ptr == (unsigned int)-1)
+                continue;
+            int blk;
+            char *from, *to;
+            size_t len = BLOCK_SIZE;
+            if (ptr & UFS_PACKED)
+            {
+                int nsec = __builtin_popcount(packed_mask(img->image, superBlock, ptr));
+                unsigned int copy = extent_alloc(img, nsec);
+                if (copy == (unsigned int)-1)
+                {
+                    res = -1;
+                    break;
+                }
+                from = BLOCK_ADDR(img->data_region, UFS_PACKED_BLOCK(ptr)) + UFS_PACKED_SECTOR(ptr) * UFS_SECTOR_SIZE;
+                to = BLOCK_ADDR(img->data_region, UFS_PACKED_BLOCK(copy)) + UFS_PACKED_SECTOR(copy) * UFS_SECTOR_SIZE;
+                len = (size_t)nsec * UFS_SECTOR_SIZE;
+                dst->direct[i] = copy;
             }
-            
-        }
-        else if (strcmp(msg, "MFS_Stat") == 0)
-        {
-            int res = MFS_stat(&reply_msg, inode_table, param1);
-            respondToServer(reply_msg, res, sd, &addr, &rc);
-        }
-        else if (strcmp(msg, "MFS_Write") == 0)
-        {
-            char *buffer = received_msg.buf;
-            int res = MFS_write(param3, param2, param1, inode_table, data_bitmap, inode_bitmap, buffer, superBlock, image);
-            respondToServer(reply_msg, res, sd, &addr, &rc);
+            else
+            {
+                if (find_empty_set_bitmap((unsigned int *)img->data_bitmap, superBlock->num_data, &blk) == 0)
+                {
+                    res = -1;
+                    break;
+                }
+                persist_bit(img->data_bitmap, blk);
+                from = BLOCK_ADDR(img->data_region, ptr);
+                to = BLOCK_ADDR(img->data_region, blk);
+                dst->direct[i] = blk;
+            }
+            memcpy(to, from, len);
+            persist(to, len);
         }
-        else if (strcmp(msg, "MFS_Read") == 0)
+    }
+    else
+    {
+        int blks[DIRECT_PTRS];
+        res = data_alloc_bulk(img, nblocks, blks);
+        for (int i = 0, k = 0; i < DIRECT_PTRS && res == 0; i++)
         {
-            char buffer[4096];
-            int res = MFS_read(param3, param2, param1, inode_table, image, superBlock, buffer);
-            memcpy(reply_msg.buf, buffer, BLOCK_SIZE);
-            respondToServer(reply_msg, res, sd, &addr, &rc);
+            if (src.direct[i] != (unsigned int)-1)
+                dst->direct[i] = blks[k++];
         }
-        else if (strcmp(msg, "MFS_Creat") == 0)
+        for (int i = 0, run; i < DIRECT_PTRS && res == 0; i += run)
         {
-            int res = MFS_create(param1, param2, received_msg.charParam, inode_table, data_region, data_bitmap, inode_bitmap, superBlock);
-            respondToServer(reply_msg, res, sd, &addr, &rc);
+            run = 1;
+            if (src.direct[i] == (unsigned int)-1)
+                continue;
+            while (i + run < DIRECT_PTRS && src.direct[i + run] == src.direct[i] + run && dst->direct[i + run] == dst->direct[i] + run)
+                run++;
+            memcpy(BLOCK_ADDR(img->data_region, dst->direct[i]), BLOCK_ADDR(img->data_region, src.direct[i]), (size_t)run * BLOCK_SIZE);
+            persist(BLOCK_ADDR(img->data_region, dst->direct[i]), (size_t)run * BLOCK_SIZE);
         }
-        else if (strcmp(msg, "MFS_Unlink") == 0)
+    }
+
+    persist_bit(img->inode_bitmap, inum);
+    persist(dst, sizeof(inode_t));
+    if (res != 0 || dir_append(img, dst_pinum, name, inum) != 0)
+    {
+        rm_file(inum, inode_table, img->data_bitmap, img->inode_bitmap); // gives back whatever was allocated
+        return -1;
+    }
+    return inum;
+}
+
+int 
+MFS_stat(message * reply_msg_ptr, inode_t * inode_table, int inum){
+
+    inode_t metadata = inode_table[inum];
+    reply_msg_ptr->param1 = metadata.size; // size of the inode
+    reply_msg_ptr->param2 = metadata.type; // type of the inode
+    return 0;
+}
+
+// op names counted in image_t.ops, in order
+const char *stat_names[STAT_OPS] = {"MFS_Init", "MFS_Lookup", "MFS_Stat", "MFS_Write", "MFS_Read", "MFS_Creat", "MFS_Unlink", "MFS_Shutdown", "MFS_Snapshot", "MFS_Fsync", "MFS_Rename", "MFS_Copy"};
+
+void count_request(image_t *img, message *received_msg, int res)
+{
+    for (int i = 0; i < STAT_OPS; i++)
+    {
+        if (strcmp(received_msg->msg, stat_names[i]) != 0)
+            continue;
+        img->ops[i]++;
+        if (res >= 0 && strcmp(stat_names[i], "MFS_Read") == 0)
+            img->bytes_read += received_msg->param3;
+        if (res >= 0 && strcmp(stat_names[i], "MFS_Write") == 0)
+            img->bytes_written += received_msg->param3;
+        break;
+    }
+    if (res < 0)
+        img->errors++;
+}
+
+// MFS_Snapshot copies the whole image when it cannot be cloned (-C)
+int snapshot_copy = 0;
+
+/**
+ * @brief Freeze the volume into a read-only snapshot next to the image, named
+ * <image>@<name>. The snapshot is a reflink clone: the file system shares
+ * every block with the live image and copies a block only when one side
+ * writes it, so taking one is instant and it grows with divergence. On file
+ * systems without reflinks the snapshot fails, unless the server was started
+ * with -C to accept a full copy, which holds every volume for as long as
+ * copying the image takes. Runs under fs_lock, so no request is half applied
+ * in the snapshot.
+ *
+ * @param img the volume
+ * @param name snapshot name, no '/'
+ * @return int 0 on success, -1 on failure
+ */
+int volume_snapshot(image_t *img, char *name)
+{
+    char snap_path[PATH_MAX];
+    if (name[0] == '\0' || memchr(name, '\0', sizeof(((message *)0)->charParam)) == NULL || strchr(name, '/') != NULL)
+        return -1;
+    if (snprintf(snap_path, sizeof(snap_path), "%s@%s", img->path, name) >= (int)sizeof(snap_path))
+        return -1;
+
+    // deferred ranges included: the clone reads the file, not the mapping
+    if (!img->readonly && msync(img->image, img->image_size, MS_SYNC) != 0)
+        return -1;
+    int fd = open(snap_path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+    {
+        perror("open snapshot");
+        return -1;
+    }
+    if (ioctl(fd, FICLONE, img->fd) != 0)
+    {
+        if (!snapshot_copy || (errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL))
         {
-            int pinum = param1;
-            char *name = received_msg.charParam;
-            int res = MFS_unlink(param1, received_msg.charParam, data_region, superBlock, inode_table, data_bitmap, inode_bitmap, image, image_size);
-            respondToServer(reply_msg, res, sd, &addr, &rc);
+            perror("clone snapshot");
+            close(fd);
+            unlink(snap_path);
+            return -1;
         }
-        else if (strcmp(msg, "MFS_Shutdown") == 0)
+        loff_t in = 0, out = 0;
+        while ((size_t)in < img->image_size)
         {
-            msync(image, image_size, MS_SYNC);
-            respondToServer(reply_msg, 0, sd, &addr, &rc);
-            UDP_Close(sd);
-            exit(0);
+            long n = syscall(SYS_copy_file_range, img->fd, &in, fd, &out, img->image_size - in, 0);
+            if (n <= 0)
+            {
+                perror("copy_file_range");
+                close(fd);
+                unlink(snap_path);
+                return -1;
+            }
         }
     }
-    return 0;
+    int rc = 0;
+    if (img->checksums != NULL && !img->readonly)
+    {
+        // the table matched every block once the image was synced above, so
+        // the snapshot starts out clean
+        char block[BLOCK_SIZE];
+        memcpy(block, img->image, BLOCK_SIZE);
+        ((super_t *)block)->checksum_stale = 0;
+        uint32_t crc = CRC_Block(block);
+        if (pwrite(fd, &crc, sizeof(crc), (off_t)img->superBlock->checksum_addr * BLOCK_SIZE) != sizeof(crc) ||
+            pwrite(fd, block, BLOCK_SIZE, 0) != BLOCK_SIZE)
+            rc = -1;
+    }
+    if (fsync(fd) != 0)
+        rc = -1;
+    close(fd);
+    if (rc != 0)
+        unlink(snap_path);
+    printf("snapshot %s %s\n", snap_path, rc == 0 ? "taken" : "failed");
+    return rc == 0 ? 0 : -1;
 }
 
+// frames on a TCP connection: 32-bit big-endian length, then the message
+#define TCP_FRAME_SIZE (sizeof(uint32_t) + sizeof(message))
 
+// send every byte of iov, resuming after short writes
+int tcp_writev_all(int fd, struct iovec *iov, int n)
+{
+    struct msghdr mh = {.msg_iov = iov, .msg_iovlen = n};
+    while (mh.msg_iovlen > 0)
+    {
+        int rc = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        while (mh.msg_iovlen > 0 && (size_t)rc >= mh.msg_iov->iov_len)
+        {
+            rc -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0)
+        {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + rc;
+            mh.msg_iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+// receive exactly n bytes; -1 on error, timeout or end of stream
+int tcp_read_all(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rc = recv(fd, buf, n, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        buf += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+// primary-backup replication (-B): a backup is another fsserv serving a
+// copy of the same image with -t. A primary sends every request that modifies
+// a volume to its backups' TCP ports, in the order it applies them, and answers
+// the client once the backups have applied it too. Requests are deterministic
+// given the allocation state, which both sides rebuild from the image when the
+// stream starts (volume_rebuild), so the images stay identical. Backups answer
+// reads meanwhile, which makes them read replicas too. A backup refuses client
+// modifications with MSG_STANDBY until its stream is lost, which keeps a client
+// that gave up on a slow primary from writing behind the primary's back.
+__thread int replica_stream = 0; // the request being served came from a primary
+
+// fingerprint of a volume's metadata, so a backup serving another image is refused
+uint32_t metadata_fingerprint(image_t *img)
+{
+    return CRC32C(img->image, img->data_region - (char *)img->image);
+}
+
+// send a request down a replication stream
+int replica_send(int fd, message *msg, char *payload)
+{
+    uint32_t len = htonl(sizeof(message));
+    size_t tail = offsetof(message, buf) + sizeof(msg->buf);
+    struct iovec iov[4] = {
+        {.iov_base = &len, .iov_len = sizeof(len)},
+        {.iov_base = msg, .iov_len = offsetof(message, buf)},
+        {.iov_base = payload, .iov_len = sizeof(msg->buf)},
+        {.iov_base = (char *)msg + tail, .iov_len = sizeof(message) - tail},
+    };
+    return tcp_writev_all(fd, iov, 4);
+}
+
+// the reply code a backup answered on its stream, -2 when it did not
+int replica_recv(int fd)
+{
+    char frame[TCP_FRAME_SIZE];
+    if (tcp_read_all(fd, frame, sizeof(frame)) == 0 && ntohl(*(uint32_t *)frame) == sizeof(message))
+        return ((message *)(frame + sizeof(uint32_t)))->msg_code;
+    return -2;
+}
+
+void replica_drop(image_t *img, int r)
+{
+    fprintf(stderr, "volume on port %d lost backup %d, no longer replicating to it\n", img->port, r);
+    // a stream that just closes reads as a lost primary, yet this backup
+    // missed requests: have it stay in standby, if it still listens
+    message dropped = {.msg = "MFS_Dropped"};
+    replica_send(img->replica_fd[r], &dropped, dropped.buf);
+    close(img->replica_fd[r]);
+    img->replica_fd[r] = -1;
+}
+
+/**
+ * @brief Have every backup apply a request the primary just applied. The
+ * request goes out to all of them before any answer is awaited, so a write
+ * waits for the slowest backup rather than for their sum. A backup that fails
+ * to answer, or answers differently, is dropped and the volume goes on
+ * without it.
+ *
+ * @param img the volume
+ * @param msg the request
+ * @param payload its buf, which may live apart from msg
+ * @param res the primary's reply code, which the backups should agree with
+ */
+void replica_forward(image_t *img, message *msg, char *payload, int res)
+{
+    for (int r = 0; r < MAX_REPLICAS; r++)
+    {
+        if (img->replica_fd[r] >= 0 && replica_send(img->replica_fd[r], msg, payload) != 0)
+            replica_drop(img, r);
+    }
+    for (int r = 0; r < MAX_REPLICAS; r++)
+    {
+        if (img->replica_fd[r] < 0)
+            continue;
+        int backup_res = replica_recv(img->replica_fd[r]);
+        if (backup_res != res && backup_res != -2)
+            fprintf(stderr, "backup %d of the volume on port %d answered %s with %d, the primary with %d\n", r, img->port, msg->msg, backup_res, res);
+        if (backup_res != res) // its image is no longer a copy of this one
+            replica_drop(img, r);
+    }
+}
+
+/**
+ * @brief Open a replication stream to one more backup. Its first request
+ * announces the stream and carries the metadata fingerprint the backup checks
+ * and the version it starts counting from.
+ *
+ * @param img the volume
+ * @param host the backup's host
+ * @param port the backup's port for this volume
+ * @return int 0 on success, -1 when the backup cannot be reached or refuses
+ */
+int replica_connect(image_t *img, char *host, int port)
+{
+    int r = 0;
+    while (r < MAX_REPLICAS && img->replica_fd[r] >= 0)
+        r++;
+    struct sockaddr_in addr;
+    if (r == MAX_REPLICAS || UDP_FillSockAddr(&addr, host, port) != 0)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect to backup");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = {.tv_sec = REPLICA_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)); // a stuck backup fills the stream
+
+    message hello = {.msg = "MFS_Replicate", .param1 = 0, .param2 = (int)metadata_fingerprint(img), .param3 = (int)img->version};
+    if (replica_send(fd, &hello, hello.buf) != 0 || replica_recv(fd) != 0)
+    {
+        fprintf(stderr, "backup %s:%d refused the volume on port %d: not the same image?\n", host, port, img->port);
+        close(fd);
+        return -1;
+    }
+    img->replica_fd[r] = fd;
+    return 0;
+}
+
+// sharding (-M name=host:port): other fsserv processes serve whole subtrees of
+// the namespace, mounted in the root directory under a name. The server only
+// hands the map to clients (MFS_ShardMap); fscli.c routes every request to
+// its shard and encodes the shard in the inode numbers it returns.
+typedef struct {
+    char name[28];
+    char host[64];
+    int port;
+} shard_t;
+
+shard_t shard_map[MAX_SHARDS - 1];
+int num_shards = 0; // besides this one
+
+// the shard map as "name host port" lines; returns the number of shards
+int shard_map_format(char *buf, size_t len)
+{
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < num_shards; i++)
+        used += snprintf(buf + used, len - used, "%s %s %d\n", shard_map[i].name, shard_map[i].host, shard_map[i].port);
+    return num_shards;
+}
+
+/**
+ * @brief Handle one request against the image. The reply is built in place and
+ * its msg_code is set to the result. Shared by every transport.
+ *
+ * @param img the volume the request was addressed to
+ * @param received_msg the request
+ * @param payload the bytes of a write; NULL takes them from received_msg->buf
+ * @param reply_msg the reply to fill in
+ * @param extents when not NULL, a successful read leaves its payload here as
+ * ranges of the image instead of copying it into reply_msg->buf; see reply_iov
+ * @param shutdown set to 1 when the request asks to shut the volume down
+ * @return int the reply code
+ */
+int serve_request(image_t *img, message *received_msg, char *payload, message *reply_msg, struct iovec *extents, int *shutdown)
+{
+    char *msg = received_msg->msg;
+    if (payload == NULL)
+        payload = received_msg->buf;
+    if (extents != NULL)
+        extents[0].iov_base = NULL;
+    if (reply_msg != received_msg) // clients match replies by op and charParam tag, see sendToServer in fscli.c
+    {
+        memcpy(reply_msg->msg, received_msg->msg, sizeof(reply_msg->msg));
+        memcpy(reply_msg->charParam, received_msg->charParam, sizeof(reply_msg->charParam));
+    }
+
+    int param1 = received_msg->param1; // pinum/inum
+    int param2 = received_msg->param2;
+    int param3 = received_msg->param3;
+
+    int res = -1;
+    int modifies = strcmp(msg, "MFS_Write") == 0 || strcmp(msg, "MFS_Creat") == 0 || strcmp(msg, "MFS_Unlink") == 0 || strcmp(msg, "MFS_Rename") == 0 ||
+                   strcmp(msg, "MFS_Copy") == 0;
+    int replicated = modifies || strcmp(msg, "MFS_Fsync") == 0 || strcmp(msg, "MFS_Snapshot") == 0;
+    if ((img->readonly && modifies) || (img->standby && modifies && !replica_stream) || !IsInoValid(param1, img->numInode, (unsigned int *)img->inode_bitmap)) // check if the inum is valid
+    {
+        if (img->standby && modifies && !replica_stream)
+            res = MSG_STANDBY; // the client should go back to the primary
+        count_request(img, received_msg, res);
+        reply_msg->msg_code = res;
+        reply_msg->param3 = (int)img->version;
+        return res;
+    }
+    int deferred = persist_deferred;
+    if (strcmp(msg, "MFS_Write") == 0 && strncmp(received_msg->charParam, MSG_WRITE_DEFERRED, sizeof(received_msg->charParam)) == 0)
+        persist_deferred = 1; // a write-back client makes it durable with MFS_Fsync
+    // process by case according to the msg field
+    if (strcmp(msg, "MFS_Init") == 0) // Initialization
+    {
+        res = 0;
+    }
+    else if (strcmp(msg, "MFS_Lookup") == 0)
+    {
+        inode_t *metadata = img->inode_table + param1;
+        if (metadata->type != 1) // cannot look up in a file
+        {
+            int inum;
+            int found = lookup(param1, received_msg->charParam, img->inode_table, img->data_region, &inum, img->superBlock->data_region_addr);
+            res = found == 0 ? -1 : inum;
+        }
+    }
+    else if (strcmp(msg, "MFS_Stat") == 0)
+    {
+        res = MFS_stat(reply_msg, img->inode_table, param1);
+    }
+    else if (strcmp(msg, "MFS_Write") == 0)
+    {
+        if (img->sector_map != NULL)
+            res = MFS_write_packed(img, param3, param2, param1, payload);
+        else if (img->block_refs != NULL)
+            res = MFS_write_dedup(img, param3, param2, param1, payload);
+        else
+            res = MFS_write(param3, param2, param1, img->inode_table, img->data_bitmap, img->inode_bitmap, payload, img->superBlock, img->image);
+    }
+    else if (strcmp(msg, "MFS_Read") == 0)
+    {
+        if (extents != NULL)
+            res = read_extents(param3, param2, param1, img->inode_table, img->image, img->superBlock, extents);
+        else
+            res = MFS_read(param3, param2, param1, img->inode_table, img->image, img->superBlock, reply_msg->buf);
+        if (res == -2)
+        {
+            img->checksum_errors++;
+            res = -1;
+        }
+        if (res != 0 && extents != NULL)
+            extents[0].iov_base = NULL;
+        if (res == 0)
+            read_ahead(img, param1, param2, param3);
+        reply_msg->param2 = img->inode_table[param1].type; // lets a client tell directory entries apart
+    }
+    else if (strcmp(msg, "MFS_Creat") == 0)
+    {
+        res = MFS_create(param1, param2, received_msg->charParam, img->inode_table, img->data_region, img->data_bitmap, img->inode_bitmap, img->superBlock);
+    }
+    else if (strcmp(msg, "MFS_Unlink") == 0)
+    {
+        res = MFS_unlink(param1, received_msg->charParam, img->data_region, img->superBlock, img->inode_table, img->data_bitmap, img->inode_bitmap);
+    }
+    else if (strcmp(msg, "MFS_Shutdown") == 0)
+    {
+        msync(img->image, img->image_size, MS_SYNC);
+        if (img->checksums != NULL && !img->readonly)
+            checksums_mark(img, 0);
+        *shutdown = 1;
+        res = 0;
+    }
+    else if (strcmp(msg, "MFS_Snapshot") == 0)
+    {
+        res = volume_snapshot(img, received_msg->charParam);
+    }
+    else if (strcmp(msg, "MFS_Rename") == 0)
+    {
+        res = MFS_rename(img, param1, received_msg->charParam, param2, payload); // the new name travels in buf
+    }
+    else if (strcmp(msg, "MFS_Copy") == 0)
+    {
+        res = MFS_copy(img, param1, param2, received_msg->charParam);
+        if (res == -2)
+        {
+            img->checksum_errors++;
+            res = -1;
+        }
+    }
+    else if (strcmp(msg, "MFS_ShardMap") == 0)
+    {
+        res = shard_map_format(reply_msg->buf, sizeof(reply_msg->buf));
+    }
+    else if (strcmp(msg, "MFS_Replicate") == 0)
+    {
+        // a primary streams its modifications from now on, see replica_connect
+        res = !img->readonly && (uint32_t)param2 == metadata_fingerprint(img) && volume_rebuild(img) == 0 ? 0 : -1;
+        if (res == 0)
+        {
+            img->standby = 1;
+            img->version = (uint32_t)param3;
+        }
+    }
+    else if (strcmp(msg, "MFS_Dropped") == 0)
+    {
+        // the primary goes on without this copy, which stays in standby, see replica_drop
+        res = replica_stream ? 0 : -1;
+    }
+    else if (strcmp(msg, "MFS_Fsync") == 0)
+    {
+        // the whole mapping: deferred writes may have reached it on any transport
+        res = img->readonly || msync(img->image, img->image_size, MS_SYNC) == 0 ? 0 : -1;
+        if (!persist_deferred)
+            img->dirty_lo = img->dirty_hi = NULL; // no group commit is waiting for the range
+    }
+    persist_checksums(img);
+    persist_deferred = deferred;
+    if (modifies)
+        img->version++;
+    if (replicated)
+        replica_forward(img, received_msg, payload, res);
+    count_request(img, received_msg, res);
+    reply_msg->msg_code = res;
+    // replies carry the version, so a client can tell a read replica that
+    // has not seen its writes yet (MFS_AddReplica in fscli.c)
+    reply_msg->param3 = (int)img->version;
+    return res;
+}
+
+volatile sig_atomic_t stats_requested = 0;
+
+void on_sigusr1(int sig)
+{
+    stats_requested = 1;
+}
+
+// one line of counters per volume
+void volume_stats(FILE *out)
+{
+    for (int v = 0; v < num_volumes; v++)
+    {
+        image_t *img = &volumes[v];
+        fprintf(out, "volume %d port %d image %s%s:", v, img->port, img->path, img->active ? "" : " (shut down)");
+        for (int i = 0; i < STAT_OPS; i++)
+            fprintf(out, " %s=%lu", stat_names[i] + 4, img->ops[i]);
+        fprintf(out, " errors=%lu bytes_read=%lu bytes_written=%lu", img->errors, img->bytes_read, img->bytes_written);
+        if (img->checksums != NULL)
+            fprintf(out, " checksum_errors=%lu", img->checksum_errors);
+        if (img->block_refs != NULL)
+            fprintf(out, " dedup_hits=%lu", img->dedup_hits);
+        fprintf(out, " readahead=%lu", img->readahead_blocks);
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+/**
+ * @brief Stop serving a volume after MFS_Shutdown. Other volumes keep running;
+ * the process exits with the last one.
+ *
+ * @param img the volume
+ */
+void volume_shutdown(image_t *img)
+{
+    img->active = 0;
+    for (int v = 0; v < num_volumes; v++)
+    {
+        if (volumes[v].active)
+            return;
+    }
+    volume_stats(stderr);
+    exit(0);
+}
+
+#define SCRUB_CHUNK (64) // blocks verified per hold of fs_lock
+#define SCRUB_PASS_PAUSE (60) // seconds between two passes over a volume
+
+// scrub rate in MB/s for volumes with checksums, 0 turns the scrubber off (-S)
+int scrub_rate = 64;
+
+/**
+ * @brief Walk a volume with checksums over and over, verifying every block
+ * against the table so corruption in blocks nobody reads is found too. Each
+ * chunk is checked under fs_lock and followed by a sleep that holds the walk
+ * to scrub_rate, and passes are SCRUB_PASS_PAUSE apart. A corrupt block is
+ * reported and counted once, until it is rewritten. Runs in its own thread
+ * until the volume shuts down.
+ *
+ * @param arg the volume
+ * @return void*
+ */
+void *scrub_serve(void *arg)
+{
+    image_t *img = arg;
+    super_t *superBlock = img->superBlock;
+    size_t num_blocks = img->image_size / BLOCK_SIZE;
+    long pause_ns = (long)SCRUB_CHUNK * BLOCK_SIZE * 1000000000 / ((long)scrub_rate << 20);
+    struct timespec pause = {.tv_sec = pause_ns / 1000000000, .tv_nsec = pause_ns % 1000000000};
+    size_t blk = 0;
+    while (img->active)
+    {
+        pthread_mutex_lock(&fs_lock);
+        for (size_t end = blk + SCRUB_CHUNK; blk < end && blk < num_blocks; blk++)
+        {
+            if (blk >= (size_t)superBlock->checksum_addr && blk < (size_t)superBlock->checksum_addr + superBlock->checksum_len)
+                continue;
+            if ((img->scrub_known[blk / 8] & 1 << blk % 8) || block_verify(img->image, superBlock, blk) == 0)
+                continue;
+            fprintf(stderr, "scrub: %s block %zu fails its checksum\n", img->path, blk);
+            img->checksum_errors++;
+            img->scrub_known[blk / 8] |= 1 << blk % 8;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (blk >= num_blocks)
+        {
+            blk = 0;
+            sleep(SCRUB_PASS_PAUSE);
+        }
+        else
+            nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Serve the shared-memory ring. Runs in its own thread next to the UDP
+ * loop; requests are answered in place inside their slot.
+ *
+ * @param arg the volume the ring belongs to
+ * @return void*
+ */
+void *shm_serve(void *arg)
+{
+    image_t *img = arg;
+    shm_ring_t *ring = img->shm_ring;
+    while (1)
+    {
+        uint32_t bell = __atomic_load_n(&ring->doorbell, __ATOMIC_ACQUIRE);
+        int served = 0;
+        for (int i = 0; i < SHM_SLOTS; i++)
+        {
+            shm_slot_t *slot = &ring->slots[i];
+            if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SHM_REQUEST)
+                continue;
+            int shutdown = 0;
+            pthread_mutex_lock(&fs_lock);
+            if (img->active)
+                serve_request(img, &slot->req, NULL, &slot->rep, NULL, &shutdown);
+            else
+                slot->rep.msg_code = -1;
+            __atomic_store_n(&slot->state, SHM_REPLY, __ATOMIC_RELEASE);
+            SHM_Wake(&slot->state, 1);
+            if (shutdown)
+                volume_shutdown(img);
+            pthread_mutex_unlock(&fs_lock);
+            served = 1;
+        }
+        if (!served)
+            SHM_Wait(&ring->doorbell, bell, 0);
+    }
+    return NULL;
+}
+
+// unlink the rings and turn away clients still attached to them
+void shm_cleanup()
+{
+    for (int v = 0; v < num_volumes; v++)
+    {
+        shm_ring_t *ring = volumes[v].shm_ring;
+        if (ring == NULL)
+            continue;
+        shm_unlink(volumes[v].shm_name);
+        __atomic_store_n(&ring->magic, 0, __ATOMIC_RELEASE);
+        SHM_Wake(&ring->released, INT_MAX);
+        for (int i = 0; i < SHM_SLOTS; i++)
+            SHM_Wake(&ring->slots[i].state, INT_MAX);
+    }
+}
+
+void shm_on_signal(int sig)
+{
+    shm_cleanup();
+    _exit(1);
+}
+
+/**
+ * @brief Create the shared-memory ring for a volume and start serving it
+ *
+ * @param img the volume, whose port also names the ring
+ * @return int 0 on success, -1 on failure
+ */
+int shm_start(image_t *img)
+{
+    SHM_Name(img->shm_name, sizeof(img->shm_name), img->port);
+    int fd = shm_open(img->shm_name, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0 || ftruncate(fd, sizeof(shm_ring_t)) != 0)
+    {
+        perror("shm_open");
+        return -1;
+    }
+    shm_ring_t *ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+    ring->nslots = SHM_SLOTS;
+    ring->server = getpid();
+    __atomic_store_n(&ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    img->shm_ring = ring;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, shm_serve, img) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+#define MAX_TCP_CONNS (64)
+
+// a TCP client; frames are a 32-bit big-endian length followed by a message
+typedef struct {
+    int fd;
+    image_t *img; // volume whose port the client connected to
+    int have;     // bytes of the current frame received so far
+    int replica;  // the connection is a primary's replication stream
+    char inbuf[TCP_FRAME_SIZE];
+} tcp_conn_t;
+
+tcp_conn_t tcp_conns[MAX_TCP_CONNS];
+
+// listen for TCP clients on port
+int TCP_Listen(int port)
+{
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_port = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1 || listen(fd, 64) == -1)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Accept a pending TCP client of a volume into a free connection slot
+ *
+ * @param img the volume whose listener is readable
+ * @return tcp_conn_t* the new connection, NULL if none could be accepted
+ */
+tcp_conn_t *tcp_accept(image_t *img)
+{
+    int fd = accept(img->tcp_sd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+    for (int i = 0; i < MAX_TCP_CONNS; i++)
+    {
+        if (tcp_conns[i].fd >= 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // replies are sent under fs_lock: a client that stops reading is
+        // closed once its window has stayed shut this long
+        struct timeval timeout = {.tv_sec = REPLICA_TIMEOUT};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        tcp_conns[i].fd = fd;
+        tcp_conns[i].img = img;
+        tcp_conns[i].have = 0;
+        tcp_conns[i].replica = 0;
+        return &tcp_conns[i];
+    }
+    close(fd); // out of slots
+    return NULL;
+}
+
+/**
+ * @brief Read what the client has sent toward its next frame.
+ *
+ * @param conn the readable connection
+ * @return int 1 once a whole frame is in conn->inbuf, 0 when more has to
+ * arrive, -1 when the connection is to be closed
+ */
+int tcp_receive(tcp_conn_t *conn)
+{
+    while (conn->img->active)
+    {
+        int rc = recv(conn->fd, conn->inbuf + conn->have, TCP_FRAME_SIZE - conn->have, MSG_DONTWAIT);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        conn->have += rc;
+        if (conn->have < TCP_FRAME_SIZE)
+            continue;
+        if (ntohl(*(uint32_t *)conn->inbuf) != sizeof(message))
+            return -1; // not speaking our framing
+        return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Answer the frame tcp_receive completed in conn->inbuf.
+ *
+ * @param conn the connection
+ * @param shutdown set to 1 when the request asks to shut the volume down
+ * @return int 0 on success, -1 when the reply could not be sent
+ */
+int tcp_answer(tcp_conn_t *conn, int *shutdown)
+{
+    image_t *img = conn->img;
+    conn->have = 0;
+    message *received_msg = (message *)(conn->inbuf + sizeof(uint32_t));
+    printf("The Machine:: read message [tcp contents:(%s)]\n", received_msg->msg);
+
+    message reply_msg;
+    struct iovec extents[2];
+    uint32_t len = htonl(sizeof(message));
+    struct iovec iov[6] = {{.iov_base = &len, .iov_len = sizeof(len)}};
+    pthread_mutex_lock(&fs_lock);
+    replica_stream = conn->replica;
+    serve_request(img, received_msg, NULL, &reply_msg, extents, shutdown);
+    replica_stream = 0;
+    if (strcmp(received_msg->msg, "MFS_Replicate") == 0 && reply_msg.msg_code == 0 && !conn->replica)
+    {
+        // an idle stream says nothing about the primary; probes find a host
+        // that vanished without closing it
+        int one = 1, idle = REPLICA_TIMEOUT, interval = 1, count = 3;
+        setsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        conn->replica = 1;
+    }
+    if (strcmp(received_msg->msg, "MFS_Dropped") == 0 && reply_msg.msg_code == 0)
+    {
+        conn->replica = 0;
+        fprintf(stderr, "volume on port %d: dropped by its primary, staying in standby\n", img->port);
+    }
+    // read payloads point into the image, so they go out under the lock
+    int rc = tcp_writev_all(conn->fd, iov, 1 + reply_iov(&reply_msg, extents, iov + 1));
+    pthread_mutex_unlock(&fs_lock);
+    return rc;
+}
+
+/**
+ * @brief Close a connection. When it was a primary's replication stream, this
+ * server takes over the primary's clients.
+ *
+ * @param conn the connection
+ * @param shutdown its last request shut the volume down
+ */
+void tcp_close(tcp_conn_t *conn, int shutdown)
+{
+    image_t *img = conn->img;
+    close(conn->fd);
+    conn->fd = -1;
+    conn->have = 0;
+    if (conn->replica)
+    {
+        pthread_mutex_lock(&fs_lock);
+        img->standby = 0;
+        pthread_mutex_unlock(&fs_lock);
+        conn->replica = 0;
+        fprintf(stderr, "volume on port %d: primary gone, serving clients\n", img->port);
+    }
+    if (shutdown)
+        volume_shutdown(img);
+}
+
+/**
+ * @brief Drain whatever the client has sent and answer every complete frame,
+ * in order. Clients may pipeline any number of requests on one connection.
+ *
+ * @param conn the readable connection
+ * @return int -1 when the connection is closed, 0 otherwise
+ */
+int tcp_serve(tcp_conn_t *conn)
+{
+    int shutdown = 0;
+    int rc;
+    while ((rc = tcp_receive(conn)) == 1 && tcp_answer(conn, &shutdown) == 0 && !shutdown)
+        ;
+    if (rc == 0)
+        return 0;
+    tcp_close(conn, shutdown);
+    return -1;
+}
+
+#define PAYLOAD_POOL (16)
+
+// page-aligned receive buffers for request payloads, so a full-block write
+// reaches the image (or anything else that wants aligned pages) from an
+// aligned source. Only the event loop thread takes from the pool.
+char *payload_pool[PAYLOAD_POOL];
+int payload_free = 0;
+
+char *payload_get()
+{
+    if (payload_free > 0)
+        return payload_pool[--payload_free];
+    void *page;
+    if (posix_memalign(&page, BLOCK_SIZE, BLOCK_SIZE) != 0)
+    {
+        perror("posix_memalign");
+        exit(1);
+    }
+    return page;
+}
+
+void payload_put(char *page)
+{
+    if (payload_free < PAYLOAD_POOL)
+        payload_pool[payload_free++] = page;
+    else
+        free(page);
+}
+
+// request scheduling in the poll loop: requests are read off the sockets as
+// they arrive and wait in one queue per class. Each turn of the loop answers
+// one of them, taking the classes in weighted round robin (-W) or by strict
+// priority (-P), so a lookup or stat does not wait behind a bulk ingest.
+// A TCP connection has at most one frame queued, which keeps its requests
+// in order.
+#define SCHED_CLASSES (4)
+#define SCHED_DEPTH (64) // requests a class holds; past that they are answered at once
+#define SCHED_META (0)   // lookups, stats, creates, unlinks, renames
+#define SCHED_READ (1)   // reads, a block at most
+#define SCHED_WRITE (2)  // writes and copies
+#define SCHED_MAINT (3)  // syncs, snapshots, shutdowns
+
+int sched_weight[SCHED_CLASSES] = {8, 4, 2, 1}; // requests a class is answered per round
+int sched_strict = 0;
+
+typedef struct {
+    image_t *img;
+    int sd;            // datagram socket to answer on, -1 for a TCP frame
+    tcp_conn_t *conn;  // the connection a TCP frame waits in
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    message msg;       // a datagram's header; its buf stays unused
+    char *payload;     // a datagram's buf, from the payload pool
+} sched_req_t;
+
+typedef struct {
+    sched_req_t reqs[SCHED_DEPTH];
+    int head;
+    int len;
+    int credit; // requests left in the class's current turn
+} sched_queue_t;
+
+sched_queue_t sched_queues[SCHED_CLASSES];
+int sched_turn = 0;
+int sched_pending = 0;
+
+int sched_class(message *msg, int replica)
+{
+    if (replica)
+        return SCHED_META; // the primary holds its client's reply until this one is applied
+    if (strcmp(msg->msg, "MFS_Read") == 0)
+        return SCHED_READ;
+    if (strcmp(msg->msg, "MFS_Write") == 0 || strcmp(msg->msg, "MFS_Copy") == 0)
+        return SCHED_WRITE;
+    if (strcmp(msg->msg, "MFS_Fsync") == 0 || strcmp(msg->msg, "MFS_Snapshot") == 0 || strcmp(msg->msg, "MFS_Shutdown") == 0)
+        return SCHED_MAINT;
+    return SCHED_META;
+}
+
+/**
+ * @brief Answer a request and send the reply back to whoever sent it
+ *
+ * @param req the request; a datagram's payload goes back to the pool
+ */
+void sched_answer(sched_req_t *req)
+{
+    image_t *img = req->img;
+    int shutdown = 0;
+    if (req->conn != NULL)
+    {
+        if (tcp_answer(req->conn, &shutdown) != 0 || shutdown)
+            tcp_close(req->conn, shutdown);
+        return;
+    }
+    if (!img->active)
+    {
+        payload_put(req->payload);
+        return;
+    }
+    message reply_msg; // message to be replied to client
+    struct iovec extents[2];
+    int rc;
+    pthread_mutex_lock(&fs_lock);
+    int res = serve_request(img, &req->msg, req->payload, &reply_msg, extents, &shutdown);
+    // read payloads point into the image, so they go out under the lock
+    respondToServer(&reply_msg, extents, res, req->sd, (struct sockaddr *)&req->addr, req->addr_len, &rc);
+    pthread_mutex_unlock(&fs_lock);
+    payload_put(req->payload);
+    if (shutdown)
+        volume_shutdown(img);
+}
+
+// queue a request behind the others of its class, or answer it when they are too many
+void sched_add(sched_req_t *req, message *msg)
+{
+    sched_queue_t *q = &sched_queues[sched_class(msg, req->conn != NULL && req->conn->replica)];
+    if (q->len == SCHED_DEPTH)
+    {
+        sched_answer(req);
+        return;
+    }
+    q->reqs[(q->head + q->len++) % SCHED_DEPTH] = *req;
+    sched_pending++;
+}
+
+/**
+ * @brief Read the datagrams waiting on sd into the queues, up to SCHED_DEPTH
+ * of them so one busy socket cannot hold up the loop
+ *
+ * @param img the volume the socket belongs to
+ * @param sd a UDP or unix datagram socket
+ */
+void sched_receive(image_t *img, int sd)
+{
+    sched_req_t req = {.img = img, .sd = sd};
+    for (int i = 0; i < SCHED_DEPTH && img->active; i++)
+    {
+        req.payload = payload_get();
+        // split the datagram: the header around buf lands in req.msg, buf
+        // itself in a page-aligned buffer of the pool
+        size_t tail = offsetof(message, buf) + sizeof(req.msg.buf);
+        struct iovec iov[3] = {
+            {.iov_base = &req.msg, .iov_len = offsetof(message, buf)},
+            {.iov_base = req.payload, .iov_len = sizeof(req.msg.buf)},
+            {.iov_base = (char *)&req.msg + tail, .iov_len = sizeof(message) - tail},
+        };
+        struct msghdr mh = {.msg_name = &req.addr, .msg_namelen = sizeof(req.addr), .msg_iov = iov, .msg_iovlen = 3};
+        int rc = recvmsg(sd, &mh, MSG_DONTWAIT);
+        if (rc <= 0)
+        {
+            payload_put(req.payload);
+            return;
+        }
+        printf("The Machine:: read message [size:%d contents:(%s)]\n", rc, req.msg.msg);
+        req.addr_len = mh.msg_namelen;
+        sched_add(&req, &req.msg);
+    }
+}
+
+// queue the frame tcp_receive completed on conn; the connection is not read again until it is answered
+void sched_receive_frame(tcp_conn_t *conn)
+{
+    sched_req_t req = {.img = conn->img, .sd = -1, .conn = conn};
+    sched_add(&req, (message *)(conn->inbuf + sizeof(uint32_t)));
+}
+
+// the class to answer next, -1 when every queue is empty
+int sched_pick()
+{
+    for (int c = 0; c < SCHED_CLASSES && sched_strict; c++)
+    {
+        if (sched_queues[c].len > 0)
+            return c;
+    }
+    for (int i = 0; i <= SCHED_CLASSES && !sched_strict && sched_pending > 0; i++)
+    {
+        sched_queue_t *q = &sched_queues[sched_turn];
+        if (q->len > 0 && q->credit > 0)
+        {
+            q->credit--;
+            return sched_turn;
+        }
+        sched_turn = (sched_turn + 1) % SCHED_CLASSES;
+        sched_queues[sched_turn].credit = sched_weight[sched_turn];
+    }
+    return -1;
+}
+
+// answer the next queued request
+void sched_dispatch()
+{
+    int c = sched_pick();
+    if (c < 0)
+        return;
+    sched_queue_t *q = &sched_queues[c];
+    sched_req_t *req = &q->reqs[q->head];
+    q->head = (q->head + 1) % SCHED_DEPTH;
+    q->len--;
+    sched_pending--;
+    sched_answer(req);
+}
+
+#define URING_ENTRIES (512)
+#define URING_BUFS (128)
+#define URING_BUF_LEN (8192)
+
+// user_data of io_uring completions: small tags for the sockets, anything
+// at or above TAG_MAX is the commit_batch_t whose fsync just finished
+#define TAG_RECV (1)     // + index into the datagram socket table
+#define TAG_LISTEN (128) // + volume index
+#define TAG_CONN (256)   // + index into tcp_conns
+#define TAG_MAX (1024)
+
+// a reply waiting for the fsync that makes its request durable
+typedef struct pending_reply {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    message reply;
+    image_t *img;
+    struct pending_reply *next;
+} pending_reply_t;
+
+typedef struct {
+    pending_reply_t *head;
+} commit_batch_t;
+
+// a datagram socket served through the ring
+typedef struct {
+    int fd;
+    image_t *img;
+    struct msghdr tmpl; // sizes of the name/control areas in each receive buffer
+} uring_dgram_t;
+
+void uring_arm_recv(uring_t *u, uring_bufs_t *bufs, uring_dgram_t *d, int index)
+{
+    struct io_uring_sqe *sqe = URING_GetSqe(u);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = d->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&d->tmpl;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs->bgid;
+    sqe->user_data = TAG_RECV + index;
+}
+
+void uring_arm_poll(uring_t *u, int fd, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = URING_GetSqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag;
+}
+
+void uring_send_list(pending_reply_t *p)
+{
+    while (p != NULL)
+    {
+        pending_reply_t *next = p->next;
+        sendto(p->fd, (char *)&p->reply, sizeof(message), reply_flags((struct sockaddr *)&p->addr), (struct sockaddr *)&p->addr, p->addr_len);
+        free(p);
+        p = next;
+    }
+}
+
+/**
+ * @brief io_uring event loop shared by every volume. Multishot receives stay
+ * posted on the datagram sockets; mutating requests no longer msync inline
+ * but join their volume's batch, whose dirty range is fsync'd asynchronously,
+ * and their replies leave when that fsync completes. The next requests are
+ * served while the disk works.
+ *
+ * @param unix_sd the unix datagram socket of volume 0 (-1 when unused)
+ * @return int -1 if io_uring is unavailable, otherwise does not return
+ */
+int uring_serve(int unix_sd)
+{
+    uring_t u;
+    uring_bufs_t bufs;
+    if (URING_Setup(&u, URING_ENTRIES) != 0 || URING_SetupBufs(&u, &bufs, URING_BUFS, URING_BUF_LEN, 0) != 0)
+    {
+        perror("io_uring");
+        return -1;
+    }
+    uring_dgram_t dgrams[MAX_VOLUMES + 1];
+    int num_dgrams = 0;
+    for (int v = 0; v < num_volumes; v++)
+        dgrams[num_dgrams++] = (uring_dgram_t){.fd = volumes[v].sd, .img = &volumes[v]};
+    if (unix_sd >= 0)
+        dgrams[num_dgrams++] = (uring_dgram_t){.fd = unix_sd, .img = &volumes[0]};
+    for (int i = 0; i < num_dgrams; i++)
+    {
+        dgrams[i].tmpl.msg_namelen = sizeof(struct sockaddr_storage);
+        uring_arm_recv(&u, &bufs, &dgrams[i], i);
+    }
+    for (int v = 0; v < num_volumes; v++)
+    {
+        if (volumes[v].tcp_sd >= 0)
+            uring_arm_poll(&u, volumes[v].tcp_sd, TAG_LISTEN + v);
+    }
+
+    persist_deferred = 1;
+    int inflight = 0;
+    pending_reply_t *shutdown_replies = NULL; // sent once nothing is in flight
+    while (1)
+    {
+        if (stats_requested)
+        {
+            stats_requested = 0;
+            volume_stats(stderr);
+        }
+        URING_Submit(&u, 1);
+        commit_batch_t *batch[MAX_VOLUMES] = {NULL};
+        struct io_uring_cqe *cqe;
+        while ((cqe = URING_PeekCqe(&u)) != NULL)
+        {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            URING_SeenCqe(&u);
+
+            if (tag >= TAG_RECV && tag < TAG_LISTEN)
+            {
+                uring_dgram_t *d = &dgrams[tag - TAG_RECV];
+                if (!(flags & IORING_CQE_F_MORE))
+                    uring_arm_recv(&u, &bufs, d, tag - TAG_RECV);
+                if (res < 0 || !(flags & IORING_CQE_F_BUFFER))
+                    continue;
+                unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                char *buf = bufs.base + (size_t)bid * bufs.buf_len;
+                struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+                char *name = buf + sizeof(*out);
+                message *received_msg = (message *)(name + d->tmpl.msg_namelen + d->tmpl.msg_controllen);
+                printf("The Machine:: read message [size:%u contents:(%s)]\n", out->payloadlen, received_msg->msg);
+                if (!d->img->active)
+                {
+                    URING_RecycleBuf(&bufs, bid);
+                    continue;
+                }
+
+                message reply;
+                struct iovec extents[2];
+                socklen_t addr_len = out->namelen < sizeof(struct sockaddr_storage) ? out->namelen : sizeof(struct sockaddr_storage);
+                int stop = 0;
+                pthread_mutex_lock(&fs_lock);
+                unsigned long gen = d->img->dirty_gen; // the shm and poll threads defer writes too
+                int res = serve_request(d->img, received_msg, NULL, &reply, extents, &stop);
+                if (!stop && d->img->dirty_gen == gen)
+                {
+                    // nothing to commit: answer now, reads straight from the image
+                    int rc;
+                    respondToServer(&reply, extents, res, d->fd, (struct sockaddr *)name, addr_len, &rc);
+                    pthread_mutex_unlock(&fs_lock);
+                    URING_RecycleBuf(&bufs, bid);
+                    continue;
+                }
+                pthread_mutex_unlock(&fs_lock);
+
+                pending_reply_t *p = malloc(sizeof(pending_reply_t));
+                p->fd = d->fd;
+                p->img = d->img;
+                p->addr_len = addr_len;
+                memcpy(&p->addr, name, addr_len);
+                p->reply = reply;
+                URING_RecycleBuf(&bufs, bid);
+
+                if (stop)
+                {
+                    p->next = shutdown_replies;
+                    shutdown_replies = p;
+                }
+                else
+                {
+                    int v = d->img - volumes;
+                    if (batch[v] == NULL)
+                        batch[v] = calloc(1, sizeof(commit_batch_t));
+                    p->next = batch[v]->head;
+                    batch[v]->head = p;
+                }
+            }
+            else if (tag >= TAG_LISTEN && tag < TAG_CONN)
+            {
+                image_t *img = &volumes[tag - TAG_LISTEN];
+                tcp_conn_t *conn = tcp_accept(img);
+                if (conn != NULL)
+                    uring_arm_poll(&u, conn->fd, TAG_CONN + (conn - tcp_conns));
+                if (img->active)
+                    uring_arm_poll(&u, img->tcp_sd, tag);
+            }
+            else if (tag >= TAG_CONN && tag < TAG_MAX)
+            {
+                // stream clients are answered in order on the connection, so
+                // they keep the synchronous path
+                tcp_conn_t *conn = &tcp_conns[tag - TAG_CONN];
+                persist_deferred = 0;
+                if (tcp_serve(conn) == 0)
+                    uring_arm_poll(&u, conn->fd, tag);
+                persist_deferred = 1;
+            }
+            else
+            {
+                commit_batch_t *done = (commit_batch_t *)(uintptr_t)tag;
+                uring_send_list(done->head);
+                free(done);
+                inflight--;
+            }
+        }
+
+        // group commit: one fsync per volume covers every request of this round
+        for (int v = 0; v < num_volumes; v++)
+        {
+            image_t *img = &volumes[v];
+            if (batch[v] == NULL)
+                continue;
+            // deferred writes on other threads grow the range, and MFS_Fsync
+            // clears it: take it whole, under the lock they hold
+            pthread_mutex_lock(&fs_lock);
+            char *lo = img->dirty_lo, *hi = img->dirty_hi;
+            img->dirty_lo = img->dirty_hi = NULL;
+            pthread_mutex_unlock(&fs_lock);
+            struct io_uring_sqe *sqe = URING_GetSqe(&u);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = img->fd;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            // an MFS_Fsync since may have taken the range: the replies still
+            // ride on an fsync, of the whole file
+            sqe->off = lo == NULL ? 0 : lo - (char *)img->image;
+            sqe->len = lo == NULL || hi - lo > UINT32_MAX ? 0 : hi - lo; // 0 syncs to end of file
+            sqe->user_data = (uint64_t)(uintptr_t)batch[v];
+            inflight++;
+        }
+
+        // a shut down volume is already msync'd; its answer waits for the
+        // replies queued ahead of it
+        if (shutdown_replies != NULL && inflight == 0)
+        {
+            pending_reply_t *p = shutdown_replies;
+            shutdown_replies = NULL;
+            while (p != NULL)
+            {
+                pending_reply_t *next = p->next;
+                image_t *img = p->img;
+                p->next = NULL;
+                uring_send_list(p);
+                volume_shutdown(img);
+                p = next;
+            }
+        }
+    }
+    return 0;
+}
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/**
+ * @brief Map an image file shared and writable. With hugepages the mapping is
+ * placed on a 2 MB boundary and marked MADV_HUGEPAGE so the kernel can back it
+ * with huge pages (where the file system supports it), cutting TLB misses on
+ * large images.
+ *
+ * @param fd the open image
+ * @param size the image size in bytes
+ * @param hugepages ask for transparent huge pages
+ * @param readonly map without write access
+ * @return void* the mapping, NULL on failure
+ */
+void *image_map(int fd, size_t size, int hugepages, int readonly)
+{
+    int prot = readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+    if (!hugepages)
+    {
+        void *image = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+        return image == MAP_FAILED ? NULL : image;
+    }
+
+    // reserve enough address space to slide the mapping onto a huge page boundary
+    char *area = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
+        return NULL;
+    char *aligned = (char *)(((uintptr_t)area + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > area)
+        munmap(area, aligned - area);
+    munmap(aligned + size, area + size + HUGE_PAGE_SIZE - (aligned + size));
+
+    void *image = mmap(aligned, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (image == MAP_FAILED)
+        return NULL;
+    if (madvise(image, size, MADV_HUGEPAGE) != 0)
+        perror("madvise(MADV_HUGEPAGE)");
+    return image;
+}
+
+/**
+ * @brief Map an image and open its sockets
+ *
+ * @param img the volume to fill in
+ * @param port UDP (and TCP) port the volume is served on
+ * @param path the image file
+ * @param use_tcp also listen for TCP clients on port
+ * @param hugepages ask for transparent huge pages behind the mapping
+ * @param readonly serve the image read-only, e.g. to mount a snapshot
+ * @return int 0 on success, -1 on failure
+ */
+int volume_open(image_t *img, int port, const char *path, int use_tcp, int hugepages, int readonly)
+{
+    // Sanity check
+    printf("portnum: %d\nfileImage: %s \n", port, path);
+
+    // If the file Sys doesn't exist, do this.
+    if (access(path, F_OK) != 0)
+    {
+        printf("image does not exist\n");
+        return -1;
+    }
+    img->port = port;
+    img->path = path;
+    img->tcp_sd = -1;
+    for (int r = 0; r < MAX_REPLICAS; r++)
+        img->replica_fd[r] = -1;
+
+    // Establish listening on portnum
+    img->sd = UDP_Open(port);
+    if (img->sd < 0 || (use_tcp && (img->tcp_sd = TCP_Listen(port)) < 0))
+        return -1;
+
+    // Read-in the super block
+    img->readonly = readonly;
+    img->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    struct stat sbuf;
+    if (img->fd < 0 || fstat(img->fd, &sbuf) < 0)
+        return -1;
+    img->image_size = sbuf.st_size;
+    img->image = image_map(img->fd, img->image_size, hugepages, readonly);
+    if (img->image == NULL)
+        return -1;
+
+    super_t *superBlock = (super_t *)img->image;
+    img->superBlock = superBlock;
+
+    // Sanity check
+    printf("superBlock info\n inode_bitmap_addr: %d\n inode_bitmap_len: %d\n data_bitmap_addr: %d\n data_bitmap_len: %d\n inode_region_addr: %d\n inode_region_len: %d\n data_region_addr: %d\n data_region_len: %d\n",
+           superBlock->inode_bitmap_addr, superBlock->inode_bitmap_len, superBlock->data_bitmap_addr,
+           superBlock->data_bitmap_len, superBlock->inode_region_addr, superBlock->inode_region_len,
+           superBlock->data_region_addr, superBlock->data_region_len);
+
+    // Read-in the bitmaps
+    img->inode_bitmap = BLOCK_ADDR(img->image, superBlock->inode_bitmap_addr);
+    img->data_bitmap = BLOCK_ADDR(img->image, superBlock->data_bitmap_addr);
+
+    // Read-in the inode table
+    img->inode_table = (inode_t *)BLOCK_ADDR(img->image, superBlock->inode_region_addr);
+
+    // Read-in the data region
+    img->data_region = BLOCK_ADDR(img->image, superBlock->data_region_addr);
+
+    img->numInode = (size_t)superBlock->inode_region_len * BLOCK_SIZE / sizeof(inode_t);
+
+    if (superBlock->checksum_len > 0)
+    {
+        img->checksums = (uint32_t *)BLOCK_ADDR(img->image, superBlock->checksum_addr);
+        img->scrub_known = calloc(img->image_size / BLOCK_SIZE / 8 + 1, 1);
+        if (img->scrub_known == NULL)
+            return -1;
+        if (superBlock->checksum_stale && readonly)
+            fprintf(stderr, "%s was not shut down cleanly: blocks may fail their checksums until it is served writable or repaired with mfsck -r\n", path);
+        else if (superBlock->checksum_stale)
+            fprintf(stderr, "%s was not shut down cleanly: %lu checksums recomputed\n", path, checksums_rebuild(img));
+        if (!readonly && checksums_mark(img, 1) != 0)
+            return -1;
+        printf(" checksum_addr: %d\n checksum_len: %d\n", superBlock->checksum_addr, superBlock->checksum_len);
+    }
+    if (superBlock->compress)
+    {
+        sector_map_build(img);
+        if (img->sector_map == NULL)
+            return -1;
+    }
+    if (superBlock->dedup && dedup_build(img) != 0)
+        return -1;
+    img->readahead = calloc(img->numInode, sizeof(readahead_t));
+    if (img->readahead == NULL)
+        return -1;
+
+    // bitmaps and inodes are hit at random. The data region keeps the default
+    // hint: a file's blocks are scattered across it, so sequential readers are
+    // served by read_ahead instead
+    madvise(img->image, img->data_region - (char *)img->image, MADV_RANDOM);
+    img->active = 1;
+    return 0;
+}
+
+#ifndef FSSERV_NO_MAIN
+void usage()
+{
+    fprintf(stderr, "usage: server [-B host:port] [-C] [-H] [-M name=host:port] [-m] [-P] [-R] [-S MB/s] [-t] [-U] [-u socket_path] [-W weights] [portnum] [image] [[portnum] [image] ...]\n"
+                    "  every portnum/image pair is a volume served by this one process\n"
+                    "  -B  replicate every volume to a backup fsserv started with -t on a copy\n"
+                    "      of its image; volume i goes to port + i, clients are answered once\n"
+                    "      the backup has applied their request. Up to 4 backups, which also\n"
+                    "      serve reads to clients that add them with MFS_AddReplica; they\n"
+                    "      refuse client writes until they lose their primary\n"
+                    "  -C  let MFS_Snapshot copy the whole image, holding every volume, on\n"
+                    "      file systems that cannot clone it\n"
+                    "  -H  back image mappings with transparent huge pages\n"
+                    "  -M  mount the root of the fsserv at host:port as name in the root\n"
+                    "      directory, for clients that follow the shard map (up to 15)\n"
+                    "  -m  also serve same-host clients over a shared-memory ring per volume\n"
+                    "  -P  answer queued requests by strict priority: metadata, reads, writes,\n"
+                    "      then syncs, snapshots and shutdowns\n"
+                    "  -R  serve the images read-only, e.g. snapshots taken with MFS_Snapshot\n"
+                    "  -S  rate of the background checksum scrub on images made with mkfs -c\n"
+                    "      (default 64 MB/s, 0 turns it off), with a minute between passes\n"
+                    "  -t  also accept length-framed requests over TCP on each portnum\n"
+                    "  -U  io_uring event loop: replies leave once an async fsync covers them\n"
+                    "  -u  also serve the first volume on a unix datagram socket\n"
+                    "  -W  requests of each of those four classes answered per round of the\n"
+                    "      weighted round robin between them (default 8,4,2,1); neither -P\n"
+                    "      nor -W applies to the io_uring loop or the shared-memory rings\n"
+                    "  SIGUSR1 prints per-volume counters to stderr\n");
+    exit(1);
+}
+
+char *unix_path = NULL;
+
+void unix_cleanup()
+{
+    unlink(unix_path);
+}
+
+int main(int argc, char *argv[])
+{
+    printf("Hello From Server \n");
+    int use_shm = 0;
+    int use_tcp = 0;
+    int use_uring = 0;
+    int use_hugepages = 0;
+    int readonly = 0;
+    int ch;
+    char *backup_host[MAX_REPLICAS];
+    int backup_port[MAX_REPLICAS];
+    int num_backups = 0;
+    while ((ch = getopt(argc, argv, "B:CHM:mPRS:tUu:W:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'B':
+            if (strrchr(optarg, ':') == NULL || num_backups == MAX_REPLICAS)
+                usage();
+            backup_host[num_backups] = optarg;
+            backup_port[num_backups++] = atoi(strrchr(optarg, ':') + 1);
+            *strrchr(optarg, ':') = '\0';
+            break;
+        case 'C':
+            snapshot_copy = 1;
+            break;
+        case 'M':
+        {
+            shard_t *shard = &shard_map[num_shards];
+            if (num_shards == MAX_SHARDS - 1 || sscanf(optarg, "%27[^=]=%63[^:]:%d", shard->name, shard->host, &shard->port) != 3)
+                usage();
+            num_shards++;
+            break;
+        }
+        case 'P':
+            sched_strict = 1;
+            break;
+        case 'W':
+            if (sscanf(optarg, "%d,%d,%d,%d", &sched_weight[SCHED_META], &sched_weight[SCHED_READ], &sched_weight[SCHED_WRITE],
+                       &sched_weight[SCHED_MAINT]) != SCHED_CLASSES)
+                usage();
+            for (int c = 0; c < SCHED_CLASSES; c++)
+            {
+                if (sched_weight[c] < 1)
+                    usage();
+            }
+            break;
+        case 'R':
+            readonly = 1;
+            break;
+        case 'S':
+            scrub_rate = atoi(optarg);
+            break;
+        case 'H':
+            use_hugepages = 1;
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'm':
+            use_shm = 1;
+            break;
+        case 't':
+            use_tcp = 1;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    // server [portnum] [image] ..., positional arguments come in pairs
+    int npos = argc - optind;
+    if (npos < 2 || npos % 2 != 0 || npos / 2 > MAX_VOLUMES)
+        usage();
+
+    for (int i = optind; i < argc; i += 2)
+    {
+        // Convert arguments to variables of port number and file image filename.
+        if (volume_open(&volumes[num_volumes], atoi(argv[i]), argv[i + 1], use_tcp, use_hugepages, readonly) != 0)
+            exit(1);
+        num_volumes++;
+    }
+    for (int v = 0; v < num_volumes; v++)
+    {
+        for (int b = 0; b < num_backups; b++)
+        {
+            if (replica_connect(&volumes[v], backup_host[b], backup_port[b] + v) != 0)
+                exit(1);
+        }
+    }
+
+    if (use_shm)
+    {
+        atexit(shm_cleanup);
+        signal(SIGINT, shm_on_signal);
+        signal(SIGTERM, shm_on_signal);
+        for (int v = 0; v < num_volumes; v++)
+        {
+            if (shm_start(&volumes[v]) != 0)
+                exit(1);
+        }
+    }
+    signal(SIGUSR1, on_sigusr1);
+
+    for (int v = 0; v < num_volumes && scrub_rate > 0; v++)
+    {
+        pthread_t tid;
+        if (volumes[v].checksums != NULL && pthread_create(&tid, NULL, scrub_serve, &volumes[v]) == 0)
+            pthread_detach(tid);
+    }
+
+    int unix_sd = -1;
+    if (unix_path != NULL)
+    {
+        unix_sd = UNIX_Open(unix_path);
+        if (unix_sd < 0)
+            exit(1);
+        atexit(unix_cleanup);
+    }
+
+    for (int i = 0; i < MAX_TCP_CONNS; i++)
+        tcp_conns[i].fd = -1;
+
+    if (use_uring)
+    {
+        uring_serve(unix_sd);
+        printf("io_uring unavailable, falling back to poll\n");
+    }
+
+    // Start the server
+    // fds: per volume its UDP socket and TCP listener, then the unix socket,
+    // then one per TCP client. poll skips entries whose fd is negative.
+    struct pollfd fds[2 * MAX_VOLUMES + 1 + MAX_TCP_CONNS];
+    while (1)
+    {
+        if (stats_requested)
+        {
+            stats_requested = 0;
+            volume_stats(stderr);
+        }
+        int n = 0;
+        for (int v = 0; v < num_volumes; v++)
+        {
+            int active = volumes[v].active;
+            fds[n++] = (struct pollfd){.fd = active ? volumes[v].sd : -1, .events = POLLIN};
+            fds[n++] = (struct pollfd){.fd = active ? volumes[v].tcp_sd : -1, .events = POLLIN};
+        }
+        fds[n++] = (struct pollfd){.fd = unix_sd, .events = POLLIN};
+        for (int i = 0; i < MAX_TCP_CONNS; i++) // a connection with a frame queued waits for its answer
+            fds[n++] = (struct pollfd){.fd = tcp_conns[i].have == TCP_FRAME_SIZE ? -1 : tcp_conns[i].fd, .events = POLLIN};
+
+        printf("The Machine:: waiting...\n");
+        if (poll(fds, n, sched_pending > 0 ? 0 : -1) < 0)
+            continue;
+        for (int v = 0; v < num_volumes; v++)
+        {
+            if (fds[2 * v].revents & POLLIN)
+                sched_receive(&volumes[v], volumes[v].sd);
+            if (fds[2 * v + 1].revents & POLLIN)
+                tcp_accept(&volumes[v]);
+        }
+        if (fds[2 * num_volumes].revents & POLLIN)
+            sched_receive(&volumes[0], unix_sd);
+        for (int i = 0; i < MAX_TCP_CONNS; i++)
+        {
+            if (!(fds[2 * num_volumes + 1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int rc = tcp_receive(&tcp_conns[i]);
+            if (rc < 0)
+                tcp_close(&tcp_conns[i], 0);
+            else if (rc == 1)
+                sched_receive_frame(&tcp_conns[i]);
+        }
+        sched_dispatch();
+    }
+    return 0;
+}
+#endif // FSSERV_NO_MAIN
@@ -1,3 +1,6 @@
+#ifndef __MESSAGE_h__
+#define __MESSAGE_h__
+
 #include<stdio.h>
 
 
@@ -12,3 +15,11 @@ typedef struct message
     int param3;
     char charParam[48];
 } message;
+
+// charParam of an MFS_Write the server may leave unsynced until the next MFS_Fsync
+#define MSG_WRITE_DEFERRED "deferred"
+
+// reply code of a backup asked to modify its volume while its primary is alive
+#define MSG_STANDBY (-3)
+
+#endif // __MESSAGE_h__
@@ -6,6 +6,9 @@
 
 #define MFS_BLOCK_SIZE   (4096)
 
+// inode numbers in a sharded namespace (fsserv -M): the shard, then the inode on it
+#define MFS_SHARD_SHIFT  (24)
+
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
@@ -19,12 +22,18 @@ typedef struct __MFS_DirEnt_t {
 
 
 int MFS_Init(char *hostname, int port);
+int MFS_AddReplica(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
+int MFS_Rename(int src_pinum, char *src_name, int dst_pinum, char *dst_name);
+int MFS_Copy(int src_inum, int dst_pinum, char *name);
 int MFS_Shutdown();
+int MFS_Snapshot(char *name);
+int MFS_WriteBack(int enable);
+int MFS_Fsync(int inum);
 
 #endif // __MFS_h__
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef __MFS_CRC_h__
+#define __MFS_CRC_h__
+
+//
+// CRC32C (Castagnoli) for the per-block checksum table laid out by mkfs -c.
+// x86-64 CPUs with SSE4.2 compute it with the crc32 instruction, 8 bytes per
+// step; everything else falls back to a table-driven loop.
+//
+// the table stores crc ^ CRC_ZERO_BLOCK rather than the crc itself, so an
+// all-zero block has entry 0: a fresh, sparse image needs no entries written
+// for the blocks mkfs leaves as holes.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC_BLOCK_SIZE (4096)
+#define CRC_PER_BLOCK  (CRC_BLOCK_SIZE / sizeof(uint32_t)) // table entries in one block
+
+static uint32_t crc32c_table[256];
+static uint32_t crc_zero_block;
+static int crc_have_hw;
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len-- > 0)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t) c;
+    for (; len > 0; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+static inline uint32_t CRC32C(const void *buf, size_t len) {
+#if defined(__x86_64__)
+    if (crc_have_hw)
+        return ~crc32c_hw(~0u, buf, len);
+#endif
+    return ~crc32c_sw(~0u, buf, len);
+}
+
+// checksum table entry for one block
+static inline uint32_t CRC_Block(const void *block) {
+    return CRC32C(block, CRC_BLOCK_SIZE) ^ crc_zero_block;
+}
+
+__attribute__((constructor))
+static void CRC_Init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        crc32c_table[i] = c;
+    }
+#if defined(__x86_64__)
+    crc_have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    static const unsigned char zeros[CRC_BLOCK_SIZE];
+    crc_zero_block = CRC32C(zeros, sizeof(zeros));
+}
+
+#endif // __MFS_CRC_h__
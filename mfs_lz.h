@@ -0,0 +1,154 @@
+#ifndef __MFS_LZ_h__
+#define __MFS_LZ_h__
+
+//
+// small LZ77 codec for the compressed blocks of images made with mkfs -z,
+// in the spirit of LZ4: greedy matching through a hash of the next 4 bytes,
+// and a byte-aligned stream of sequences that decodes without a table.
+//
+// a sequence is a token byte, whose high nibble is the literal count and low
+// nibble the match length - 4 (15 in either means more length bytes follow,
+// each adding up to 255), the literals, then a 2-byte little-endian match
+// offset and the extra match length bytes. the last sequence has literals
+// only and ends the stream.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS (12)
+#define LZ_MIN_MATCH (4)
+
+static inline uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// write the extra bytes of a length that did not fit its nibble
+static inline int lz_put_len(unsigned char *dst, int op, int cap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= cap)
+            return -1;
+        dst[op++] = 255;
+    }
+    if (op >= cap)
+        return -1;
+    dst[op++] = len;
+    return op;
+}
+
+// one sequence: literals src[0..nlit), then a match of mlen at offset (mlen 0: none)
+static inline int lz_put_seq(unsigned char *dst, int op, int cap, const unsigned char *lit, int nlit, int offset, int mlen) {
+    if (op >= cap)
+        return -1;
+    int token = op++;
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst[token] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15 && (op = lz_put_len(dst, op, cap, nlit - 15)) < 0)
+        return -1;
+    if (op + nlit > cap)
+        return -1;
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return op;
+    if (op + 2 > cap)
+        return -1;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    if (ml >= 15 && (op = lz_put_len(dst, op, cap, ml - 15)) < 0)
+        return -1;
+    return op;
+}
+
+// compress src[0..n) into dst; returns the compressed length, 0 when it does not fit in cap
+static inline int LZ_Compress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    int ip = 1, anchor = 0, op = 0;
+    while (ip + LZ_MIN_MATCH <= n) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = table[h];
+        table[h] = ip;
+        if (ip - cand > 65535 || lz_read32(src + cand) != seq) {
+            ip += 1 + ((ip - anchor) >> 6); // skip faster through data that does not compress
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && src[cand + len] == src[ip + len])
+            len++;
+        if ((op = lz_put_seq(dst, op, cap, src + anchor, ip - anchor, ip - cand, len)) < 0)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if ((op = lz_put_seq(dst, op, cap, src + anchor, n - anchor, 0, 0)) < 0)
+        return 0;
+    return op;
+}
+
+// read the extra bytes of a length; -1 past the end of the input
+static inline int lz_get_len(const unsigned char *src, int *ip, int n) {
+    int len = 0, b;
+    do {
+        if (*ip >= n)
+            return -1;
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+// decompress src[0..n) into dst; returns the decompressed length, -1 on a corrupt stream
+static inline int LZ_Decompress(const unsigned char *src, int n, unsigned char *dst, int cap) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            int more = lz_get_len(src, &ip, n);
+            if (more < 0)
+                return -1;
+            nlit += more;
+        }
+        if (ip + nlit > n || op + nlit > cap)
+            return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n)
+            break; // the last sequence has no match
+        if (ip + 2 > n)
+            return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        int mlen = (token & 0xf) + LZ_MIN_MATCH;
+        if ((token & 0xf) == 15) {
+            int more = lz_get_len(src, &ip, n);
+            if (more < 0)
+                return -1;
+            mlen += more;
+        }
+        if (offset == 0 || offset > op || op + mlen > cap)
+            return -1;
+        if (offset == 1) {
+            memset(dst + op, dst[op - 1], mlen); // a run of one byte
+        } else if (offset >= 8) {
+            // 8 bytes at a time never reads what the same step writes
+            int i = 0;
+            for (; i + 8 <= mlen; i += 8)
+                memcpy(dst + op + i, dst + op + i - offset, 8);
+            for (; i < mlen; i++)
+                dst[op + i] = dst[op + i - offset];
+        } else {
+            for (int i = 0; i < mlen; i++) // byte by byte: the match overlaps its own output
+                dst[op + i] = dst[op + i - offset];
+        }
+        op += mlen;
+    }
+    return op;
+}
+
+#endif // __MFS_LZ_h__
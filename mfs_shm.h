@@ -0,0 +1,68 @@
+#ifndef __MFS_SHM_h__
+#define __MFS_SHM_h__
+
+//
+// shared-memory request/response ring for clients on the same host as fsserv.
+// the server creates one ring per port; a client claims a free slot, writes the
+// request straight into it, rings the doorbell and sleeps on the slot's state.
+// a slot records the pid of the client holding it, so the slots of clients
+// that died holding one can be taken back.
+//
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "message.h"
+
+#define SHM_MAGIC (0x4d465352) // "MFSR"
+#define SHM_SLOTS (16)
+#define SHM_TIMEOUT (30) // seconds a client waits for a slot, or for its reply
+
+// slot states, also used as the futex word the client sleeps on
+#define SHM_FREE    (0)
+#define SHM_CLAIMED (1)
+#define SHM_REQUEST (2)
+#define SHM_REPLY   (3)
+
+typedef struct {
+    uint32_t state;
+    int32_t owner; // pid of the client holding the slot, 0 while it is free
+    message req;
+    message rep;
+} shm_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t nslots;
+    uint32_t doorbell; // bumped by clients for every request, the server sleeps on it
+    uint32_t released; // bumped whenever a slot is freed, clients waiting for one sleep on it
+    int32_t server;    // pid of the fsserv serving the ring
+    shm_slot_t slots[SHM_SLOTS];
+} shm_ring_t;
+
+// name of the ring served next to the UDP socket on port
+static inline void SHM_Name(char *buf, size_t n, int port) {
+    snprintf(buf, n, "/mfs.%d", port);
+}
+
+// sleep while *addr == val, for at most timeout_sec (0 waits forever)
+static inline int SHM_Wait(uint32_t *addr, uint32_t val, int timeout_sec) {
+    struct timespec ts = {.tv_sec = timeout_sec, .tv_nsec = 0};
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout_sec ? &ts : NULL, NULL, 0);
+}
+
+static inline int SHM_Wake(uint32_t *addr, int n) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+// whether the process pid is gone; pids the caller may not signal are alive
+static inline int SHM_Gone(int32_t pid) {
+    return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+#endif // __MFS_SHM_h__
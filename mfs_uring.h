@@ -0,0 +1,145 @@
+#ifndef __MFS_URING_h__
+#define __MFS_URING_h__
+
+//
+// minimal io_uring plumbing for fsserv, straight on the syscalls so the server
+// keeps building without liburing. one submission/completion ring plus one
+// provided-buffer ring that multishot receives pick their buffers from.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// linux/fs.h, pulled in above, defines a 1 KB BLOCK_SIZE; the file system's own is 4 KB
+#undef BLOCK_SIZE
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending; // sqes filled in but not yet handed to the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned entries;
+    unsigned buf_len;
+    int bgid;
+} uring_bufs_t;
+
+static inline int URING_Setup(uring_t *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(u->fd);
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    char *ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+// next free submission entry, zeroed; NULL when the queue is full
+static inline struct io_uring_sqe *URING_GetSqe(uring_t *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *u->sq_tail + u->sq_pending;
+    if (tail - head > *u->sq_mask)
+        return NULL;
+    unsigned idx = tail & *u->sq_mask;
+    u->sq_array[idx] = idx;
+    u->sq_pending++;
+    memset(&u->sqes[idx], 0, sizeof(struct io_uring_sqe));
+    return &u->sqes[idx];
+}
+
+// hand every pending sqe to the kernel and wait for at least wait_nr completions
+static inline int URING_Submit(uring_t *u, unsigned wait_nr) {
+    unsigned submit = u->sq_pending;
+    __atomic_store_n(u->sq_tail, *u->sq_tail + submit, __ATOMIC_RELEASE);
+    u->sq_pending = 0;
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// oldest unconsumed completion, NULL if there is none
+static inline struct io_uring_cqe *URING_PeekCqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void URING_SeenCqe(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// hand buffer bid back to the kernel for the next receive
+static inline void URING_RecycleBuf(uring_bufs_t *b, unsigned bid) {
+    unsigned short tail = b->ring->tail;
+    struct io_uring_buf *buf = &b->ring->bufs[tail & (b->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(b->base + (size_t)bid * b->buf_len);
+    buf->len = b->buf_len;
+    buf->bid = bid;
+    __atomic_store_n(&b->ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// register entries (a power of two) buffers of buf_len bytes as group bgid
+static inline int URING_SetupBufs(uring_t *u, uring_bufs_t *b, unsigned entries, unsigned buf_len, int bgid) {
+    size_t ring_len = entries * sizeof(struct io_uring_buf);
+    b->ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    b->base = mmap(NULL, (size_t)entries * buf_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED || b->base == MAP_FAILED)
+        return -1;
+    b->entries = entries;
+    b->buf_len = buf_len;
+    b->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return -1;
+    for (unsigned i = 0; i < entries; i++)
+        URING_RecycleBuf(b, i);
+    return 0;
+}
+
+#endif // __MFS_URING_h__
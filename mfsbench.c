@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mfs.h"
+
+// load generator for fsserv, links against the MFS client library (fscli.c).
+// libmfs keeps its connection in globals, so every client is its own process.
+
+#define OP_LOOKUP (0)
+#define OP_STAT   (1)
+#define OP_READ   (2)
+#define OP_WRITE  (3)
+#define OP_CREAT  (4)
+#define OP_UNLINK (5)
+#define NUM_OPS   (6)
+
+#define MAX_DIRS    (64)
+#define MAX_FANOUT  (128)
+#define MAX_FILE_SIZE (30 * MFS_BLOCK_SIZE)
+
+static const char *op_names[NUM_OPS] = {"lookup", "stat", "read", "write", "creat", "unlink"};
+
+typedef struct {
+    uint32_t op;
+    int32_t  rc;
+    uint64_t ns;
+} sample_t;
+
+typedef struct {
+    char *host;
+    int port;
+    int clients;
+    int ops;
+    int mix[NUM_OPS];
+    int file_size;
+    int dirs;
+    int fanout;
+    double rate;
+    char *out_file;
+} bench_cfg_t;
+
+void usage() {
+    fprintf(stderr, "usage: mfsbench [-h host] [-p port] [-c clients] [-n ops_per_client] [-m mix]\n"
+                    "                [-s file_size] [-d dirs] [-f files_per_dir] [-r rate_per_client] [-o out.json]\n"
+                    "  mix is a comma list of op=weight, ops: lookup stat read write creat unlink\n"
+                    "  default mix: lookup=30,stat=20,read=25,write=20,creat=3,unlink=2\n");
+    exit(1);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = {.tv_sec = deadline / 1000000000ull, .tv_nsec = deadline % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static int parse_mix(char *spec, int *mix) {
+    memset(mix, 0, sizeof(int) * NUM_OPS);
+    char *save;
+    for (char *tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        int op;
+        for (op = 0; op < NUM_OPS; op++)
+            if (strcmp(tok, op_names[op]) == 0)
+                break;
+        if (op == NUM_OPS || atoi(eq + 1) < 0)
+            return -1;
+        mix[op] = atoi(eq + 1);
+    }
+    return 0;
+}
+
+static int pick_op(int *mix, int total) {
+    int r = rand() % total;
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (r < mix[op])
+            return op;
+        r -= mix[op];
+    }
+    return OP_STAT;
+}
+
+// build /b<id>/d<j>/f<k> with every file filled to file_size
+static int setup_tree(bench_cfg_t *cfg, int id, int *dir_inum, int file_inum[][MAX_FANOUT], char *block) {
+    char name[28];
+    snprintf(name, sizeof(name), "b%d", id);
+    if (MFS_Creat(0, MFS_DIRECTORY, name) < 0)
+        return -1;
+    int top = MFS_Lookup(0, name);
+    if (top < 0)
+        return -1;
+    for (int j = 0; j < cfg->dirs; j++) {
+        snprintf(name, sizeof(name), "d%d", j);
+        if (MFS_Creat(top, MFS_DIRECTORY, name) < 0 || (dir_inum[j] = MFS_Lookup(top, name)) < 0)
+            return -1;
+        for (int k = 0; k < cfg->fanout; k++) {
+            snprintf(name, sizeof(name), "f%d", k);
+            if (MFS_Creat(dir_inum[j], MFS_REGULAR_FILE, name) < 0 || (file_inum[j][k] = MFS_Lookup(dir_inum[j], name)) < 0)
+                return -1;
+            for (int off = 0; off < cfg->file_size; off += MFS_BLOCK_SIZE) {
+                int n = cfg->file_size - off < MFS_BLOCK_SIZE ? cfg->file_size - off : MFS_BLOCK_SIZE;
+                if (MFS_Write(file_inum[j][k], block, off, n) < 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void run_client(bench_cfg_t *cfg, int id, sample_t *samples, int ready_fd, int go_fd) {
+    // the client library is chatty on stdout; keep it out of the report
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(1);
+    srand(getpid());
+
+    static int file_inum[MAX_DIRS][MAX_FANOUT];
+    int dir_inum[MAX_DIRS];
+    char block[MFS_BLOCK_SIZE];
+    memset(block, 'a' + id % 26, sizeof(block));
+
+    char ok = 1;
+    if (MFS_Init(cfg->host, cfg->port) != 0 || setup_tree(cfg, id, dir_inum, file_inum, block) != 0) {
+        fprintf(stderr, "mfsbench: client %d failed to build its tree (is the image large enough?)\n", id);
+        ok = 0;
+    }
+    if (write(ready_fd, &ok, 1) != 1 || !ok)
+        exit(1);
+    char c;
+    while (read(go_fd, &c, 1) > 0)
+        ; // parent closes the pipe to start everyone at once
+
+    int total = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+        total += cfg->mix[op];
+    int blocks = (cfg->file_size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+    int temp_dir[MAX_FANOUT], temp_id[MAX_FANOUT], ntemp = 0, next_temp = 0;
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    uint64_t scheduled = now_ns();
+
+    for (int i = 0; i < cfg->ops; i++) {
+        int op = pick_op(cfg->mix, total);
+        int j = rand() % cfg->dirs;
+        int k = rand() % cfg->fanout;
+        int off = (rand() % blocks) * MFS_BLOCK_SIZE;
+        int n = cfg->file_size - off < MFS_BLOCK_SIZE ? cfg->file_size - off : MFS_BLOCK_SIZE;
+        char name[28];
+        MFS_Stat_t st;
+
+        if (op == OP_UNLINK && ntemp == 0)
+            op = OP_CREAT;
+        if (op == OP_CREAT && ntemp == MAX_FANOUT)
+            op = OP_UNLINK;
+
+        // with a target rate, latency is measured from the scheduled start so
+        // a slow server is not hidden by the generator backing off
+        uint64_t start;
+        if (interval) {
+            sleep_until(scheduled);
+            start = scheduled;
+            scheduled += interval;
+        } else {
+            start = now_ns();
+        }
+
+        int rc = 0;
+        switch (op) {
+        case OP_LOOKUP:
+            snprintf(name, sizeof(name), "f%d", k);
+            rc = MFS_Lookup(dir_inum[j], name);
+            break;
+        case OP_STAT:
+            rc = MFS_Stat(file_inum[j][k], &st);
+            break;
+        case OP_READ:
+            rc = MFS_Read(file_inum[j][k], block, off, n);
+            break;
+        case OP_WRITE:
+            rc = MFS_Write(file_inum[j][k], block, off, n);
+            break;
+        case OP_CREAT:
+            snprintf(name, sizeof(name), "t%d", next_temp);
+            rc = MFS_Creat(dir_inum[j], MFS_REGULAR_FILE, name);
+            if (rc >= 0) {
+                temp_dir[ntemp] = dir_inum[j];
+                temp_id[ntemp++] = next_temp++;
+            }
+            break;
+        case OP_UNLINK:
+            ntemp--;
+            snprintf(name, sizeof(name), "t%d", temp_id[ntemp]);
+            rc = MFS_Unlink(temp_dir[ntemp], name);
+            break;
+        }
+        samples[i].op = op;
+        samples[i].rc = rc;
+        samples[i].ns = now_ns() - start;
+    }
+    exit(0);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, int n, double p) {
+    if (n == 0)
+        return 0;
+    int idx = (int)(p * n);
+    if (idx >= n)
+        idx = n - 1;
+    return sorted[idx] / 1000.0;
+}
+
+static void report(FILE *out, bench_cfg_t *cfg, sample_t *samples, double secs) {
+    int nsamples = cfg->clients * cfg->ops;
+    uint64_t *lat = malloc(sizeof(uint64_t) * (nsamples > 0 ? nsamples : 1));
+    int errors_total = 0;
+    for (int i = 0; i < nsamples; i++)
+        errors_total += samples[i].rc < 0;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"host\": \"%s\",\n  \"port\": %d,\n", cfg->host, cfg->port);
+    fprintf(out, "  \"clients\": %d,\n  \"ops_per_client\": %d,\n", cfg->clients, cfg->ops);
+    fprintf(out, "  \"file_size\": %d,\n  \"dirs\": %d,\n  \"files_per_dir\": %d,\n", cfg->file_size, cfg->dirs, cfg->fanout);
+    fprintf(out, "  \"target_rate_per_client\": %.1f,\n", cfg->rate);
+    fprintf(out, "  \"duration_s\": %.6f,\n", secs);
+    fprintf(out, "  \"throughput_ops\": %.1f,\n", secs > 0 ? nsamples / secs : 0);
+    fprintf(out, "  \"errors\": %d,\n", errors_total);
+    fprintf(out, "  \"ops\": {");
+    int first = 1;
+    for (int op = 0; op < NUM_OPS; op++) {
+        int n = 0, errors = 0;
+        double sum = 0;
+        for (int i = 0; i < nsamples; i++) {
+            if (samples[i].op != op)
+                continue;
+            lat[n++] = samples[i].ns;
+            sum += samples[i].ns;
+            errors += samples[i].rc < 0;
+        }
+        if (n == 0)
+            continue;
+        qsort(lat, n, sizeof(uint64_t), cmp_u64);
+        fprintf(out, "%s\n    \"%s\": {\"count\": %d, \"errors\": %d, \"ops_per_sec\": %.1f, "
+                     "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+                first ? "" : ",", op_names[op], n, errors, secs > 0 ? n / secs : 0, sum / n / 1000.0,
+                percentile_us(lat, n, 0.50), percentile_us(lat, n, 0.99), percentile_us(lat, n, 0.999),
+                lat[n - 1] / 1000.0);
+        first = 0;
+    }
+    fprintf(out, "\n  }\n}\n");
+    free(lat);
+}
+
+int main(int argc, char *argv[]) {
+    char default_mix[] = "lookup=30,stat=20,read=25,write=20,creat=3,unlink=2";
+    bench_cfg_t cfg = {
+        .host = "localhost", .port = 3000, .clients = 1, .ops = 1000,
+        .file_size = 4 * MFS_BLOCK_SIZE, .dirs = 2, .fanout = 4, .rate = 0, .out_file = NULL};
+    char *mix = default_mix;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "h:p:c:n:m:s:d:f:r:o:")) != -1) {
+        switch (ch) {
+        case 'h': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'n': cfg.ops = atoi(optarg); break;
+        case 'm': mix = optarg; break;
+        case 's': cfg.file_size = atoi(optarg); break;
+        case 'd': cfg.dirs = atoi(optarg); break;
+        case 'f': cfg.fanout = atoi(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'o': cfg.out_file = optarg; break;
+        default: usage();
+        }
+    }
+    if (parse_mix(mix, cfg.mix) != 0)
+        usage();
+    int total = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+        total += cfg.mix[op];
+    if (total == 0 || cfg.clients < 1 || cfg.ops < 1 || cfg.dirs < 1 || cfg.dirs > MAX_DIRS ||
+        cfg.fanout < 1 || cfg.fanout > MAX_FANOUT || cfg.file_size < 1 || cfg.file_size > MAX_FILE_SIZE)
+        usage();
+
+    size_t samples_len = sizeof(sample_t) * cfg.clients * cfg.ops;
+    sample_t *samples = mmap(NULL, samples_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (samples == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    int ready[2], go[2];
+    if (pipe(ready) != 0 || pipe(go) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t *pids = calloc(cfg.clients, sizeof(pid_t));
+    for (int i = 0; i < cfg.clients; i++) {
+        fflush(NULL);
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pids[i] == 0) {
+            close(ready[0]);
+            close(go[1]);
+            run_client(&cfg, i, samples + (size_t)i * cfg.ops, ready[1], go[0]);
+        }
+    }
+    close(ready[1]);
+    close(go[0]);
+
+    int ready_count = 0;
+    char ok;
+    while (ready_count < cfg.clients && read(ready[0], &ok, 1) == 1 && ok)
+        ready_count++;
+    if (ready_count < cfg.clients) {
+        for (int i = 0; i < cfg.clients; i++)
+            kill(pids[i], SIGKILL);
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    close(go[1]);
+    int failed = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        int status;
+        waitpid(pids[i], &status, 0);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    FILE *out = stdout;
+    if (cfg.out_file != NULL && (out = fopen(cfg.out_file, "w")) == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    report(out, &cfg, samples, secs);
+    if (out != stdout)
+        fclose(out);
+    return failed;
+}
@@ -0,0 +1,566 @@
+//
+// offline consistency checker for images made by mkfs and served by fsserv.
+//
+// the image is mmap'd and checked in parallel phases:
+//   0. on images made with mkfs -c, verify every block against its checksum
+//   1. walk the directory tree from the root, one level at a time, with the
+//      directories of a level split across threads
+//   2. count references to every data block from the reachable inodes
+//   3. compare both bitmaps against what phases 1 and 2 found
+// with -r, problems are repaired in place, the checksums of the repaired blocks
+// are brought up to date and the image is msync'd at the end. a block that
+// fails its checksum is reported but never repaired: its contents are lost.
+// the exception is an image fsserv did not shut down cleanly, whose table may
+// lag the blocks written just before the crash: -r recomputes the entries of
+// the blocks that fail, as fsserv does on its next writable open.
+//
+// on-disk conventions, as fsserv writes them: inodes and data blocks are
+// allocated in their bitmaps most significant bit first; directories store
+// absolute block numbers in direct[], regular files store data block indexes
+// relative to data_region_addr, or on images made with mkfs -z a packed block
+// (see UFS_PACKED); (unsigned)-1 marks an unused pointer and an entry inum of
+// -1 an unused directory entry. on images made with mkfs -D regular files may
+// share data blocks with each other, but not with directories.
+//
+// exit status: 0 clean, 1 problems found and all repaired, 4 problems left,
+// 8 the image could not be checked.
+//
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ufs.h"
+#include "mfs_crc.h"
+
+#define ENTRIES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+#define MAX_THREADS (256)
+
+// kinds of problems, counted separately
+enum {
+    P_DANGLING,     // directory entry names an invalid or unallocated inode
+    P_DUP_LINK,     // a second directory entry for an already linked inode
+    P_BAD_PTR,      // direct[] points outside the data region, or at a broken packed block
+    P_DUP_BLOCK,    // data block (or sectors of one) referenced more than once
+    P_INODE_LEAK,   // inode allocated but unreachable
+    P_INODE_MISSING,// reachable inode not marked allocated
+    P_BLOCK_LEAK,   // data block allocated but unreferenced
+    P_BLOCK_MISSING,// referenced data block not marked allocated
+    P_CHECKSUM,     // block contents do not match its checksum
+    P_STALE,        // the same, on an image that was not shut down cleanly
+    P_KINDS
+};
+
+static const char *problem_names[P_KINDS] = {
+    "dangling entries", "duplicate links", "bad block pointers",
+    "doubly allocated blocks", "leaked inodes", "unallocated reachable inodes",
+    "leaked blocks", "unallocated referenced blocks", "checksum mismatches",
+    "checksums stale after a crash",
+};
+
+// per image block, see block_state
+#define B_CORRUPT (0x1)
+#define B_TOUCHED (0x2)
+
+typedef struct {
+    char *image;
+    size_t image_size;
+    super_t *s;
+    unsigned int *inode_bitmap;
+    unsigned int *data_bitmap;
+    inode_t *inode_table;
+    int repair;
+    int verbose;
+    int nthreads;
+
+    uint8_t *reached;       // per inode: 1 once a directory entry (or the root) links it
+    uint32_t *block_refs;   // per data block: references from reachable inodes
+    int *level;             // directories of the level being walked
+    int level_len;
+    int *next;              // directories found for the next level
+    int next_len;
+    uint32_t *checksums;    // the checksum table, NULL on images without one
+    long num_blocks;
+    uint8_t *block_state;   // per image block: B_CORRUPT, B_TOUCHED by a repair
+
+    unsigned long problems[P_KINDS];
+    unsigned long repaired[P_KINDS];
+    pthread_mutex_t report_lock;
+} fsck_t;
+
+typedef struct {
+    fsck_t *f;
+    int id;
+} worker_t;
+
+static void usage() {
+    fprintf(stderr, "usage: mfsck [-r] [-v] [-j threads] <image_file>\n"
+                    "  -r  repair problems in place\n"
+                    "  -v  print every problem, not just the totals\n"
+                    "  -j  worker threads (default: one per online cpu)\n");
+    exit(8);
+}
+
+static unsigned int get_bit(unsigned int *bitmap, long position) {
+    return (bitmap[position / 32] >> (31 - position % 32)) & 0x1;
+}
+
+static void put_bit(unsigned int *bitmap, long position, int value) {
+    unsigned int mask = 0x1u << (31 - position % 32);
+    if (value)
+        bitmap[position / 32] |= mask;
+    else
+        bitmap[position / 32] &= ~mask;
+}
+
+// count a problem, say what it is with -v (fmt takes up to two longs, a and
+// b), and note whether it gets repaired
+static void problem(fsck_t *f, int kind, const char *fmt, long a, long b) {
+    pthread_mutex_lock(&f->report_lock);
+    f->problems[kind]++;
+    int repaired = f->repair && kind != P_CHECKSUM;
+    if (repaired)
+        f->repaired[kind]++;
+    if (f->verbose) {
+        printf("%s: ", problem_names[kind]);
+        printf(fmt, a, b);
+        printf("%s\n", repaired ? " (repaired)" : "");
+    }
+    pthread_mutex_unlock(&f->report_lock);
+}
+
+// note that a repair is about to modify the block holding addr
+static void touch(fsck_t *f, void *addr) {
+    if (f->block_state != NULL)
+        __atomic_or_fetch(&f->block_state[((char *) addr - f->image) / UFS_BLOCK_SIZE], B_TOUCHED, __ATOMIC_RELAXED);
+}
+
+// split n items evenly over the workers
+static void my_range(fsck_t *f, int id, long n, long *lo, long *hi) {
+    long per = (n + f->nthreads - 1) / f->nthreads;
+    *lo = id * per < n ? id * per : n;
+    *hi = *lo + per < n ? *lo + per : n;
+}
+
+static int valid_block(fsck_t *f, unsigned int blk) {
+    return blk < (unsigned int) f->s->num_data;
+}
+
+// data block index a direct[] entry refers to, as the server interprets it
+static unsigned int block_index(fsck_t *f, inode_t *inode, unsigned int ptr) {
+    if (inode->type == UFS_DIRECTORY)
+        return ptr - f->s->data_region_addr;
+    return ptr & UFS_PACKED ? UFS_PACKED_BLOCK(ptr) : ptr;
+}
+
+// the sectors of its data block a direct[] entry uses: all of them, unless
+// it is packed; 0 for a packed block whose length runs past its data block
+static uint16_t block_mask(fsck_t *f, inode_t *inode, unsigned int ptr) {
+    if (inode->type == UFS_DIRECTORY || !(ptr & UFS_PACKED))
+        return 0xffff;
+    uint16_t clen;
+    memcpy(&clen, f->image + ((size_t) f->s->data_region_addr + UFS_PACKED_BLOCK(ptr)) * UFS_BLOCK_SIZE +
+           UFS_PACKED_SECTOR(ptr) * UFS_SECTOR_SIZE, sizeof(clen));
+    int nsec = UFS_PACKED_SECTORS(clen);
+    if (nsec > UFS_SECTORS - (int) UFS_PACKED_SECTOR(ptr))
+        return 0;
+    return ((1u << nsec) - 1) << UFS_PACKED_SECTOR(ptr);
+}
+
+static dir_ent_t *dir_block(fsck_t *f, unsigned int blk) {
+    return (dir_ent_t *) (f->image + ((size_t) f->s->data_region_addr + blk) * UFS_BLOCK_SIZE);
+}
+
+//
+// phase 1: one level of the directory walk. every directory of the level is
+// owned by one thread, so its entries can be repaired without locking; a
+// child is claimed with a compare-and-swap so only one entry links it.
+//
+static void walk_level(fsck_t *f, int id) {
+    long lo, hi;
+    my_range(f, id, f->level_len, &lo, &hi);
+    for (long d = lo; d < hi; d++) {
+        int dir = f->level[d];
+        inode_t *inode = &f->inode_table[dir];
+        long seen = 0;
+        for (int i = 0; i < DIRECT_PTRS && seen < inode->size; i++) {
+            if (inode->direct[i] == (unsigned int) -1)
+                continue;
+            unsigned int blk = block_index(f, inode, inode->direct[i]);
+            if (!valid_block(f, blk))
+                continue; // reported in phase 2
+            dir_ent_t *e = dir_block(f, blk);
+            for (int j = 0; j < (int) ENTRIES_PER_BLOCK && seen < inode->size; j++, seen += sizeof(dir_ent_t)) {
+                int child = e[j].inum;
+                if (child == -1 || strcmp(e[j].name, ".") == 0 || strcmp(e[j].name, "..") == 0)
+                    continue;
+                if (child < 0 || child >= f->s->num_inodes || !get_bit(f->inode_bitmap, child) ||
+                    (f->inode_table[child].type != UFS_DIRECTORY && f->inode_table[child].type != UFS_REGULAR_FILE)) {
+                    problem(f, P_DANGLING, "directory %ld names inode %ld", dir, child);
+                    if (f->repair) {
+                        touch(f, &e[j]);
+                        e[j].inum = -1;
+                    }
+                    continue;
+                }
+                uint8_t unseen = 0;
+                if (!__atomic_compare_exchange_n(&f->reached[child], &unseen, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    problem(f, P_DUP_LINK, "directory %ld links inode %ld again", dir, child);
+                    if (f->repair) {
+                        touch(f, &e[j]);
+                        e[j].inum = -1;
+                    }
+                    continue;
+                }
+                if (f->inode_table[child].type == UFS_DIRECTORY) {
+                    int slot = __atomic_fetch_add(&f->next_len, 1, __ATOMIC_RELAXED);
+                    f->next[slot] = child;
+                }
+            }
+        }
+    }
+}
+
+//
+// phase 2: count references to every data block. a bad pointer is dropped on
+// repair; of several references to one block, the lowest inode keeps it.
+//
+static void count_blocks(fsck_t *f, int id) {
+    long lo, hi;
+    my_range(f, id, f->s->num_inodes, &lo, &hi);
+    for (long inum = lo; inum < hi; inum++) {
+        if (!f->reached[inum])
+            continue;
+        inode_t *inode = &f->inode_table[inum];
+        for (int i = 0; i < DIRECT_PTRS; i++) {
+            if (inode->direct[i] == (unsigned int) -1)
+                continue;
+            unsigned int blk = block_index(f, inode, inode->direct[i]);
+            if (!valid_block(f, blk) || block_mask(f, inode, inode->direct[i]) == 0) {
+                problem(f, P_BAD_PTR, "inode %ld points at block %ld", inum, (long) inode->direct[i]);
+                if (f->repair) {
+                    touch(f, &inode->direct[i]);
+                    inode->direct[i] = -1;
+                }
+                continue;
+            }
+            __atomic_fetch_add(&f->block_refs[blk], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+#define KEPT_SHARED (0x10000) // in kept[]: referenced by a regular file of a deduplicated image
+
+// run after count_blocks: releases the extra references, lowest inode first.
+// packed blocks share a data block legitimately as long as their sectors do
+// not overlap, and so do regular files on deduplicated images.
+static void drop_duplicates(fsck_t *f) {
+    uint32_t *kept = calloc(f->s->num_data, sizeof(uint32_t));
+    assert(kept != NULL);
+    for (long inum = 0; inum < f->s->num_inodes; inum++) {
+        if (!f->reached[inum])
+            continue;
+        inode_t *inode = &f->inode_table[inum];
+        for (int i = 0; i < DIRECT_PTRS; i++) {
+            if (inode->direct[i] == (unsigned int) -1)
+                continue;
+            unsigned int blk = block_index(f, inode, inode->direct[i]);
+            if (!valid_block(f, blk) || f->block_refs[blk] < 2)
+                continue;
+            uint16_t mask = block_mask(f, inode, inode->direct[i]);
+            if (mask == 0)
+                continue;
+            if (f->s->dedup && inode->type == UFS_REGULAR_FILE) {
+                if ((kept[blk] & ~KEPT_SHARED) == 0) {
+                    kept[blk] |= KEPT_SHARED;
+                    continue;
+                }
+            } else if ((kept[blk] & (mask | KEPT_SHARED)) == 0) {
+                kept[blk] |= mask;
+                continue;
+            }
+            problem(f, P_DUP_BLOCK, "inode %ld shares data block %ld", inum, blk);
+            if (f->repair) {
+                touch(f, &inode->direct[i]);
+                inode->direct[i] = -1;
+            }
+        }
+    }
+    free(kept);
+}
+
+//
+// phase 3: bitmaps against the walk. threads own whole 32-bit words, so
+// repairs never touch a word another thread is looking at.
+//
+static void check_bitmaps(fsck_t *f, int id) {
+    long lo, hi;
+    my_range(f, id, (f->s->num_inodes + 31) / 32, &lo, &hi);
+    for (long bit = lo * 32; bit < hi * 32 && bit < f->s->num_inodes; bit++) {
+        int used = get_bit(f->inode_bitmap, bit);
+        if (used && !f->reached[bit]) {
+            problem(f, P_INODE_LEAK, "inode %ld", bit, 0);
+            if (f->repair) {
+                touch(f, &f->inode_bitmap[bit / 32]);
+                put_bit(f->inode_bitmap, bit, 0);
+            }
+        } else if (!used && f->reached[bit]) {
+            problem(f, P_INODE_MISSING, "inode %ld", bit, 0);
+            if (f->repair) {
+                touch(f, &f->inode_bitmap[bit / 32]);
+                put_bit(f->inode_bitmap, bit, 1);
+            }
+        }
+    }
+
+    my_range(f, id, (f->s->num_data + 31) / 32, &lo, &hi);
+    for (long bit = lo * 32; bit < hi * 32 && bit < f->s->num_data; bit++) {
+        int used = get_bit(f->data_bitmap, bit);
+        if (used && f->block_refs[bit] == 0) {
+            problem(f, P_BLOCK_LEAK, "data block %ld", bit, 0);
+            if (f->repair) {
+                touch(f, &f->data_bitmap[bit / 32]);
+                put_bit(f->data_bitmap, bit, 0);
+            }
+        } else if (!used && f->block_refs[bit] > 0) {
+            problem(f, P_BLOCK_MISSING, "data block %ld", bit, 0);
+            if (f->repair) {
+                touch(f, &f->data_bitmap[bit / 32]);
+                put_bit(f->data_bitmap, bit, 1);
+            }
+        }
+    }
+}
+
+//
+// phase 0: every block against the checksum table, except the table itself,
+// which mkfs -c and fsserv do not checksum
+//
+static void verify_checksums(fsck_t *f, int id) {
+    long lo, hi;
+    my_range(f, id, f->num_blocks, &lo, &hi);
+    for (long blk = lo; blk < hi; blk++) {
+        if (blk >= f->s->checksum_addr && blk < f->s->checksum_addr + f->s->checksum_len)
+            continue;
+        if (CRC_Block(f->image + blk * UFS_BLOCK_SIZE) == f->checksums[blk])
+            continue;
+        if (f->s->checksum_stale) {
+            problem(f, P_STALE, "block %ld", blk, 0);
+            f->block_state[blk] |= B_TOUCHED;
+        } else {
+            problem(f, P_CHECKSUM, "block %ld", blk, 0);
+            f->block_state[blk] |= B_CORRUPT;
+        }
+    }
+}
+
+// after the repairs: new checksums for the blocks they modified, except for
+// blocks that were corrupt before, which must keep failing
+static void update_checksums(fsck_t *f, int id) {
+    long lo, hi;
+    my_range(f, id, f->num_blocks, &lo, &hi);
+    for (long blk = lo; blk < hi; blk++) {
+        if (f->block_state[blk] == B_TOUCHED)
+            f->checksums[blk] = CRC_Block(f->image + blk * UFS_BLOCK_SIZE);
+    }
+}
+
+// clear the unclean-shutdown flag of a repaired image, in the order fsserv
+// does: the entry of the super block is durable before the flag is cleared
+static int mark_clean(fsck_t *f) {
+    char block[UFS_BLOCK_SIZE];
+    memcpy(block, f->image, UFS_BLOCK_SIZE);
+    ((super_t *) block)->checksum_stale = 0;
+    f->checksums[0] = CRC_Block(block);
+    if (msync(f->checksums, UFS_BLOCK_SIZE, MS_SYNC) != 0)
+        return -1;
+    f->s->checksum_stale = 0;
+    return msync(f->image, UFS_BLOCK_SIZE, MS_SYNC);
+}
+
+// each phase is a parallel pass; the main thread joins between them
+typedef void (*phase_fn)(fsck_t *, int);
+
+static phase_fn current_phase;
+
+static void *run_worker(void *arg) {
+    worker_t *w = arg;
+    current_phase(w->f, w->id);
+    return NULL;
+}
+
+static void parallel(fsck_t *f, phase_fn fn) {
+    pthread_t tids[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+    current_phase = fn;
+    for (int i = 0; i < f->nthreads; i++) {
+        workers[i] = (worker_t) { .f = f, .id = i };
+        if (pthread_create(&tids[i], NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(8);
+        }
+    }
+    for (int i = 0; i < f->nthreads; i++)
+        pthread_join(tids[i], NULL);
+}
+
+// the layout must fit inside the file before anything else is read
+static int check_super(fsck_t *f) {
+    super_t *s = f->s;
+    long long blocks = (long long) f->image_size / UFS_BLOCK_SIZE;
+    if (f->image_size < UFS_BLOCK_SIZE || s->num_inodes <= 0 || s->num_data <= 0 ||
+        s->inode_bitmap_addr < 1 || s->data_bitmap_addr < s->inode_bitmap_addr + s->inode_bitmap_len ||
+        s->inode_region_addr < s->data_bitmap_addr + s->data_bitmap_len ||
+        s->data_region_addr < s->inode_region_addr + s->inode_region_len ||
+        (long long) s->data_region_addr + s->num_data > blocks ||
+        (long long) s->inode_bitmap_len * UFS_BLOCK_SIZE * 8 < s->num_inodes ||
+        (long long) s->data_bitmap_len * UFS_BLOCK_SIZE * 8 < s->num_data ||
+        (long long) s->inode_region_len * UFS_BLOCK_SIZE < (long long) s->num_inodes * sizeof(inode_t)) {
+        return -1;
+    }
+    if (s->checksum_len != 0 &&
+        (s->checksum_len < 0 || s->checksum_addr < s->inode_region_addr + s->inode_region_len ||
+         s->data_region_addr < s->checksum_addr + s->checksum_len ||
+         (long long) s->checksum_len * CRC_PER_BLOCK < blocks)) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    fsck_t f;
+    memset(&f, 0, sizeof(f));
+    f.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_mutex_init(&f.report_lock, NULL);
+
+    int ch;
+    while ((ch = getopt(argc, argv, "rvj:")) != -1) {
+        switch (ch) {
+        case 'r':
+            f.repair = 1;
+            break;
+        case 'v':
+            f.verbose = 1;
+            break;
+        case 'j':
+            f.nthreads = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    if (f.nthreads < 1)
+        f.nthreads = 1;
+    if (f.nthreads > MAX_THREADS)
+        f.nthreads = MAX_THREADS;
+
+    int fd = open(argv[optind], f.repair ? O_RDWR : O_RDONLY);
+    struct stat sbuf;
+    if (fd < 0 || fstat(fd, &sbuf) < 0) {
+        perror("open");
+        exit(8);
+    }
+    f.image_size = sbuf.st_size;
+    f.image = mmap(NULL, f.image_size, PROT_READ | (f.repair ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (f.image == MAP_FAILED) {
+        perror("mmap");
+        exit(8);
+    }
+    close(fd);
+    madvise(f.image, f.image_size, MADV_WILLNEED);
+
+    f.s = (super_t *) f.image;
+    if (f.image_size < sizeof(super_t) || check_super(&f) != 0) {
+        fprintf(stderr, "mfsck: %s: superblock does not describe this image, not checking further\n", argv[optind]);
+        exit(4);
+    }
+    f.inode_bitmap = (unsigned int *) (f.image + (size_t) f.s->inode_bitmap_addr * UFS_BLOCK_SIZE);
+    f.data_bitmap = (unsigned int *) (f.image + (size_t) f.s->data_bitmap_addr * UFS_BLOCK_SIZE);
+    f.inode_table = (inode_t *) (f.image + (size_t) f.s->inode_region_addr * UFS_BLOCK_SIZE);
+    f.num_blocks = f.image_size / UFS_BLOCK_SIZE;
+    if (f.s->checksum_len > 0) {
+        f.checksums = (uint32_t *) (f.image + (size_t) f.s->checksum_addr * UFS_BLOCK_SIZE);
+        f.block_state = calloc(f.num_blocks, 1);
+        if (f.block_state == NULL) {
+            perror("malloc");
+            exit(8);
+        }
+    }
+
+    f.reached = calloc(f.s->num_inodes, 1);
+    f.block_refs = calloc(f.s->num_data, sizeof(uint32_t));
+    f.level = malloc(f.s->num_inodes * sizeof(int));
+    f.next = malloc(f.s->num_inodes * sizeof(int));
+    if (f.reached == NULL || f.block_refs == NULL || f.level == NULL || f.next == NULL) {
+        perror("malloc");
+        exit(8);
+    }
+
+    if (f.inode_table[0].type != UFS_DIRECTORY || !get_bit(f.inode_bitmap, 0)) {
+        // without a root nothing is reachable; the bitmaps would all be wiped
+        fprintf(stderr, "mfsck: %s: inode 0 is not an allocated directory, not checking further\n", argv[optind]);
+        exit(4);
+    }
+
+    // phase 0
+    if (f.checksums != NULL)
+        parallel(&f, verify_checksums);
+
+    // phase 1: level by level from the root
+    f.reached[0] = 1;
+    f.level[0] = 0;
+    f.level_len = 1;
+    while (f.level_len > 0) {
+        f.next_len = 0;
+        parallel(&f, walk_level);
+        int *t = f.level;
+        f.level = f.next;
+        f.next = t;
+        f.level_len = f.next_len;
+    }
+
+    // phase 2
+    parallel(&f, count_blocks);
+    drop_duplicates(&f);
+    // keep only the surviving references for the bitmap comparison
+    if (f.repair) {
+        memset(f.block_refs, 0, f.s->num_data * sizeof(uint32_t));
+        parallel(&f, count_blocks);
+    }
+
+    // phase 3
+    parallel(&f, check_bitmaps);
+
+    if (f.repair && f.checksums != NULL)
+        parallel(&f, update_checksums);
+    if (f.repair && msync(f.image, f.image_size, MS_SYNC) != 0) {
+        perror("msync");
+        exit(8);
+    }
+    if (f.repair && f.checksums != NULL && f.s->checksum_stale && mark_clean(&f) != 0) {
+        perror("msync");
+        exit(8);
+    }
+
+    unsigned long total = 0, fixed = 0, reached = 0;
+    for (int k = 0; k < P_KINDS; k++) {
+        total += f.problems[k];
+        fixed += f.repaired[k];
+        if (f.problems[k] > 0)
+            printf("%-32s %lu%s\n", problem_names[k], f.problems[k], f.repaired[k] > 0 ? " (repaired)" : "");
+    }
+    for (long i = 0; i < f.s->num_inodes; i++)
+        reached += f.reached[i];
+    printf("%s: %lu reachable inodes of %d, %d data blocks, %d threads: %s\n", argv[optind], reached,
+           f.s->num_inodes, f.s->num_data, f.nthreads, total == 0 ? "clean" : (fixed == total ? "repaired" : "inconsistent"));
+    return total == 0 ? 0 : (fixed == total ? 1 : 4);
+}
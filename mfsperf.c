@@ -0,0 +1,322 @@
+// in-process microbenchmarks for the server primitives in fsserv.c.
+// no sockets: every primitive is called directly against an mmap'd image
+// produced by mkfs, so the numbers are free of network noise.
+#define FSSERV_NO_MAIN
+#include "fsserv.c"
+
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_SIZES (16)
+#define MAX_DIR_ENTRIES ((int)(BLOCK_SIZE / sizeof(dir_ent_t)) - 2) // a directory is one block, "." and ".." included
+
+static FILE *perf_out;
+
+typedef struct {
+    char *mkfs;
+    char *image_file;
+    int iters;
+    int num_sizes;
+    int num_inodes[MAX_SIZES];
+    int num_data[MAX_SIZES];
+    int num_dir_sizes;
+    int dir_sizes[MAX_SIZES];
+    int num_fills;
+    int fills[MAX_SIZES];
+} perf_cfg_t;
+
+typedef struct {
+    void *image;
+    size_t image_size;
+    super_t *superBlock;
+    char *inode_bitmap;
+    char *data_bitmap;
+    inode_t *inode_table;
+    char *data_region;
+} perf_image_t;
+
+void usage()
+{
+    fprintf(stderr, "usage: mfsperf [-k mkfs] [-f image_file] [-n iters] [-s inodes:data,...] [-e dir_sizes] [-l fill_pcts]\n"
+                    "  defaults: -k ./mkfs -f /tmp/mfsperf.img -n 2000 -s 256:1024,4096:16384 -e 8,32,100 -l 0,50,90,99\n"
+                    "  dir_sizes are entries per directory, 1 to %d\n", MAX_DIR_ENTRIES);
+    exit(1);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *primitive, const char *params, int ops, int errors, uint64_t ns)
+{
+    fprintf(perf_out, "%-24s %-36s %10d ops %6d err %12.1f ns/op\n", primitive, params, ops, errors, ops ? (double)ns / ops : 0);
+}
+
+static int parse_list(char *spec, int *list)
+{
+    int n = 0;
+    for (char *tok = strtok(spec, ","); tok != NULL && n < MAX_SIZES; tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    return n;
+}
+
+static int build_image(perf_cfg_t *cfg, int num_inodes, int num_data, perf_image_t *img)
+{
+    char inodes[16], data[16];
+    snprintf(inodes, sizeof(inodes), "%d", num_inodes);
+    snprintf(data, sizeof(data), "%d", num_data);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            exit(1);
+        execl(cfg->mkfs, cfg->mkfs, "-f", cfg->image_file, "-i", inodes, "-d", data, (char *)NULL);
+        perror("exec mkfs");
+        exit(1);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    int fd = open(cfg->image_file, O_RDWR);
+    struct stat sbuf;
+    if (fd < 0 || fstat(fd, &sbuf) < 0)
+        return -1;
+    img->image_size = sbuf.st_size;
+    img->image = mmap(NULL, img->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (img->image == MAP_FAILED)
+        return -1;
+    img->superBlock = (super_t *)img->image;
+    img->inode_bitmap = BLOCK_ADDR(img->image, img->superBlock->inode_bitmap_addr);
+    img->data_bitmap = BLOCK_ADDR(img->image, img->superBlock->data_bitmap_addr);
+    img->inode_table = (inode_t *)BLOCK_ADDR(img->image, img->superBlock->inode_region_addr);
+    img->data_region = BLOCK_ADDR(img->image, img->superBlock->data_region_addr);
+    return 0;
+}
+
+static int perf_lookup_inum(perf_image_t *img, int pinum, char *name)
+{
+    int inum;
+    if (lookup(pinum, name, img->inode_table, img->data_region, &inum, img->superBlock->data_region_addr) == 0)
+        return -1;
+    return inum;
+}
+
+static int perf_create(perf_image_t *img, int pinum, int type, char *name)
+{
+    char charParam[48] = {0}; // same buffer the request would carry
+    strncpy(charParam, name, sizeof(charParam) - 1);
+    return MFS_create(pinum, type, charParam, img->inode_table, img->data_region, img->data_bitmap, img->inode_bitmap, img->superBlock);
+}
+
+// lookup of present and absent names in directories of increasing size
+static void bench_lookup(perf_cfg_t *cfg, perf_image_t *img)
+{
+    char name[28], params[64];
+    for (int d = 0; d < cfg->num_dir_sizes; d++)
+    {
+        int entries = cfg->dir_sizes[d];
+        snprintf(name, sizeof(name), "lk%d", entries);
+        int dir;
+        if (perf_create(img, 0, UFS_DIRECTORY, name) < 0 || (dir = perf_lookup_inum(img, 0, name)) < 0)
+        {
+            fprintf(stderr, "mfsperf: cannot create directory %s\n", name);
+            continue;
+        }
+        int made = 0;
+        for (int i = 0; i < entries; i++)
+        {
+            snprintf(name, sizeof(name), "f%d", i);
+            made += perf_create(img, dir, UFS_REGULAR_FILE, name) == 0;
+        }
+
+        int errors = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < cfg->iters; i++)
+        {
+            snprintf(name, sizeof(name), "f%d", rand() % entries);
+            errors += perf_lookup_inum(img, dir, name) < 0;
+        }
+        uint64_t hit_ns = now_ns() - start;
+        snprintf(params, sizeof(params), "entries=%d hit", made);
+        report("lookup", params, cfg->iters, errors, hit_ns);
+
+        errors = 0;
+        start = now_ns();
+        for (int i = 0; i < cfg->iters; i++)
+            errors += perf_lookup_inum(img, dir, "absent") >= 0;
+        snprintf(params, sizeof(params), "entries=%d miss", made);
+        report("lookup", params, cfg->iters, errors, now_ns() - start);
+    }
+}
+
+// allocation from a private copy of the data bitmap at several fill levels
+static void bench_bitmap(perf_cfg_t *cfg, perf_image_t *img)
+{
+    int bits = img->superBlock->num_data;
+    int words = (bits + 31) / 32;
+    unsigned int *bitmap = malloc(words * sizeof(unsigned int));
+    char params[64];
+    for (int f = 0; f < cfg->num_fills; f++)
+    {
+        int filled = (int)((long)bits * cfg->fills[f] / 100);
+        memset(bitmap, 0, words * sizeof(unsigned int));
+        for (int i = 0; i < filled; i++)
+            set_bit(bitmap, i);
+
+        int errors = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < cfg->iters; i++)
+        {
+            int slot;
+            if (find_empty_set_bitmap(bitmap, bits, &slot) == 0)
+            {
+                errors++;
+                continue;
+            }
+            bitmap[slot / 32] &= ~(0x1u << (31 - slot % 32)); // hand the slot back
+        }
+        snprintf(params, sizeof(params), "bits=%d fill=%d%%", bits, cfg->fills[f]);
+        report("find_empty_set_bitmap", params, cfg->iters, errors, now_ns() - start);
+    }
+    free(bitmap);
+}
+
+// reads and writes of a full-size file at sequential, random and sub-block offsets
+static void bench_read_write(perf_cfg_t *cfg, perf_image_t *img)
+{
+    char buffer[BLOCK_SIZE];
+    memset(buffer, 'x', sizeof(buffer));
+    int inum;
+    if (perf_create(img, 0, UFS_REGULAR_FILE, "rw") < 0 || (inum = perf_lookup_inum(img, 0, "rw")) < 0)
+    {
+        fprintf(stderr, "mfsperf: cannot create rw file\n");
+        return;
+    }
+    for (int b = 0; b < DIRECT_PTRS; b++)
+        MFS_write(BLOCK_SIZE, b * BLOCK_SIZE, inum, img->inode_table, img->data_bitmap, img->inode_bitmap, buffer, img->superBlock, img->image);
+
+    const char *patterns[] = {"seq 4096", "random 4096", "random 128 in-block"};
+    for (int p = 0; p < 3; p++)
+    {
+        int errors = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < cfg->iters; i++)
+        {
+            int block = p == 0 ? i % DIRECT_PTRS : rand() % DIRECT_PTRS;
+            int nbytes = p == 2 ? 128 : BLOCK_SIZE;
+            int offset = block * BLOCK_SIZE + (p == 2 ? (rand() % (BLOCK_SIZE / 128 - 1)) * 128 : 0);
+            errors += MFS_read(nbytes, offset, inum, img->inode_table, img->image, img->superBlock, buffer) < 0;
+        }
+        report("MFS_read", patterns[p], cfg->iters, errors, now_ns() - start);
+    }
+    for (int p = 0; p < 3; p++)
+    {
+        int errors = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < cfg->iters; i++)
+        {
+            int block = p == 0 ? i % DIRECT_PTRS : rand() % DIRECT_PTRS;
+            int nbytes = p == 2 ? 128 : BLOCK_SIZE;
+            int offset = block * BLOCK_SIZE + (p == 2 ? (rand() % (BLOCK_SIZE / 128 - 1)) * 128 : 0);
+            errors += MFS_write(nbytes, offset, inum, img->inode_table, img->data_bitmap, img->inode_bitmap, buffer, img->superBlock, img->image) < 0;
+        }
+        report("MFS_write", patterns[p], cfg->iters, errors, now_ns() - start);
+    }
+}
+
+// create then unlink a batch of files in a fresh directory
+static void bench_create_unlink(perf_cfg_t *cfg, perf_image_t *img)
+{
+    char name[28], params[64];
+    int dir;
+    if (perf_create(img, 0, UFS_DIRECTORY, "cu") < 0 || (dir = perf_lookup_inum(img, 0, "cu")) < 0)
+    {
+        fprintf(stderr, "mfsperf: cannot create cu directory\n");
+        return;
+    }
+    int batch = cfg->dir_sizes[cfg->num_dir_sizes - 1];
+    int errors = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < batch; i++)
+    {
+        snprintf(name, sizeof(name), "c%d", i);
+        errors += perf_create(img, dir, UFS_REGULAR_FILE, name) < 0;
+    }
+    snprintf(params, sizeof(params), "files=%d", batch);
+    report("MFS_create", params, batch, errors, now_ns() - start);
+
+    errors = 0;
+    start = now_ns();
+    for (int i = batch - 1; i >= 0; i--)
+    {
+        snprintf(name, sizeof(name), "c%d", i);
+        errors += MFS_unlink(dir, name, img->data_region, img->superBlock, img->inode_table, img->data_bitmap, img->inode_bitmap) < 0;
+    }
+    report("MFS_unlink", params, batch, errors, now_ns() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    perf_cfg_t cfg = {.mkfs = "./mkfs", .image_file = "/tmp/mfsperf.img", .iters = 2000};
+    char sizes[] = "256:1024,4096:16384", dir_sizes[] = "8,32,100", fills[] = "0,50,90,99";
+    char *sizes_spec = sizes, *dir_spec = dir_sizes, *fill_spec = fills;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "k:f:n:s:e:l:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'k': cfg.mkfs = optarg; break;
+        case 'f': cfg.image_file = optarg; break;
+        case 'n': cfg.iters = atoi(optarg); break;
+        case 's': sizes_spec = optarg; break;
+        case 'e': dir_spec = optarg; break;
+        case 'l': fill_spec = optarg; break;
+        default: usage();
+        }
+    }
+    for (char *tok = strtok(sizes_spec, ","); tok != NULL && cfg.num_sizes < MAX_SIZES; tok = strtok(NULL, ","))
+    {
+        if (sscanf(tok, "%d:%d", &cfg.num_inodes[cfg.num_sizes], &cfg.num_data[cfg.num_sizes]) != 2)
+            usage();
+        cfg.num_sizes++;
+    }
+    cfg.num_dir_sizes = parse_list(dir_spec, cfg.dir_sizes);
+    cfg.num_fills = parse_list(fill_spec, cfg.fills);
+    if (cfg.iters < 1 || cfg.num_sizes == 0 || cfg.num_dir_sizes == 0 || cfg.num_fills == 0)
+        usage();
+    for (int d = 0; d < cfg.num_dir_sizes; d++)
+        if (cfg.dir_sizes[d] < 1 || cfg.dir_sizes[d] > MAX_DIR_ENTRIES)
+            usage();
+
+    // the primitives log through stdout; keep the report on its own stream
+    int report_fd = dup(STDOUT_FILENO);
+    if (report_fd < 0 || freopen("/dev/null", "w", stdout) == NULL)
+        exit(1);
+    perf_out = fdopen(report_fd, "w");
+    srand(537);
+
+    for (int s = 0; s < cfg.num_sizes; s++)
+    {
+        perf_image_t img;
+        if (build_image(&cfg, cfg.num_inodes[s], cfg.num_data[s], &img) != 0)
+        {
+            fprintf(stderr, "mfsperf: failed to build image %d:%d\n", cfg.num_inodes[s], cfg.num_data[s]);
+            exit(1);
+        }
+        fprintf(perf_out, "# image inodes=%d data=%d size=%zu bytes\n", cfg.num_inodes[s], cfg.num_data[s], img.image_size);
+        bench_bitmap(&cfg, &img);
+        bench_lookup(&cfg, &img);
+        bench_read_write(&cfg, &img);
+        bench_create_unlink(&cfg, &img);
+        munmap(img.image, img.image_size);
+        fflush(perf_out);
+    }
+    unlink(cfg.image_file);
+    return 0;
+}
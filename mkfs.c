@@ -1,25 +1,45 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "ufs.h"
+#include "mfs_crc.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-c] [-D] [-p] [-v] [-z]\n");
+    fprintf(stderr, "  -c  keep a CRC32C checksum for every block, checked by the server on read\n");
+    fprintf(stderr, "  -D  let regular files share identical data blocks (deduplication)\n");
+    fprintf(stderr, "  -p  preallocate every block instead of leaving the image sparse\n");
+    fprintf(stderr, "  -z  store the blocks of regular files compressed, several to a data block\n");
     exit(1);
 }
 
+typedef struct {
+    int addr;
+    char data[UFS_BLOCK_SIZE];
+} meta_block_t;
+
+int meta_cmp(const void *a, const void *b) {
+    return ((const meta_block_t *) a)->addr - ((const meta_block_t *) b)->addr;
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
+    int preallocate = 0;
+    int checksums = 0;
+    int compress = 0;
+    int dedup = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:cDpvz")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -30,9 +50,21 @@ int main(int argc, char *argv[]) {
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 'c':
+	    checksums = 1;
+	    break;
+	case 'D':
+	    dedup = 1;
+	    break;
+	case 'p':
+	    preallocate = 1;
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'z':
+	    compress = 1;
+	    break;
 	default:
 	    usage();
 	}
@@ -43,13 +75,6 @@ int main(int argc, char *argv[]) {
     if (image_file == NULL)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
     int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
 	perror("open");
@@ -59,16 +84,39 @@ int main(int argc, char *argv[]) {
     assert(num_inodes >= 32);
     assert(num_data >= 32);
 
+    // super_t stores block numbers as int: the whole layout must stay addressable
+    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
+    long long max_blocks = 1 + (num_inodes + bits_per_block - 1LL) / bits_per_block +
+	(num_data + bits_per_block - 1LL) / bits_per_block +
+	((long long) num_inodes * sizeof(inode_t) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE + num_data;
+    if (checksums)
+	max_blocks += (max_blocks + CRC_PER_BLOCK) / CRC_PER_BLOCK;
+    if (max_blocks > INT_MAX) {
+	fprintf(stderr, "mkfs: %d inodes and %d data blocks need %lld blocks, more than %d\n",
+		num_inodes, num_data, max_blocks, INT_MAX);
+	exit(1);
+    }
+
+    if (compress && dedup) {
+	fprintf(stderr, "mkfs: -z and -D do not combine\n");
+	exit(1);
+    }
+    if (compress && num_data > UFS_MAX_PACKED_BLOCKS) {
+	fprintf(stderr, "mkfs: -z supports at most %d data blocks\n", UFS_MAX_PACKED_BLOCKS);
+	exit(1);
+    }
+
     // presumed: block 0 is the super block
     super_t s;
+    memset(&s, 0, sizeof(s));
 
     // totals
     s.num_inodes = num_inodes;
     s.num_data = num_data;
+    s.compress = compress;
+    s.dedup = dedup;
 
     // inode bitmap
-    int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
-
     s.inode_bitmap_addr = 1;
     s.inode_bitmap_len = num_inodes / bits_per_block;
     if (num_inodes % bits_per_block != 0)
@@ -82,23 +130,29 @@ int main(int argc, char *argv[]) {
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
+    long long total_inode_bytes = (long long) num_inodes * sizeof(inode_t);
     s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
     if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
 	s.inode_region_len++;
 
+    // checksum table: one entry per block of the image, itself included
+    s.checksum_addr = s.inode_region_addr + s.inode_region_len;
+    s.checksum_len = 0;
+    if (checksums) {
+	int others = s.checksum_addr + num_data;
+	int len;
+	do {
+	    len = s.checksum_len;
+	    s.checksum_len = (others + len + CRC_PER_BLOCK - 1) / CRC_PER_BLOCK;
+	} while (s.checksum_len != len);
+    }
+
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = s.checksum_addr + s.checksum_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
-
-    // super block is the first block
-    int rc = pwrite(fd, &s, sizeof(super_t), 0);
-    if (rc != sizeof(super_t)) {
-	perror("write");
-	exit(1);
-    }
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.checksum_len +
+	s.data_region_len;
 
     printf("total blocks        %d\n", total_blocks);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
@@ -106,17 +160,47 @@ int main(int argc, char *argv[]) {
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    if (s.checksum_len > 0)
+	printf("  checksum address/len     %d [%d]\n", s.checksum_addr, s.checksum_len);
 
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
-	    exit(1);
+    //
+    // the image starts out as a hole of the full size, which reads back as
+    // zeros; only blocks with contents are written below. -p allocates all
+    // of it up front instead, so later writes never hit a full disk.
+    //
+    off_t image_bytes = (off_t) total_blocks * UFS_BLOCK_SIZE;
+    if (ftruncate(fd, image_bytes) != 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+    if (preallocate && posix_fallocate(fd, 0, image_bytes) != 0) {
+	// no fallocate support here: write the zeros out in large chunks
+	size_t chunk = 1 << 20;
+	char *zeros = calloc(chunk, 1);
+	assert(zeros != NULL);
+	for (off_t off = 0; off < image_bytes; off += chunk) {
+	    size_t n = image_bytes - off < (off_t) chunk ? image_bytes - off : chunk;
+	    if (pwrite(fd, zeros, n, off) != (ssize_t) n) {
+		perror("write");
+		exit(1);
+	    }
 	}
+	free(zeros);
     }
 
+    //
+    // every block that is not all zeros, in address order. with the default
+    // sizes they are contiguous, so they go out as one write. room for the
+    // five blocks with contents plus a checksum table block for each.
+    //
+    meta_block_t *meta = calloc(10, sizeof(meta_block_t));
+    assert(meta != NULL);
+    int num_meta = 5;
+
+    // super block is the first block
+    meta[0].addr = 0;
+    memcpy(meta[0].data, &s, sizeof(super_t));
+
     //
     // need to allocate first inode in inode bitmap
     //
@@ -125,20 +209,16 @@ int main(int argc, char *argv[]) {
     } bitmap_t;
     assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
 
-    bitmap_t b;
-    for (i = 0; i < 1024; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1 << 31; // first entry is allocated
-    
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    bitmap_t *b = (bitmap_t *) meta[1].data;
+    b->bits[0] = 0x1 << 31; // first entry is allocated
+    meta[1].addr = s.inode_bitmap_addr;
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    memcpy(meta[2].data, b, UFS_BLOCK_SIZE);
+    meta[2].addr = s.data_bitmap_addr;
 
     //
     // need to write out inode
@@ -147,15 +227,14 @@ int main(int argc, char *argv[]) {
 	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
     } inode_block;
 
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    int i;
+    inode_block *itable = (inode_block *) meta[3].data;
+    itable->inodes[0].type = UFS_DIRECTORY;
+    itable->inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    itable->inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
-
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+	itable->inodes[0].direct[i] = -1;
+    meta[3].addr = s.inode_region_addr;
 
     // 
     // need to write out root directory contents to first data block
@@ -167,18 +246,54 @@ int main(int argc, char *argv[]) {
     // xxx assumes 4096 block, 32 byte entries
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
+    dir_block_t *parent = (dir_block_t *) meta[4].data;
+    strcpy(parent->entries[0].name, ".");
+    parent->entries[0].inum = 0;
 
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
+    strcpy(parent->entries[1].name, "..");
+    parent->entries[1].inum = 0;
 
     for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
+	parent->entries[i].inum = -1;
+    meta[4].addr = s.data_region_addr;
+
+    //
+    // checksum entries for the blocks above; every other block is still
+    // zero, which the table encodes as 0, so its entry can stay a hole
+    //
+    if (s.checksum_len > 0) {
+	for (i = 0; i < 5; i++) {
+	    int addr = s.checksum_addr + meta[i].addr / CRC_PER_BLOCK;
+	    int j;
+	    for (j = 5; j < num_meta && meta[j].addr != addr; j++)
+		;
+	    if (j == num_meta)
+		meta[num_meta++].addr = addr;
+	    uint32_t *table = (uint32_t *) meta[j].data;
+	    table[meta[i].addr % CRC_PER_BLOCK] = CRC_Block(meta[i].data);
+	}
+	qsort(meta, num_meta, sizeof(meta_block_t), meta_cmp);
+    }
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    //
+    // write runs of adjacent blocks with one pwritev each
+    //
+    for (i = 0; i < num_meta; ) {
+	struct iovec iov[10];
+	int n = 0;
+	do {
+	    iov[n].iov_base = meta[i + n].data;
+	    iov[n].iov_len = UFS_BLOCK_SIZE;
+	    n++;
+	} while (i + n < num_meta && meta[i + n].addr == meta[i].addr + n);
+	ssize_t rc = pwritev(fd, iov, n, (off_t) meta[i].addr * UFS_BLOCK_SIZE);
+	if (rc != (ssize_t) n * UFS_BLOCK_SIZE) {
+	    perror("write");
+	    exit(1);
+	}
+	i += n;
+    }
+    free(meta);
 
     if (visual) {
 	int i;
@@ -190,6 +305,8 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < s.checksum_len; i++)
+	    printf("C");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
 	printf("\n\n");
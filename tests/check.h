@@ -0,0 +1,25 @@
+#ifndef __CHECK_h__
+#define __CHECK_h__
+
+//
+// shared by the clients of the tests/t_*.sh checks: every failed CHECK is
+// reported on stderr, and check_done() turns the count into an exit status
+//
+
+#include <stdio.h>
+
+static int check_failed = 0;
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            check_failed++;                                                   \
+            fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);   \
+        }                                                                     \
+    } while (0)
+
+static inline int check_done(void) {
+    return check_failed == 0 ? 0 : 1;
+}
+
+#endif // __CHECK_h__
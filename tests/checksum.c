@@ -0,0 +1,98 @@
+// a client of an image made with mkfs -c (t_checksum.sh):
+//   checksum write host port
+//     writes blocks 0-3 of file f and block 0 of file g, then shuts down
+//   checksum corrupt image
+//     flips the first byte of block 1 of f in the image file, server stopped
+//   checksum read host port
+//     block 1 of f fails its reads and copies until it is rewritten
+//   checksum recovered host port
+//     block 1 of f reads back, first byte as it is: its checksum was recomputed
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mfs.h"
+#include "ufs.h"
+#include "check.h"
+
+static void fill(char *buf, int b) {
+    for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+        buf[i] = 'a' + (b * 7 + i) % 26;
+}
+
+// absolute block number of block b of the root's entry name
+static off_t image_block(int fd, char *name, int b) {
+    super_t s;
+    inode_t root, file;
+    dir_ent_t ents[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+    CHECK(pread(fd, &s, sizeof(s), 0) == sizeof(s));
+    CHECK(pread(fd, &root, sizeof(root), (off_t)s.inode_region_addr * UFS_BLOCK_SIZE) == sizeof(root));
+    CHECK(pread(fd, ents, sizeof(ents), (off_t)root.direct[0] * UFS_BLOCK_SIZE) == sizeof(ents));
+    for (size_t i = 0; i < sizeof(ents) / sizeof(ents[0]); i++) {
+        if (ents[i].inum < 0 || strcmp(ents[i].name, name) != 0)
+            continue;
+        off_t at = (off_t)s.inode_region_addr * UFS_BLOCK_SIZE + ents[i].inum * sizeof(inode_t);
+        CHECK(pread(fd, &file, sizeof(file), at) == sizeof(file));
+        return s.data_region_addr + file.direct[b];
+    }
+    CHECK(!"no such entry");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+
+    if (strcmp(argv[1], "corrupt") == 0) {
+        int fd = open(argv[2], O_RDWR);
+        CHECK(fd >= 0);
+        off_t at = image_block(fd, "f", 1) * UFS_BLOCK_SIZE;
+        unsigned char c;
+        CHECK(pread(fd, &c, 1, at) == 1);
+        c ^= 0xff;
+        CHECK(pwrite(fd, &c, 1, at) == 1);
+        close(fd);
+        return check_done();
+    }
+
+    CHECK(MFS_Init(argv[2], atoi(argv[3])) == 0);
+    if (strcmp(argv[1], "write") == 0) {
+        CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "f") == 0);
+        CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "g") == 0);
+        int f = MFS_Lookup(0, "f"), g = MFS_Lookup(0, "g");
+        for (int b = 0; b < 4; b++) {
+            fill(w, b);
+            CHECK(MFS_Write(f, w, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+        }
+        fill(w, 9);
+        CHECK(MFS_Write(g, w, 0, MFS_BLOCK_SIZE) == 0);
+        MFS_Shutdown();
+        return check_done();
+    }
+
+    int f = MFS_Lookup(0, "f"), g = MFS_Lookup(0, "g");
+    CHECK(f > 0 && g > 0);
+    if (strcmp(argv[1], "recovered") == 0) {
+        fill(w, 1);
+        CHECK(MFS_Read(f, r, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r + 1, w + 1, MFS_BLOCK_SIZE - 1) == 0);
+        MFS_Shutdown();
+        return check_done();
+    }
+
+    // the blocks around the corrupt one, and other files, are unaffected
+    CHECK(MFS_Read(f, r, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == -1);
+    CHECK(MFS_Copy(f, 0, "fc") == -1);
+    for (int b = 0; b < 4; b += 2) {
+        fill(w, b);
+        CHECK(MFS_Read(f, r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+    }
+    fill(w, 9);
+    CHECK(MFS_Read(g, r, 0, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+
+    // a rewrite gives the block a fresh checksum
+    fill(w, 1);
+    CHECK(MFS_Write(f, w, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    CHECK(MFS_Read(f, r, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+    CHECK(MFS_Copy(f, 0, "fc") > 0);
+    MFS_Shutdown();
+    return check_done();
+}
@@ -0,0 +1,68 @@
+// server-side copies of files with holes and shared blocks (t_copy.sh)
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+#define BLOCKS 30
+
+static char content[BLOCKS][MFS_BLOCK_SIZE];
+
+int main(int argc, char *argv[]) {
+    char r[MFS_BLOCK_SIZE], name[16];
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "d") == 0);
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "src") == 0);
+    int d = MFS_Lookup(0, "d"), src = MFS_Lookup(0, "src");
+    for (int b = 0; b < BLOCKS; b++) {
+        if (b % 7 == 3)
+            continue; // holes
+        for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+            content[b][i] = b % 3 == 0 ? 'a' + (i / 64 + b) % 26 : rand();
+        if (b % 5 == 0)
+            memcpy(content[b], content[0], MFS_BLOCK_SIZE); // duplicates
+        CHECK(MFS_Write(src, content[b], b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+
+    int cp = MFS_Copy(src, d, "copy");
+    CHECK(cp > 0);
+    CHECK(MFS_Lookup(d, "copy") == cp);
+    MFS_Stat_t st_src, st_cp;
+    CHECK(MFS_Stat(src, &st_src) == 0 && MFS_Stat(cp, &st_cp) == 0 && st_src.size == st_cp.size);
+    for (int b = 0; b < BLOCKS; b++) {
+        int rc = MFS_Read(cp, r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE);
+        if (b % 7 == 3)
+            CHECK(rc == -1);
+        else
+            CHECK(rc == 0 && memcmp(r, content[b], MFS_BLOCK_SIZE) == 0);
+    }
+
+    // the copy and the source diverge on write, and outlive each other
+    memset(r, 'Z', 100);
+    CHECK(MFS_Write(cp, r, MFS_BLOCK_SIZE + 10, 100) == 0);
+    CHECK(MFS_Read(src, r, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, content[1], MFS_BLOCK_SIZE) == 0);
+    CHECK(MFS_Copy(src, d, "copy") == -1);
+    CHECK(MFS_Copy(d, 0, "dcopy") == -1);
+    CHECK(MFS_Copy(src, src, "x") == -1);
+    CHECK(MFS_Copy(src, d, "a-name-too-long-for-an-entry") == -1);
+    CHECK(MFS_Unlink(0, "src") == 0);
+    CHECK(MFS_Read(cp, r, 2 * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, content[2], MFS_BLOCK_SIZE) == 0);
+
+    // copies until the volume or the directory fills, all readable
+    int n = 0;
+    for (; n < 200; n++) {
+        sprintf(name, "c%d", n);
+        if (MFS_Copy(cp, 0, name) < 0)
+            break;
+    }
+    CHECK(n > 0 && n < 200);
+    for (int k = 0; k < n; k += 37) {
+        sprintf(name, "c%d", k);
+        CHECK(MFS_Read(MFS_Lookup(0, name), r, (BLOCKS - 1) * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 &&
+              memcmp(r, content[BLOCKS - 1], MFS_BLOCK_SIZE) == 0);
+    }
+
+    MFS_Shutdown();
+    return check_done();
+}
@@ -0,0 +1,60 @@
+// unlink and create in directories whose entries come and go (t_dirs.sh)
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+#define SLOTS (MFS_BLOCK_SIZE / sizeof(MFS_DirEnt_t) - 2) // entries a directory holds besides . and ..
+
+int main(int argc, char *argv[]) {
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+
+    // a directory that held an entry can be removed once it is gone
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "d") == 0);
+    int d = MFS_Lookup(0, "d");
+    CHECK(d > 0);
+    CHECK(MFS_Creat(d, MFS_REGULAR_FILE, "f") == 0);
+    CHECK(MFS_Unlink(0, "d") == -1);
+    CHECK(MFS_Unlink(d, "f") == 0);
+    CHECK(MFS_Lookup(d, "f") == -1);
+    CHECK(MFS_Unlink(0, "d") == 0);
+    CHECK(MFS_Lookup(0, "d") == -1);
+
+    // a full directory refuses more entries, and takes them again after an unlink
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "full") == 0);
+    int full = MFS_Lookup(0, "full");
+    char name[28];
+    for (int i = 0; i < (int)SLOTS; i++) {
+        sprintf(name, "f%d", i);
+        CHECK(MFS_Creat(full, MFS_REGULAR_FILE, name) == 0);
+    }
+    CHECK(MFS_Creat(full, MFS_REGULAR_FILE, "one-too-many") == -1);
+    CHECK(MFS_Unlink(full, "f7") == 0);
+    CHECK(MFS_Creat(full, MFS_REGULAR_FILE, "again") == 0);
+    CHECK(MFS_Lookup(full, "again") > 0);
+    CHECK(MFS_Lookup(full, "f8") > 0);
+    MFS_Stat_t st;
+    CHECK(MFS_Stat(full, &st) == 0 && st.size == (int)((SLOTS + 2) * sizeof(MFS_DirEnt_t)));
+
+    // entries churned far past a block's worth reuse the slots unlinks free
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "churn") == 0);
+    int churn = MFS_Lookup(0, "churn");
+    for (int i = 0; i < 4 * (int)SLOTS; i++) {
+        sprintf(name, "c%d", i);
+        CHECK(MFS_Creat(churn, MFS_REGULAR_FILE, name) == 0);
+        CHECK(MFS_Lookup(churn, name) > 0);
+        if (i % 5 != 0)
+            CHECK(MFS_Unlink(churn, name) == 0);
+    }
+    CHECK(MFS_Stat(churn, &st) == 0 && st.size <= MFS_BLOCK_SIZE);
+    for (int i = 0; i < 4 * (int)SLOTS; i++) {
+        sprintf(name, "c%d", i);
+        CHECK((MFS_Lookup(churn, name) > 0) == (i % 5 == 0));
+        if (i % 5 == 0)
+            CHECK(MFS_Unlink(churn, name) == 0);
+    }
+    CHECK(MFS_Unlink(0, "churn") == 0);
+
+    MFS_Shutdown();
+    return check_done();
+}
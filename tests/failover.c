@@ -0,0 +1,36 @@
+// a client of a primary and its backup (t_failover.sh):
+//   failover write "primary,backup:port" port from to
+//     writes blocks [from, to) of file f, then checks blocks [0, to)
+//   failover standby host port
+//     talks to a backup still in standby: reads work, writes are refused
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    CHECK(MFS_Init(argv[2], atoi(argv[3])) == 0);
+
+    if (strcmp(argv[1], "standby") == 0) {
+        int inum = MFS_Lookup(0, "f");
+        CHECK(inum > 0);
+        CHECK(MFS_Read(inum, r, 0, MFS_BLOCK_SIZE) == 0 && r[0] == 'A');
+        CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "g") == -1);
+        CHECK(MFS_Write(inum, w, 0, MFS_BLOCK_SIZE) == -1);
+        CHECK(MFS_Lookup(0, "g") == -1);
+        return check_done();
+    }
+
+    int from = atoi(argv[4]), to = atoi(argv[5]);
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "f") == 0);
+    int inum = MFS_Lookup(0, "f");
+    CHECK(inum > 0);
+    for (int b = from; b < to; b++) {
+        memset(w, 'A' + b, sizeof(w));
+        CHECK(MFS_Write(inum, w, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+    for (int b = 0; b < to; b++)
+        CHECK(MFS_Read(inum, r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && r[0] == 'A' + b && r[MFS_BLOCK_SIZE - 1] == 'A' + b);
+    return check_done();
+}
@@ -0,0 +1,55 @@
+# sourced by the tests/t_*.sh checks: builds mkfs, fsserv, mfsck and the
+# check's client into a scratch directory, starts servers there and stops
+# them when the check exits
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/mfs-check.XXXXXX)
+PIDS=""
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null; kill -CONT "$pid" 2>/dev/null; done
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+gcc -O2 "$ROOT/mkfs.c" -o "$WORK/mkfs" || exit 1
+gcc -O2 "$ROOT/fsserv.c" -o "$WORK/fsserv" -pthread -lrt || exit 1
+gcc -O2 "$ROOT/mfsck.c" -o "$WORK/mfsck" -pthread || exit 1
+
+# client name: build tests/name.c against the client library
+client() {
+    gcc -O2 -I"$ROOT" "$ROOT/tests/$1.c" "$ROOT/fscli.c" -DMFS_NO_MAIN -o "$WORK/$1" -pthread -lrt || exit 1
+}
+
+# image file [mkfs flags]
+image() {
+    file=$1
+    shift
+    "$WORK/mkfs" -f "$WORK/$file" "$@" > /dev/null || exit 1
+}
+
+# server [fsserv args]: runs in the scratch directory, its pid in $SERVER and
+# its stderr in $WORK/fsserv.<n>.err, n counting from 1
+SERVERS=0
+server() {
+    SERVERS=$((SERVERS + 1))
+    (cd "$WORK" && exec ./fsserv "$@") > /dev/null 2> "$WORK/fsserv.$SERVERS.err" &
+    SERVER=$!
+    PIDS="$PIDS $SERVER"
+    sleep 0.5
+}
+
+# run name [args]: run a built client and show the checks it failed
+run() {
+    name=$1
+    shift
+    "$WORK/$name" "$@" > "$WORK/$name.log" 2> "$WORK/$name.err"
+    status=$?
+    grep -a "^FAIL" "$WORK/$name.err"
+    return $status
+}
+
+# fsck file: the image must check clean
+fsck() {
+    "$WORK/mfsck" "$WORK/$1" > "$WORK/mfsck.out" 2>&1 || { cat "$WORK/mfsck.out"; exit 1; }
+}
@@ -0,0 +1,67 @@
+// blocks read ahead of a sequential reader give way to another client's
+// writes (t_readahead.sh): readahead host port
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mfs.h"
+#include "check.h"
+
+#define BLOCKS 16
+
+// another client, in a process of its own, writes block blk full of c
+static void write_elsewhere(char *host, int port, int blk, char c) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char w[MFS_BLOCK_SIZE];
+        memset(w, c, sizeof(w));
+        MFS_Init(host, port);
+        exit(MFS_Write(MFS_Lookup(0, "f"), w, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 ? 0 : 1);
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int read_block(int inum, int blk, char *r) {
+    return MFS_Read(inum, r, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    int port = atoi(argv[2]);
+    CHECK(MFS_Init(argv[1], port) == 0);
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "f") == 0);
+    int inum = MFS_Lookup(0, "f");
+    for (int blk = 0; blk < BLOCKS; blk++) {
+        memset(w, 'a' + blk, sizeof(w));
+        CHECK(MFS_Write(inum, w, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+
+    // reading on requests the blocks after; one of them changes meanwhile
+    for (int blk = 0; blk < 4; blk++)
+        CHECK(read_block(inum, blk, r) == 0 && r[0] == 'a' + blk);
+    usleep(100000);
+    write_elsewhere(argv[1], port, 6, 'N');
+
+    // a reply carrying a newer volume version retires what was read before it
+    MFS_Stat_t st;
+    CHECK(MFS_Stat(inum, &st) == 0);
+    for (int blk = 4; blk < 7; blk++)
+        CHECK(read_block(inum, blk, r) == 0 && r[0] == (blk == 6 ? 'N' : 'a' + blk));
+
+    // without one, a block read ahead is not served past its age
+    usleep(100000);
+    write_elsewhere(argv[1], port, 10, 'M');
+    usleep(1100 * 1000);
+    for (int blk = 7; blk < 11; blk++)
+        CHECK(read_block(inum, blk, r) == 0 && r[0] == (blk == 10 ? 'M' : 'a' + blk));
+
+    // jumping back reads the file as it is, not as it was read ahead
+    write_elsewhere(argv[1], port, 12, 'J');
+    CHECK(MFS_Stat(inum, &st) == 0);
+    CHECK(read_block(inum, 12, r) == 0 && r[0] == 'J');
+    CHECK(read_block(inum, 2, r) == 0 && r[0] == 'c');
+
+    MFS_Shutdown();
+    return check_done();
+}
@@ -0,0 +1,74 @@
+// renames within and across directories, and the name limit (t_rename.sh)
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "a") == 0);
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "b") == 0);
+    int a = MFS_Lookup(0, "a"), b = MFS_Lookup(0, "b");
+    CHECK(MFS_Creat(a, MFS_REGULAR_FILE, "f") == 0);
+    int f = MFS_Lookup(a, "f");
+    for (int i = 0; i < 3; i++) {
+        memset(w, 'p' + i, sizeof(w));
+        CHECK(MFS_Write(f, w, i * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+
+    // the inode moves with its data, across directories and within one
+    CHECK(MFS_Rename(a, "f", b, "g") == 0);
+    CHECK(MFS_Lookup(a, "f") == -1);
+    CHECK(MFS_Lookup(b, "g") == f);
+    CHECK(MFS_Read(f, r, 2 * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && r[0] == 'r');
+    CHECK(MFS_Rename(b, "g", b, "h") == 0);
+    CHECK(MFS_Lookup(b, "g") == -1);
+    CHECK(MFS_Lookup(b, "h") == f);
+    CHECK(MFS_Rename(b, "h", b, "h") == 0);
+
+    // a regular file in the way is replaced, a directory is not
+    CHECK(MFS_Creat(b, MFS_REGULAR_FILE, "x") == 0);
+    CHECK(MFS_Write(MFS_Lookup(b, "x"), w, 0, 100) == 0);
+    CHECK(MFS_Rename(b, "h", b, "x") == 0);
+    CHECK(MFS_Lookup(b, "x") == f);
+    CHECK(MFS_Lookup(b, "h") == -1);
+    CHECK(MFS_Creat(b, MFS_DIRECTORY, "sub") == 0);
+    CHECK(MFS_Rename(b, "x", b, "sub") == -1);
+
+    // a moved directory gets its new parent, and cannot go below itself
+    CHECK(MFS_Rename(0, "a", b, "a2") == 0);
+    CHECK(MFS_Lookup(0, "a") == -1);
+    CHECK(MFS_Lookup(b, "a2") == a);
+    CHECK(MFS_Lookup(a, "..") == b);
+    CHECK(MFS_Rename(0, "b", a, "c") == -1);
+    CHECK(MFS_Rename(0, "b", b, "c") == -1);
+
+    CHECK(MFS_Rename(b, "nope", b, "y") == -1);
+    CHECK(MFS_Rename(b, ".", b, "y") == -1);
+    CHECK(MFS_Rename(b, "x", b, "..") == -1);
+
+    // 27 characters fit an entry everywhere, 28 fit nowhere, and none are cut short
+    char longest[28], too_long[29];
+    memset(longest, 'l', 27);
+    longest[27] = '\0';
+    memset(too_long, 't', 28);
+    too_long[28] = '\0';
+    CHECK(MFS_Creat(b, MFS_REGULAR_FILE, longest) == 0);
+    CHECK(MFS_Lookup(b, longest) > 0);
+    CHECK(MFS_Creat(b, MFS_REGULAR_FILE, too_long) == -1);
+    CHECK(MFS_Lookup(b, too_long) == -1);
+    too_long[27] = '\0';
+    CHECK(MFS_Lookup(b, too_long) == -1); // nothing was created under a shortened name
+    too_long[27] = 't';
+    CHECK(MFS_Rename(b, "x", b, too_long) == -1);
+    CHECK(MFS_Rename(b, longest, b, too_long) == -1);
+    CHECK(MFS_Unlink(b, too_long) == -1);
+    CHECK(MFS_Rename(b, "x", 0, longest) == 0);
+    CHECK(MFS_Lookup(0, longest) == f);
+    CHECK(MFS_Unlink(b, longest) == 0);
+
+    MFS_Shutdown();
+    return check_done();
+}
@@ -0,0 +1,35 @@
+// reads spread over read replicas see the client's own writes (t_replica.sh):
+//   replica host port [replica_host replica_port]...
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mfs.h"
+#include "check.h"
+
+#define ROUNDS 60
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+    for (int i = 3; i + 1 < argc; i += 2)
+        CHECK(MFS_AddReplica(argv[i], atoi(argv[i + 1])) == 0);
+
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "f") == 0);
+    int inum = MFS_Lookup(0, "f");
+    CHECK(inum > 0);
+    for (int round = 0; round < ROUNDS; round++) {
+        int b = round % 10;
+        memset(w, 'a' + round % 26, sizeof(w));
+        CHECK(MFS_Write(inum, w, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+        // every replica gets a turn at each
+        for (int k = 0; k < 3; k++) {
+            CHECK(MFS_Read(inum, r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+            MFS_Stat_t st;
+            CHECK(MFS_Stat(inum, &st) == 0 && st.size >= (b + 1) * MFS_BLOCK_SIZE);
+            CHECK(MFS_Lookup(0, "f") == inum);
+        }
+        if (getenv("SLOW") != NULL)
+            usleep(200000);
+    }
+    return check_done();
+}
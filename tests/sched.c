@@ -0,0 +1,185 @@
+// requests that wait in fsserv's scheduler queues (t_sched.sh). The server is
+// stopped while a burst is sent, so the whole burst is queued at once:
+//   sched overtake port pid strict
+//     16 writes, 4 reads and a stat: strictly by priority when strict is 1,
+//     otherwise reads and the stat wait for at most a turn of writes
+//   sched overflow port volumes pid
+//     22 writes on each volume, more than a class queues: all are answered
+//   sched stream port
+//     requests pipelined on one TCP connection are answered in order
+#include <arpa/inet.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "message.h"
+#include "check.h"
+
+#define BURST (16)
+#define READS (4)
+#define WRITE_TURN (4) // writes per round of the weighted round robin, see t_sched.sh
+#define PER_VOLUME (22) // datagrams one socket surely buffers; 3 volumes overflow a queue of 64
+
+static int udp;
+
+static void fill(message *m, char *op, int p1, int p2, int p3, char *tag) {
+    memset(m, 0, sizeof(*m));
+    strcpy(m->msg, op);
+    m->param1 = p1;
+    m->param2 = p2;
+    m->param3 = p3;
+    strcpy(m->charParam, tag);
+}
+
+static void post(int port, char *op, int p1, int p2, int p3, char *tag) {
+    message m;
+    fill(&m, op, p1, p2, p3, tag);
+    memset(m.buf, tag[0], sizeof(m.buf));
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    CHECK(sendto(udp, &m, sizeof(m), 0, (struct sockaddr *)&to, sizeof(to)) == sizeof(m));
+}
+
+// the next reply on the datagram socket, -1 if none comes
+static int collect(message *m) {
+    return recv(udp, m, sizeof(*m), 0) == sizeof(*m) ? 0 : -1;
+}
+
+static int call(int port, char *op, int p1, int p2, int p3, char *tag, message *m) {
+    post(port, op, p1, p2, p3, tag);
+    CHECK(collect(m) == 0);
+    return m->msg_code;
+}
+
+static int overtake(int port, pid_t pid, int strict) {
+    message m;
+    CHECK(call(port, "MFS_Creat", 0, 1, 0, "f", &m) == 0);
+    int inum = call(port, "MFS_Lookup", 0, 0, 0, "f", &m);
+    CHECK(inum > 0);
+    CHECK(call(port, "MFS_Write", inum, 0, 4096, "w", &m) == 0);
+    kill(pid, SIGSTOP);
+    for (int i = 0; i < BURST; i++)
+        post(port, "MFS_Write", inum, i * 4096, 4096, "w");
+    for (int i = 0; i < READS; i++)
+        post(port, "MFS_Read", inum, 0, 4096, "r");
+    post(port, "MFS_Stat", inum, 0, 0, "s");
+    kill(pid, SIGCONT);
+
+    // the order of the answers, one letter per request
+    char order[BURST + READS + 2] = "";
+    for (int i = 0; i < BURST + READS + 1 && collect(&m) == 0; i++) {
+        CHECK(m.msg_code == 0);
+        order[i] = m.charParam[0];
+    }
+    CHECK(strlen(order) == BURST + READS + 1);
+    if (strict) {
+        CHECK(strncmp(order, "srrrrwwww", 9) == 0);
+    } else {
+        // no more than a turn of writes while a read or the stat waits, and
+        // writes get their turns before the last read
+        int run = 0, longest = 0;
+        for (int i = 0; order[i] != '\0' && (strchr(order + i, 'r') != NULL || strchr(order + i, 's') != NULL); i++) {
+            run = order[i] == 'w' ? run + 1 : 0;
+            longest = run > longest ? run : longest;
+        }
+        CHECK(longest <= WRITE_TURN);
+        CHECK(strchr(order, 'w') < strrchr(order, 'r'));
+    }
+    fprintf(stderr, "answered %s\n", order);
+    return check_done();
+}
+
+static int overflow(int port, int volumes, pid_t pid) {
+    message m;
+    int inum[8];
+    for (int v = 0; v < volumes; v++) {
+        CHECK(call(port + v, "MFS_Creat", 0, 1, 0, "f", &m) == 0);
+        inum[v] = call(port + v, "MFS_Lookup", 0, 0, 0, "f", &m);
+    }
+    kill(pid, SIGSTOP);
+    char tag[2] = "a";
+    for (int v = 0; v < volumes; v++) {
+        for (int i = 0; i < PER_VOLUME; i++) {
+            tag[0] = 'a' + i;
+            post(port + v, "MFS_Write", inum[v], i * 4096, 4096, tag);
+        }
+    }
+    kill(pid, SIGCONT);
+    int answered = 0;
+    while (answered < volumes * PER_VOLUME && collect(&m) == 0) {
+        CHECK(strcmp(m.msg, "MFS_Write") == 0 && m.msg_code == 0);
+        answered++;
+    }
+    CHECK(answered == volumes * PER_VOLUME);
+    for (int v = 0; v < volumes; v++) {
+        for (int i = 0; i < PER_VOLUME; i++) {
+            CHECK(call(port + v, "MFS_Read", inum[v], i * 4096, 4096, "r", &m) == 0);
+            CHECK(m.buf[0] == 'a' + i && m.buf[4095] == 'a' + i);
+        }
+    }
+    return check_done();
+}
+
+static int stream(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    CHECK(connect(fd, (struct sockaddr *)&to, sizeof(to)) == 0);
+    message m;
+    CHECK(call(port, "MFS_Creat", 0, 1, 0, "g", &m) == 0);
+    int inum = call(port, "MFS_Lookup", 0, 0, 0, "g", &m);
+
+    // writes and the reads of what they wrote, all sent before any reply
+    struct {
+        char *op;
+        int offset;
+        char *tag;
+    } reqs[] = {
+        {"MFS_Write", 0, "A"}, {"MFS_Write", 0, "B"}, {"MFS_Read", 0, "1"}, {"MFS_Stat", 0, "2"},
+        {"MFS_Write", 4096, "C"}, {"MFS_Read", 4096, "3"}, {"MFS_Write", 0, "D"}, {"MFS_Read", 0, "4"},
+    };
+    int n = sizeof(reqs) / sizeof(reqs[0]);
+    static char frames[8][sizeof(uint32_t) + sizeof(message)];
+    for (int i = 0; i < n; i++) {
+        uint32_t len = htonl(sizeof(message));
+        memcpy(frames[i], &len, sizeof(len));
+        message *f = (message *)(frames[i] + sizeof(len));
+        fill(f, reqs[i].op, inum, reqs[i].offset, 4096, reqs[i].tag);
+        memset(f->buf, reqs[i].tag[0], sizeof(f->buf));
+    }
+    CHECK(write(fd, frames, n * sizeof(frames[0])) == (ssize_t)(n * sizeof(frames[0])));
+
+    char expect[] = {0, 0, 'B', 0, 0, 'C', 0, 'D'};
+    for (int i = 0; i < n; i++) {
+        char frame[sizeof(uint32_t) + sizeof(message)];
+        size_t have = 0;
+        while (have < sizeof(frame)) {
+            ssize_t rc = read(fd, frame + have, sizeof(frame) - have);
+            CHECK(rc > 0);
+            if (rc <= 0)
+                return check_done();
+            have += rc;
+        }
+        message *r = (message *)(frame + sizeof(uint32_t));
+        CHECK(strcmp(r->msg, reqs[i].op) == 0 && strcmp(r->charParam, reqs[i].tag) == 0 && r->msg_code == 0);
+        if (expect[i] != 0)
+            CHECK(r->buf[0] == expect[i] && r->buf[4095] == expect[i]);
+    }
+    close(fd);
+    return check_done();
+}
+
+int main(int argc, char *argv[]) {
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 << 20;
+    setsockopt(udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // replies to a whole burst
+    struct timeval timeout = {.tv_sec = 5};
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int port = atoi(argv[2]);
+    if (strcmp(argv[1], "overtake") == 0)
+        return overtake(port, atoi(argv[3]), atoi(argv[4]));
+    if (strcmp(argv[1], "overflow") == 0)
+        return overflow(port, atoi(argv[3]), atoi(argv[4]));
+    return stream(port);
+}
@@ -0,0 +1,69 @@
+// a namespace sharded over three servers (t_shard.sh): shards "a" and "b"
+// are mounted in the root of the server MFS_Init reaches
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+#define SHARD_OF(inum) ((inum) >> MFS_SHARD_SHIFT)
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    MFS_Stat_t st;
+    MFS_DirEnt_t ents[4];
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+
+    // mounts resolve to the shards' roots and cannot be replaced
+    int a = MFS_Lookup(0, "a"), b = MFS_Lookup(0, "b");
+    CHECK(a == 1 << MFS_SHARD_SHIFT && b == 2 << MFS_SHARD_SHIFT);
+    CHECK(MFS_Creat(0, MFS_DIRECTORY, "a") == -1);
+    CHECK(MFS_Unlink(0, "a") == -1);
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "top") == 0);
+    int top = MFS_Lookup(0, "top");
+    CHECK(top > 0 && SHARD_OF(top) == 0);
+
+    // inodes created below a mount belong to its shard
+    CHECK(MFS_Creat(a, MFS_DIRECTORY, "d") == 0);
+    int d = MFS_Lookup(a, "d");
+    CHECK(d > a && SHARD_OF(d) == 1);
+    CHECK(MFS_Creat(d, MFS_REGULAR_FILE, "x") == 0);
+    int x = MFS_Lookup(d, "x");
+    CHECK(SHARD_OF(x) == 1);
+    for (int blk = 0; blk < 5; blk++) {
+        memset(w, 'k' + blk, sizeof(w));
+        CHECK(MFS_Write(x, w, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+    for (int blk = 0; blk < 5; blk++)
+        CHECK(MFS_Read(x, r, blk * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && r[7] == 'k' + blk);
+    CHECK(MFS_Stat(x, &st) == 0 && st.size == 5 * MFS_BLOCK_SIZE && st.type == MFS_REGULAR_FILE);
+    CHECK(MFS_Stat(a, &st) == 0 && st.type == MFS_DIRECTORY);
+
+    // ".." of a shard's root leads back to the mounting root, and directory
+    // reads carry inode numbers of the shard they were read from
+    CHECK(MFS_Lookup(a, "..") == 0 && MFS_Lookup(d, "..") == a && MFS_Lookup(a, ".") == a);
+    CHECK(MFS_Read(a, (char *)ents, 0, sizeof(ents)) == 0);
+    CHECK(strcmp(ents[0].name, ".") == 0 && ents[0].inum == a && strcmp(ents[1].name, "..") == 0 && ents[1].inum == 0 &&
+          strcmp(ents[2].name, "d") == 0 && ents[2].inum == d);
+    CHECK(MFS_Read(d, (char *)ents, 0, sizeof(ents)) == 0 && ents[1].inum == a && ents[2].inum == x);
+
+    // renames and copies stay within a shard
+    CHECK(MFS_Rename(d, "x", 0, "x") == -1);
+    CHECK(MFS_Copy(x, b, "xc") == -1);
+    int xc = MFS_Copy(x, a, "xc");
+    CHECK(xc > 0 && SHARD_OF(xc) == 1 && MFS_Read(xc, r, MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && r[0] == 'l');
+    CHECK(MFS_Rename(a, "xc", d, "y") == 0 && MFS_Lookup(d, "y") == xc);
+    CHECK(MFS_Creat(b, MFS_REGULAR_FILE, "z") == 0 && SHARD_OF(MFS_Lookup(b, "z")) == 2);
+    CHECK(MFS_Lookup(a, "z") == -1);
+    CHECK(MFS_Unlink(d, "y") == 0 && MFS_Lookup(d, "y") == -1);
+
+    // write-back and fsync reach the shard the file lives on
+    CHECK(MFS_Fsync(x) == 0);
+    MFS_WriteBack(1);
+    memset(w, 'Q', sizeof(w));
+    CHECK(MFS_Write(x, w, 100, 50) == 0);
+    CHECK(MFS_Read(x, r, 100, 50) == 0 && r[49] == 'Q');
+    CHECK(MFS_Fsync(x) == 0);
+
+    MFS_Shutdown(); // every shard
+    return check_done();
+}
@@ -0,0 +1,47 @@
+// a client of fsserv's shared-memory ring (t_shm.sh):
+//   shm hold port
+//     claims every slot of the ring and dies holding them
+//   shm use port
+//     creates, writes and reads a file through the ring
+//   shm gone port
+//     stats the root until the server is killed: the call then fails
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mfs.h"
+#include "mfs_shm.h"
+#include "check.h"
+
+shm_slot_t *shmClaim();
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE];
+    MFS_Stat_t st;
+    CHECK(MFS_Init("shm", atoi(argv[2])) == 0);
+
+    if (strcmp(argv[1], "hold") == 0) {
+        for (int i = 0; i < SHM_SLOTS; i++)
+            CHECK(shmClaim() != NULL);
+        if (check_failed == 0)
+            raise(SIGKILL);
+        return check_done();
+    }
+
+    if (strcmp(argv[1], "gone") == 0) {
+        time_t start = time(NULL);
+        while (MFS_Stat(0, &st) == 0 && time(NULL) < start + 20)
+            ;
+        CHECK(time(NULL) < start + 20);
+        CHECK(MFS_Stat(0, &st) == -1);
+        return check_done();
+    }
+
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, "f") == 0);
+    int inum = MFS_Lookup(0, "f");
+    CHECK(inum > 0);
+    memset(w, 'S', sizeof(w));
+    CHECK(MFS_Write(inum, w, 0, MFS_BLOCK_SIZE) == 0);
+    CHECK(MFS_Read(inum, r, 0, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+    return check_done();
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# the checksum table of mkfs -c images: a corrupt block is found by reads,
+# copies, the scrub and mfsck, and a server that did not shut down cleanly
+# leaves the table to be recomputed rather than blocks that never read again
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27170}
+
+client checksum
+image sum.img -c -i 32 -d 64
+server "$PORT" sum.img
+run checksum write localhost "$PORT" || exit 1
+wait "$SERVER"
+fsck sum.img
+
+# mfsck_finds file status kind count: mfsck exits with status and counts
+# count problems of kind
+mfsck_finds() {
+    "$WORK/mfsck" "$WORK/$1" > "$WORK/mfsck.out" 2>&1
+    status=$?
+    [ "$status" -eq "$2" ] && grep -q "^$3  *$4\( \|\$\)" "$WORK/mfsck.out" && return 0
+    cat "$WORK/mfsck.out"
+    return 1
+}
+
+"$WORK/checksum" corrupt "$WORK/sum.img" || exit 1
+mfsck_finds sum.img 4 "checksum mismatches" 1 || { echo "t_checksum: mfsck missed the corrupt block"; exit 1; }
+server "$PORT" sum.img
+sleep 1
+run checksum read localhost "$PORT" || exit 1
+wait "$SERVER"
+[ "$(grep -c "^scrub: .* fails its checksum" "$WORK/fsserv.2.err")" -eq 1 ] || { echo "t_checksum: scrub reports"; exit 1; }
+grep -q "checksum_errors=3 " "$WORK/fsserv.2.err" || { echo "t_checksum: checksum_errors"; exit 1; }
+fsck sum.img
+
+# a killed server leaves the table marked stale: a block that reached the disk
+# without its entry is re-checksummed by mfsck -r, or by the next server
+for repair in mfsck fsserv; do
+    PORT=$((PORT + 1))
+    server "$PORT" sum.img
+    kill -KILL "$SERVER"
+    wait "$SERVER" 2>/dev/null
+    "$WORK/checksum" corrupt "$WORK/sum.img" || exit 1
+    if [ $repair = mfsck ]; then
+        mfsck_finds sum.img 4 "checksums stale after a crash" 1 || exit 1
+        "$WORK/mfsck" -r "$WORK/sum.img" > /dev/null
+        [ $? -eq 1 ] || { echo "t_checksum: mfsck -r did not repair the table"; exit 1; }
+        fsck sum.img
+        continue
+    fi
+    server "$PORT" sum.img
+    grep -q "not shut down cleanly: 1 checksums recomputed" "$WORK/fsserv.$SERVERS.err" || { echo "t_checksum: table not recomputed"; exit 1; }
+    run checksum recovered localhost "$PORT" || exit 1
+    wait "$SERVER"
+    fsck sum.img
+done
+echo "t_checksum: ok"
@@ -0,0 +1,15 @@
+#!/bin/sh
+# server-side copies on a plain image, and on ones that share or pack blocks
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27120}
+
+client copy
+for flags in "" -D -z; do
+    image copy.img -i 512 -d 1024 $flags
+    server "$PORT" copy.img
+    run copy localhost "$PORT" || { echo "t_copy: failed on mkfs $flags"; exit 1; }
+    wait "$SERVER"
+    fsck copy.img
+    PORT=$((PORT + 1))
+done
+echo "t_copy: ok"
@@ -0,0 +1,12 @@
+#!/bin/sh
+# unlink of directories that held entries, and directories that fill up
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27100}
+
+client dirs
+image dirs.img -i 512
+server "$PORT" dirs.img
+run dirs localhost "$PORT" || exit 1
+wait "$SERVER"
+fsck dirs.img
+echo "t_dirs: ok"
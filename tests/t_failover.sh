@@ -0,0 +1,79 @@
+#!/bin/sh
+# a backup that stays in standby while its primary is only silent, and takes
+# over once the primary is gone
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27130}
+BACKUP=$((PORT + 1))
+PAIR="localhost,localhost:$BACKUP"
+
+client failover
+image primary.img -i 64 -d 64
+cp "$WORK/primary.img" "$WORK/backup.img"
+server -t "$BACKUP" backup.img
+BACKUP_PID=$SERVER
+server -B "localhost:$BACKUP" "$PORT" primary.img
+PRIMARY_PID=$SERVER
+
+run failover write "$PAIR" "$PORT" 0 4 || exit 1
+run failover standby localhost "$BACKUP" || exit 1
+
+# a primary that stops answering for a while is not lost: the client's
+# writes wait for it rather than go to the backup
+kill -STOP "$PRIMARY_PID"
+run failover write "$PAIR" "$PORT" 4 6 &
+CLIENT=$!
+sleep 20
+kill -CONT "$PRIMARY_PID"
+wait "$CLIENT" || exit 1
+run failover standby localhost "$BACKUP" || exit 1
+
+# a primary that is gone hands its clients to the backup, which has every
+# write the primary answered
+kill -KILL "$PRIMARY_PID"
+wait "$PRIMARY_PID" 2>/dev/null
+run failover write "$PAIR" "$PORT" 6 8 || exit 1
+grep -q "primary gone" "$WORK/fsserv.1.err" || { echo "t_failover: backup did not take over"; exit 1; }
+kill "$BACKUP_PID"
+wait "$BACKUP_PID" 2>/dev/null
+fsck backup.img
+
+# a backup the primary gave up on has missed writes: it must not take
+# clients' writes once the primary closes the stream
+PORT=$((PORT + 2))
+image primary.img -i 64 -d 64
+cp "$WORK/primary.img" "$WORK/backup.img"
+server -t $((PORT + 1)) backup.img
+BACKUP_PID=$SERVER
+server -B "localhost:$((PORT + 1))" "$PORT" primary.img
+run failover write localhost "$PORT" 0 2 || exit 1
+kill -STOP "$BACKUP_PID"
+run failover write localhost "$PORT" 2 4 || exit 1
+kill -CONT "$BACKUP_PID"
+sleep 0.5
+run failover standby localhost $((PORT + 1)) || exit 1
+grep -q "staying in standby" "$WORK/fsserv.$((SERVERS - 1)).err" || { echo "t_failover: dropped backup left standby"; exit 1; }
+kill "$SERVER" "$BACKUP_PID"
+wait "$SERVER" "$BACKUP_PID" 2>/dev/null
+
+# packed and deduplicated blocks are allocated from state kept in memory,
+# which must lead a backup to the very same blocks, also when it outlives
+# its primary and a restarted one streams to it
+client rename
+for flags in -z -D; do
+    PORT=$((PORT + 2))
+    image primary.img -i 512 -d 1024 $flags
+    cp "$WORK/primary.img" "$WORK/backup.img"
+    server -t $((PORT + 1)) backup.img
+    BACKUP_PID=$SERVER
+    server -B "localhost:$((PORT + 1))" "$PORT" primary.img
+    run failover write localhost "$PORT" 0 8 || exit 1
+    kill "$SERVER"
+    wait "$SERVER" 2>/dev/null
+    server -B "localhost:$((PORT + 1))" "$PORT" primary.img
+    run rename localhost "$PORT" || exit 1
+    wait "$SERVER"
+    kill "$BACKUP_PID"
+    wait "$BACKUP_PID" 2>/dev/null
+    cmp "$WORK/primary.img" "$WORK/backup.img" || { echo "t_failover: backup differs on mkfs $flags"; exit 1; }
+done
+echo "t_failover: ok"
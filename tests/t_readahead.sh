@@ -0,0 +1,12 @@
+#!/bin/sh
+# a reader's readahead against another client's writes
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27160}
+
+client readahead
+image readahead.img -i 64 -d 64
+server "$PORT" readahead.img
+run readahead localhost "$PORT" || exit 1
+wait "$SERVER"
+fsck readahead.img
+echo "t_readahead: ok"
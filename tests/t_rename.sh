@@ -0,0 +1,12 @@
+#!/bin/sh
+# renames, and names too long for a directory entry
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27110}
+
+client rename
+image rename.img -i 512
+server "$PORT" rename.img
+run rename localhost "$PORT" || exit 1
+wait "$SERVER"
+fsck rename.img
+echo "t_rename: ok"
@@ -0,0 +1,34 @@
+#!/bin/sh
+# reads served by a primary's backups, including one that fell behind
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27140}
+
+client replica
+image primary.img -i 64 -d 256
+cp "$WORK/primary.img" "$WORK/backup1.img"
+cp "$WORK/primary.img" "$WORK/backup2.img"
+server -t $((PORT + 1)) backup1.img
+server -t $((PORT + 2)) backup2.img
+BACKUP2_PID=$SERVER
+server -B "localhost:$((PORT + 1))" -B "localhost:$((PORT + 2))" "$PORT" primary.img
+
+run replica localhost "$PORT" localhost $((PORT + 1)) localhost $((PORT + 2)) || exit 1
+kill -USR1 $PIDS
+sleep 0.3
+# turns go round across lookups, stats and reads alike
+for n in 1 2; do
+    reads=$(grep -a "Read=" "$WORK/fsserv.$n.err" | tail -1 | sed 's/.*Lookup=\([0-9]*\) Stat=\([0-9]*\) .* Read=\([0-9]*\) .*/\1 + \2 + \3/')
+    [ $((${reads:-0})) -gt 0 ] || { echo "t_replica: backup $n served no reads"; exit 1; }
+done
+
+# a backup that stalls is dropped and falls behind; its stale answers must
+# not reach the client
+SLOW=1 run replica localhost "$PORT" localhost $((PORT + 1)) localhost $((PORT + 2)) &
+CLIENT=$!
+sleep 1
+kill -STOP "$BACKUP2_PID"
+sleep 7
+kill -CONT "$BACKUP2_PID"
+wait "$CLIENT" || exit 1
+grep -q "lost backup 1" "$WORK/fsserv.3.err" || { echo "t_replica: stalled backup was not dropped"; exit 1; }
+echo "t_replica: ok"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# the request scheduler of the poll loop: by strict priority (-P) a stat and
+# reads overtake the writes queued before them, by weighted round robin (-W)
+# they wait for at most one turn of writes, a full queue answers at once, and
+# a TCP connection is answered in the order it sent
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27190}
+
+client sched
+image a.img -i 64 -d 256
+image b.img -i 64 -d 256
+image c.img -i 64 -d 256
+
+server -P -t "$PORT" a.img
+run sched overtake "$PORT" "$SERVER" 1 || { echo "t_sched: -P"; exit 1; }
+run sched stream "$PORT" || { echo "t_sched: TCP order"; exit 1; }
+kill "$SERVER"
+wait "$SERVER" 2>/dev/null
+fsck a.img
+
+PORT=$((PORT + 1))
+server -W 1,1,4,1 "$PORT" b.img
+run sched overtake "$PORT" "$SERVER" 0 || { echo "t_sched: -W"; exit 1; }
+kill "$SERVER"
+wait "$SERVER" 2>/dev/null
+fsck b.img
+
+PORT=$((PORT + 1))
+image a.img -i 64 -d 256
+image b.img -i 64 -d 256
+server -P "$PORT" a.img $((PORT + 1)) b.img $((PORT + 2)) c.img
+run sched overflow "$PORT" 3 "$SERVER" || { echo "t_sched: full queue"; exit 1; }
+kill "$SERVER"
+wait "$SERVER" 2>/dev/null
+for img in a.img b.img c.img; do
+    fsck $img
+done
+echo "t_sched: ok"
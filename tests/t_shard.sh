@@ -0,0 +1,14 @@
+#!/bin/sh
+# a namespace sharded over three servers, shut down through the first
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27150}
+
+client shard
+for i in root a b; do image $i.img -i 64 -d 256; done
+server $((PORT + 1)) a.img
+server $((PORT + 2)) b.img
+server -M a=localhost:$((PORT + 1)) -M b=localhost:$((PORT + 2)) "$PORT" root.img
+run shard localhost "$PORT" || exit 1
+for pid in $PIDS; do wait "$pid" || { echo "t_shard: a shard did not shut down cleanly"; exit 1; }; done
+for i in root a b; do fsck $i.img; done
+echo "t_shard: ok"
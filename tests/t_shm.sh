@@ -0,0 +1,28 @@
+#!/bin/sh
+# the shared-memory ring outlives clients that die holding its slots, and
+# its clients fail rather than wait forever once the server is gone
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27180}
+
+client shm
+image shm.img -i 64 -d 64
+server -m "$PORT" shm.img
+
+# every slot is left claimed by a dead client
+"$WORK/shm" hold "$PORT" 2> "$WORK/shm.err"
+[ $? -eq 137 ] || { cat "$WORK/shm.err"; echo "t_shm: holder did not die holding the slots"; exit 1; }
+timeout 20 "$WORK/shm" use "$PORT" > "$WORK/shm.log" 2> "$WORK/shm.err"
+status=$?
+grep -a "^FAIL" "$WORK/shm.err"
+[ $status -eq 0 ] || { echo "t_shm: slots of a dead client not taken back ($status)"; exit 1; }
+grep -q "taken back" "$WORK/shm.log" || { echo "t_shm: slots of a dead client not taken back"; exit 1; }
+
+run shm gone "$PORT" &
+CLIENT=$!
+sleep 1
+kill -KILL "$SERVER"
+wait "$CLIENT" || { echo "t_shm: client outlived by a dead server"; exit 1; }
+wait "$SERVER" 2>/dev/null
+rm -f "/dev/shm/mfs.$PORT" # a killed server leaves its ring behind
+fsck shm.img
+echo "t_shm: ok"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# the io_uring loop (-U): deferred and plain writes from a UDP, a TCP and a
+# shared-memory client at once, whose MFS_Fsync calls also take the dirty range
+# from under the loop's group commits, and an image that checks clean once the
+# server has shut down
+. "$(dirname "$0")/lib.sh"
+PORT=${PORT:-27200}
+
+client uring
+# one copy per concurrent client, each run keeps its own log
+cp "$WORK/uring" "$WORK/uring_udp"
+cp "$WORK/uring" "$WORK/uring_shm"
+image uring.img -i 64 -d 256
+server -U -t -m "$PORT" uring.img
+grep -q "io_uring" "$WORK/fsserv.1.err" && { cat "$WORK/fsserv.1.err"; echo "t_uring: no io_uring"; exit 1; }
+run uring_udp localhost "$PORT" u &
+UDP=$!
+run uring_shm shm "$PORT" s &
+SHM=$!
+run uring "tcp:localhost" "$PORT" t || exit 1
+wait "$UDP" || exit 1
+wait "$SHM" || exit 1
+run uring localhost "$PORT" shutdown || exit 1
+wait "$SERVER"
+fsck uring.img
+echo "t_uring: ok"
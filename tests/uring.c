@@ -0,0 +1,70 @@
+// a client of an fsserv started with -U (t_uring.sh):
+//   uring host port prefix
+//     deferred and plain writes to files prefix0-3, with reads and MFS_Fsync
+//     calls in between, some with nothing left to sync
+//   uring host port shutdown
+#include <stdlib.h>
+#include <string.h>
+#include "mfs.h"
+#include "check.h"
+
+#define FILES (4)
+#define ROUNDS (6)
+
+static void fill(char *buf, int f, int b) {
+    for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+        buf[i] = 'a' + (f * 5 + b * 3 + i / 512) % 26;
+}
+
+int main(int argc, char *argv[]) {
+    char w[MFS_BLOCK_SIZE], r[MFS_BLOCK_SIZE], name[16];
+    int inum[FILES];
+    CHECK(MFS_Init(argv[1], atoi(argv[2])) == 0);
+    if (strcmp(argv[3], "shutdown") == 0) {
+        MFS_Shutdown();
+        return check_done();
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        sprintf(name, "%s%d", argv[3], f);
+        CHECK(MFS_Creat(0, MFS_REGULAR_FILE, name) == 0);
+        inum[f] = MFS_Lookup(0, name);
+        CHECK(inum[f] > 0);
+    }
+
+    // deferred writes in halves; reads and syncs of some files in between
+    MFS_WriteBack(1);
+    for (int b = 0; b < ROUNDS; b++) {
+        for (int f = 0; f < FILES; f++) {
+            fill(w, f, b);
+            CHECK(MFS_Write(inum[f], w, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE / 2) == 0);
+            CHECK(MFS_Write(inum[f], w + MFS_BLOCK_SIZE / 2, b * MFS_BLOCK_SIZE + MFS_BLOCK_SIZE / 2, MFS_BLOCK_SIZE / 2) == 0);
+        }
+        if (b % 2 == 1)
+            CHECK(MFS_Fsync(inum[0]) == 0);
+        fill(w, 1, b);
+        CHECK(MFS_Read(inum[1], r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+        CHECK(MFS_Fsync(inum[2]) == 0);
+        CHECK(MFS_Fsync(inum[2]) == 0); // nothing left to sync
+    }
+    MFS_WriteBack(0);
+
+    // plain writes join the same group commits
+    for (int f = 0; f < FILES; f++) {
+        fill(w, f, ROUNDS);
+        CHECK(MFS_Write(inum[f], w, ROUNDS * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0);
+    }
+    CHECK(MFS_Fsync(inum[3]) == 0);
+    for (int f = 0; f < FILES; f++) {
+        for (int b = 0; b <= ROUNDS; b++) {
+            fill(w, f, b);
+            CHECK(MFS_Read(inum[f], r, b * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) == 0 && memcmp(r, w, MFS_BLOCK_SIZE) == 0);
+        }
+    }
+
+    sprintf(name, "%s%d", argv[3], FILES - 1);
+    CHECK(MFS_Unlink(0, name) == 0);
+    CHECK(MFS_Creat(0, MFS_REGULAR_FILE, name) == 0);
+    CHECK(MFS_Fsync(inum[0]) == 0);
+    return check_done();
+}
@@ -31,7 +31,30 @@ typedef struct __super {
     int data_region_len;   // in blocks
     int num_inodes;        // just the number of inodes
     int num_data;          // and data blocks...
+    int checksum_addr;     // block address of the per-block CRC32C table (mkfs -c)
+    int checksum_len;      // in blocks; 0 when the image carries no checksums
+    int compress;          // 1: regular file blocks are stored compressed (mkfs -z)
+    int dedup;             // 1: regular files may share identical data blocks (mkfs -D)
+    int checksum_stale;    // 1 while fsserv has the image open for writing: after a crash the
+                           // checksum table may be out of step with the blocks it covers
 } super_t;
 
+//
+// a regular file's direct[] entry with the top bit set points at a compressed
+// block packed into part of a data block: a run of 256-byte sectors that
+// starts with the compressed length as a 16-bit word. entries without the bit
+// are plain data block indexes, as before.
+//
+#define UFS_PACKED (0x80000000u)
+#define UFS_SECTOR_SIZE (256)
+#define UFS_SECTORS (UFS_BLOCK_SIZE / UFS_SECTOR_SIZE)
+#define UFS_MAX_PACKED_BLOCKS ((1 << 27) - 1) // data blocks a packed entry can name
+
+#define UFS_PACK(blk, sector) (UFS_PACKED | (unsigned int)(blk) << 4 | (sector))
+#define UFS_PACKED_BLOCK(ptr) (((ptr) & ~UFS_PACKED) >> 4)
+#define UFS_PACKED_SECTOR(ptr) ((ptr) & 0xf)
+// sectors taken by a compressed block of clen bytes, header included
+#define UFS_PACKED_SECTORS(clen) (((clen) + 2 + UFS_SECTOR_SIZE - 1) / UFS_SECTOR_SIZE)
+
 
 #endif // __ufs_h__
\ No newline at end of file